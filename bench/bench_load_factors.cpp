@@ -30,6 +30,25 @@ namespace {
 
 using namespace poplar;
 
+// Searches all the keys, so that the displacements are decoded at the final load factor.
+template <class Map>
+double search(const Map& map, const std::string& key_name) {
+    std::ifstream ifs{key_name};
+    std::vector<std::string> keys;
+    for (std::string key; std::getline(ifs, key);) {
+        keys.push_back(key);
+    }
+
+    timer t;
+    for (const std::string& key : keys) {
+        if (map.find(make_char_range(key)) == nullptr) {
+            std::cerr << "critical error for search results" << std::endl;
+            exit(1);
+        }
+    }
+    return t.get<std::micro>() / keys.size();
+}
+
 template <class Map>
 void build(const std::string& key_name, uint32_t capa_bits, uint64_t lambda) {
     uint64_t process_size = get_process_size();
@@ -71,6 +90,8 @@ void build(const std::string& key_name, uint32_t capa_bits, uint64_t lambda) {
     show_stat(out, indent, "rss_bytes", process_size);
     show_stat(out, indent, "rss_MiB", process_size / (1024.0 * 1024.0));
 
+    show_stat(out, indent, "search_us_per_query", search(map, key_name));
+
     show_member(out, indent, "map");
     map.show_stats(out, 1);
 
@@ -93,36 +114,61 @@ int main(int argc, char* argv[]) {
     auto lambda = p.get<uint64_t>("lambda");
 
     using nlm_type = compact_bonsai_nlm<int, 16>;
+    using blk_type = block_dsp_table<>;
 
     using map_80_3_type = map<compact_bonsai_trie<80, 3>, nlm_type>;
     using map_85_3_type = map<compact_bonsai_trie<85, 3>, nlm_type>;
     using map_90_3_type = map<compact_bonsai_trie<90, 3>, nlm_type>;
     using map_95_3_type = map<compact_bonsai_trie<95, 3>, nlm_type>;
+    using map_80_3_blk_type = map<compact_bonsai_trie<80, 3, blk_type>, nlm_type>;
+    using map_85_3_blk_type = map<compact_bonsai_trie<85, 3, blk_type>, nlm_type>;
+    using map_90_3_blk_type = map<compact_bonsai_trie<90, 3, blk_type>, nlm_type>;
+    using map_95_3_blk_type = map<compact_bonsai_trie<95, 3, blk_type>, nlm_type>;
 
     using map_80_4_type = map<compact_bonsai_trie<80, 4>, nlm_type>;
     using map_85_4_type = map<compact_bonsai_trie<85, 4>, nlm_type>;
     using map_90_4_type = map<compact_bonsai_trie<90, 4>, nlm_type>;
     using map_95_4_type = map<compact_bonsai_trie<95, 4>, nlm_type>;
+    using map_80_4_blk_type = map<compact_bonsai_trie<80, 4, blk_type>, nlm_type>;
+    using map_85_4_blk_type = map<compact_bonsai_trie<85, 4, blk_type>, nlm_type>;
+    using map_90_4_blk_type = map<compact_bonsai_trie<90, 4, blk_type>, nlm_type>;
+    using map_95_4_blk_type = map<compact_bonsai_trie<95, 4, blk_type>, nlm_type>;
 
     using map_80_5_type = map<compact_bonsai_trie<80, 5>, nlm_type>;
     using map_85_5_type = map<compact_bonsai_trie<85, 5>, nlm_type>;
     using map_90_5_type = map<compact_bonsai_trie<90, 5>, nlm_type>;
     using map_95_5_type = map<compact_bonsai_trie<95, 5>, nlm_type>;
+    using map_80_5_blk_type = map<compact_bonsai_trie<80, 5, blk_type>, nlm_type>;
+    using map_85_5_blk_type = map<compact_bonsai_trie<85, 5, blk_type>, nlm_type>;
+    using map_90_5_blk_type = map<compact_bonsai_trie<90, 5, blk_type>, nlm_type>;
+    using map_95_5_blk_type = map<compact_bonsai_trie<95, 5, blk_type>, nlm_type>;
 
     build<map_80_3_type>(key_fn, capa_bits, lambda);
     build<map_85_3_type>(key_fn, capa_bits, lambda);
     build<map_90_3_type>(key_fn, capa_bits, lambda);
     build<map_95_3_type>(key_fn, capa_bits, lambda);
+    build<map_80_3_blk_type>(key_fn, capa_bits, lambda);
+    build<map_85_3_blk_type>(key_fn, capa_bits, lambda);
+    build<map_90_3_blk_type>(key_fn, capa_bits, lambda);
+    build<map_95_3_blk_type>(key_fn, capa_bits, lambda);
 
     build<map_80_4_type>(key_fn, capa_bits, lambda);
     build<map_85_4_type>(key_fn, capa_bits, lambda);
     build<map_90_4_type>(key_fn, capa_bits, lambda);
     build<map_95_4_type>(key_fn, capa_bits, lambda);
+    build<map_80_4_blk_type>(key_fn, capa_bits, lambda);
+    build<map_85_4_blk_type>(key_fn, capa_bits, lambda);
+    build<map_90_4_blk_type>(key_fn, capa_bits, lambda);
+    build<map_95_4_blk_type>(key_fn, capa_bits, lambda);
 
     build<map_80_5_type>(key_fn, capa_bits, lambda);
     build<map_85_5_type>(key_fn, capa_bits, lambda);
     build<map_90_5_type>(key_fn, capa_bits, lambda);
     build<map_95_5_type>(key_fn, capa_bits, lambda);
+    build<map_80_5_blk_type>(key_fn, capa_bits, lambda);
+    build<map_85_5_blk_type>(key_fn, capa_bits, lambda);
+    build<map_90_5_blk_type>(key_fn, capa_bits, lambda);
+    build<map_95_5_blk_type>(key_fn, capa_bits, lambda);
 
     return 0;
 }
@@ -57,6 +57,7 @@ int bench(const cmdline::parser& p) {
     auto lambda = p.get<uint64_t>("lambda");
     auto runs = p.get<int>("runs");
     auto detail = p.get<bool>("detail");
+    auto threads = p.get<uint32_t>("threads");
 
     uint64_t num_keys = 0, num_queries = 0;
     uint64_t ok = 0, ng = 0;
@@ -64,8 +65,11 @@ int bench(const cmdline::parser& p) {
 
     double insert_us_per_key = 0.0, search_us_per_query = 0.0;
     double best_insert_us_per_key = 0.0, best_search_us_per_query = 0.0;
+    double batch_insert_us_per_key = 0.0, batch_search_us_per_query = 0.0;
+    double best_batch_insert_us_per_key = 0.0, best_batch_search_us_per_query = 0.0;
 
     auto map = std::make_unique<Map>(capa_bits, lambda);
+    map->set_num_threads(threads);
     {
         std::ifstream ifs{key_fn};
         if (!ifs) {
@@ -120,10 +124,24 @@ int bench(const cmdline::parser& p) {
 
     {
         std::vector<double> insert_times(runs);
+        std::vector<double> batch_insert_times(runs);
         std::vector<double> search_times(runs);
+        std::vector<double> batch_search_times(runs);
+
+        std::vector<char_range> query_ranges(queries->size());
+        for (size_t j = 0; j < queries->size(); ++j) {
+            query_ranges[j] = make_char_range((*queries)[j]);
+        }
+        std::vector<const value_type*> ptrs(queries->size());
+
+        std::vector<char_range> key_ranges(keys->size());
+        for (size_t j = 0; j < keys->size(); ++j) {
+            key_ranges[j] = make_char_range((*keys)[j]);
+        }
 
         for (int i = 0; i < runs; ++i) {
             auto map = std::make_unique<Map>(capa_bits, lambda);
+            map->set_num_threads(threads);
 
             // insertion
             {
@@ -149,6 +167,39 @@ int bench(const cmdline::parser& p) {
                 search_times[i] = t.get<std::micro>() / queries->size();
             }
 
+            // batch insertion
+            {
+                auto batch_map = std::make_unique<Map>(capa_bits, lambda);
+                batch_map->set_num_threads(threads);
+                std::vector<value_type*> vptrs(keys->size());
+                timer t;
+                batch_map->update_batch(key_ranges.data(), key_ranges.size(), vptrs.data());
+                for (auto vptr : vptrs) {
+                    *vptr = 1;
+                }
+                batch_insert_times[i] = t.get<std::micro>() / keys->size();
+            }
+
+            // batch retrieval
+            {
+                timer t;
+                map->find_batch(query_ranges.data(), query_ranges.size(), ptrs.data());
+                batch_search_times[i] = t.get<std::micro>() / queries->size();
+            }
+
+            {
+                size_t _batch_ok = 0;
+                for (auto ptr : ptrs) {
+                    if (ptr != nullptr and *ptr == 1) {
+                        ++_batch_ok;
+                    }
+                }
+                if (_batch_ok != _ok) {
+                    std::cerr << "critical error for batch search results" << std::endl;
+                    return 1;
+                }
+            }
+
             if (i != 0) {
                 if ((ok != _ok) or (ng != _ng)) {
                     std::cerr << "critical error for search results" << std::endl;
@@ -166,6 +217,10 @@ int bench(const cmdline::parser& p) {
         best_insert_us_per_key = get_min(insert_times);
         search_us_per_query = get_average(search_times);
         best_search_us_per_query = get_min(search_times);
+        batch_insert_us_per_key = get_average(batch_insert_times);
+        best_batch_insert_us_per_key = get_min(batch_insert_times);
+        batch_search_us_per_query = get_average(batch_search_times);
+        best_batch_search_us_per_query = get_min(batch_search_times);
     }
 
     std::ostream& out = std::cout;
@@ -175,6 +230,7 @@ int bench(const cmdline::parser& p) {
     show_stat(out, indent, "key_fn", key_fn);
     show_stat(out, indent, "query_fn", query_fn);
     show_stat(out, indent, "init_capa_bits", capa_bits);
+    show_stat(out, indent, "threads", threads);
 
     show_stat(out, indent, "rss_bytes", process_size);
     show_stat(out, indent, "rss_MiB", process_size / (1024.0 * 1024.0));
@@ -187,6 +243,10 @@ int bench(const cmdline::parser& p) {
     show_stat(out, indent, "best_insert_us_per_key", best_insert_us_per_key);
     show_stat(out, indent, "search_us_per_query", search_us_per_query);
     show_stat(out, indent, "best_search_us_per_query", best_search_us_per_query);
+    show_stat(out, indent, "batch_insert_us_per_key", batch_insert_us_per_key);
+    show_stat(out, indent, "best_batch_insert_us_per_key", best_batch_insert_us_per_key);
+    show_stat(out, indent, "batch_search_us_per_query", batch_search_us_per_query);
+    show_stat(out, indent, "best_batch_search_us_per_query", best_batch_search_us_per_query);
 
     show_stat(out, indent, "ok", ok);
     show_stat(out, indent, "ng", ng);
@@ -213,6 +273,7 @@ int main(int argc, char* argv[]) {
     p.add<uint64_t>("lambda", 'l', "lambda", false, 32);
     p.add<int>("runs", 'r', "# of runs", false, 10);
     p.add<bool>("detail", 'd', "show detail stats?", false, false);
+    p.add<uint32_t>("threads", 'p', "# of threads for expansion (for pbm, scbm and cbm)", false, 1);
     p.parse_check(argc, argv);
 
     auto map_type = p.get<std::string>("map_type");
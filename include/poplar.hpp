@@ -24,6 +24,7 @@
 #ifndef POPLAR_TRIE_POPLAR_HPP
 #define POPLAR_TRIE_POPLAR_HPP
 
+#include "poplar/block_dsp_table.hpp"
 #include "poplar/compact_bonsai_trie.hpp"
 #include "poplar/compact_fkhash_trie.hpp"
 #include "poplar/plain_bonsai_trie.hpp"
@@ -34,7 +35,10 @@
 #include "poplar/plain_bonsai_nlm.hpp"
 #include "poplar/plain_fkhash_nlm.hpp"
 
+#include "poplar/frozen_map.hpp"
+#include "poplar/left_right_map.hpp"
 #include "poplar/map.hpp"
+#include "poplar/sharded_map.hpp"
 
 namespace poplar {
 
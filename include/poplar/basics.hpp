@@ -35,6 +35,18 @@
 
 #include "poplar_config.hpp"
 
+// On x86-64 with GCC or Clang, the kernels using the instruction set extensions beyond the baseline
+// (POPCNT, BMI2 and AVX2) are compiled with target attributes and selected at runtime, so one binary
+// built without -march=native still takes the faster paths on the CPUs supporting them.
+// Define POPLAR_DISABLE_CPU_DISPATCH to use only the extensions enabled at compile time.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(POPLAR_DISABLE_CPU_DISPATCH)
+#define POPLAR_CPU_DISPATCH
+#endif
+
+#if defined(__SSE2__) || defined(POPLAR_CPU_DISPATCH)
+#include <immintrin.h>
+#endif
+
 namespace poplar {
 
 using std::uint16_t;
@@ -44,6 +56,8 @@ using std::uint8_t;
 
 enum class trie_type_ids : uint8_t { BONSAI_TRIE, FKHASH_TRIE };
 
+// Range of the bytes of a key. The key is delimited by the length, and the end is regarded as a virtual
+// terminator, so the bytes are not needed to be followed by '\0' and may contain '\0'.
 struct char_range {
     const uint8_t* begin = nullptr;
     const uint8_t* end = nullptr;
@@ -59,13 +73,9 @@ struct char_range {
     }
 };
 
-inline char_range make_char_range(const char* str) {
-    auto ptr = reinterpret_cast<const uint8_t*>(str);
-    return {ptr, ptr + (std::strlen(str) + 1)};
-}
-inline char_range make_char_range(const std::string& str) {
-    auto ptr = reinterpret_cast<const uint8_t*>(str.c_str());
-    return {ptr, ptr + (str.size() + 1)};
+inline char_range make_char_range(std::string_view str) {
+    auto ptr = reinterpret_cast<const uint8_t*>(str.data());
+    return {ptr, ptr + str.size()};
 }
 
 constexpr bool is_power2(uint64_t n) {
@@ -85,6 +95,92 @@ constexpr void copy_bytes(uint8_t* dst, const uint8_t* src, uint64_t num) {
     }
 }
 
+// Instruction set extensions of the running CPU used by the dispatched kernels.
+struct cpu_features {
+    bool popcnt = false;
+    bool bmi2 = false;  // only if PDEP/PEXT are fast, i.e., not microcoded as on AMD Zen 1 and 2
+    bool avx2 = false;
+};
+
+inline cpu_features detect_cpu_features() {
+    cpu_features features;
+#ifdef POPLAR_CPU_DISPATCH
+    __builtin_cpu_init();
+    features.popcnt = __builtin_cpu_supports("popcnt");
+    features.bmi2 = __builtin_cpu_supports("bmi2") and !__builtin_cpu_is("znver1") and !__builtin_cpu_is("znver2");
+    features.avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return features;
+}
+
+// Detected once at startup. Until then, e.g., in static initializers of other translation units, every flag is
+// zero-initialized to false and the portable paths are taken.
+inline const cpu_features host_cpu = detect_cpu_features();
+
+#if defined(POPLAR_CPU_DISPATCH) && !defined(__AVX2__)
+__attribute__((target("avx2"))) inline uint64_t find_mismatch_avx2_(const uint8_t* x, const uint8_t* y,
+                                                                    uint64_t n) {
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+        const uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < n; ++i) {
+        if (x[i] != y[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+#endif
+
+// Gets the first position i such that x[i] != y[i] in [0, n), or n if not found.
+// Blocks of 32 (AVX2) or 16 (SSE2) bytes are compared at once, while no byte beyond x[n-1] and y[n-1] is
+// loaded until a mismatch is found in the block. Without AVX2 enabled at compile time, the AVX2 loop is
+// dispatched at runtime only for n >= 32, so short labels are compared inline.
+inline uint64_t find_mismatch(const uint8_t* x, const uint8_t* y, uint64_t n) {
+    uint64_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+        const uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(POPLAR_CPU_DISPATCH)
+    if (32 <= n and host_cpu.avx2) {
+        return find_mismatch_avx2_(x, y, n);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+        const uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))) & 0xFFFFU;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (x[i] != y[i]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Hints the processor to load the cache line including addr in advance.
+inline void prefetch_address(const void* addr) {
+    __builtin_prefetch(addr);
+}
+
 // <quo, mod>
 template <uint64_t N>
 constexpr std::pair<uint64_t, uint64_t> decompose_value(uint64_t x) {
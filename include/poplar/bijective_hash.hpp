@@ -25,6 +25,7 @@
 #define POPLAR_TRIE_BIJECTIVE_HASH_HPP
 
 #include "basics.hpp"
+#include "io_tools.hpp"
 
 namespace poplar::bijective_hash {
 
@@ -132,6 +133,20 @@ class split_mix_hasher {
         return univ_size_.bits();
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, univ_size_.bits());
+    }
+    void load(std::istream& is) {
+        const uint64_t univ_bits = io_tools::load_value(is);
+        POPLAR_THROW_IF(64 <= univ_bits, "The serialized data is broken.");
+        *this = univ_bits == 0 ? split_mix_hasher{} : split_mix_hasher{static_cast<uint32_t>(univ_bits)};
+    }
+    void load_view(io_tools::mapper& mapper) {
+        const uint64_t univ_bits = mapper.map_value();
+        POPLAR_THROW_IF(64 <= univ_bits, "The serialized data is broken.");
+        *this = univ_bits == 0 ? split_mix_hasher{} : split_mix_hasher{static_cast<uint32_t>(univ_bits)};
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "split_mix_hasher");
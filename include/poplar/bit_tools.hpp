@@ -24,10 +24,6 @@
 #ifndef POPLAR_TRIE_BIT_TOOLS_HPP
 #define POPLAR_TRIE_BIT_TOOLS_HPP
 
-#ifdef __SSE4_2__
-#include <xmmintrin.h>
-#endif
-
 #include "basics.hpp"
 
 namespace poplar::bit_tools {
@@ -100,26 +96,45 @@ inline uint64_t popcnt(uint8_t x) {
 inline uint64_t popcnt(uint16_t x) {
     return POPCNT_TABLE[x & UINT8_MAX] + POPCNT_TABLE[x >> 8];
 }
-inline uint64_t popcnt(uint32_t x) {
-#ifdef __SSE4_2__
-    return static_cast<uint64_t>(__builtin_popcount(x));
-#else
+inline uint64_t popcnt_portable_(uint32_t x) {
     x = (x & 0x55555555U) + ((x & 0xAAAAAAAAU) >> 1);
     x = (x & 0x33333333U) + ((x & 0xCCCCCCCCU) >> 2);
     x = (x & 0x0F0F0F0FU) + ((x & 0xF0F0F0F0U) >> 4);
     x *= 0x01010101U;
     return x >> 24;
-#endif
 }
-inline uint64_t popcnt(uint64_t x) {
-#ifdef __SSE4_2__
-    return static_cast<uint64_t>(__builtin_popcountll(x));
-#else
+inline uint64_t popcnt_portable_(uint64_t x) {
     x = (x & 0x5555555555555555ULL) + ((x & 0xAAAAAAAAAAAAAAAAULL) >> 1);
     x = (x & 0x3333333333333333ULL) + ((x & 0xCCCCCCCCCCCCCCCCULL) >> 2);
     x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x & 0xF0F0F0F0F0F0F0F0ULL) >> 4);
     x *= 0x0101010101010101ULL;
     return x >> 56;
+}
+#if defined(POPLAR_CPU_DISPATCH) && !defined(__POPCNT__)
+__attribute__((target("popcnt"))) inline uint64_t popcnt_hw_(uint32_t x) {
+    return static_cast<uint64_t>(__builtin_popcount(x));
+}
+__attribute__((target("popcnt"))) inline uint64_t popcnt_hw_(uint64_t x) {
+    return static_cast<uint64_t>(__builtin_popcountll(x));
+}
+#endif
+
+inline uint64_t popcnt(uint32_t x) {
+#if defined(__POPCNT__)
+    return static_cast<uint64_t>(__builtin_popcount(x));
+#elif defined(POPLAR_CPU_DISPATCH)
+    return host_cpu.popcnt ? popcnt_hw_(x) : popcnt_portable_(x);
+#else
+    return popcnt_portable_(x);
+#endif
+}
+inline uint64_t popcnt(uint64_t x) {
+#if defined(__POPCNT__)
+    return static_cast<uint64_t>(__builtin_popcountll(x));
+#elif defined(POPLAR_CPU_DISPATCH)
+    return host_cpu.popcnt ? popcnt_hw_(x) : popcnt_portable_(x);
+#else
+    return popcnt_portable_(x);
 #endif
 }
 
@@ -224,9 +239,9 @@ constexpr uint8_t LT_SEL[256 * 8] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7};
 
 // From sdsl-lite (https://github.com/simongog/sdsl-lite)
-constexpr uint64_t select(uint64_t x, uint64_t i) {
+inline uint64_t select_portable_(uint64_t x, uint64_t i) {
     assert(i != 0);
-#ifdef __SSE4_2__
+#ifdef __GNUC__
     uint64_t s = x;
     s = s - ((s >> 1) & 0x5555555555555555ULL);
     s = (s & 0x3333333333333333ULL) + ((s >> 2) & 0x3333333333333333ULL);
@@ -271,7 +286,26 @@ constexpr uint64_t select(uint64_t x, uint64_t i) {
 #endif
 }
 
-#ifndef __SSE4_2__
+#if defined(POPLAR_CPU_DISPATCH) && !defined(__BMI2__)
+__attribute__((target("bmi2"))) inline uint64_t select_bmi2_(uint64_t x, uint64_t i) {
+    return static_cast<uint64_t>(__builtin_ctzll(_pdep_u64(1ULL << (i - 1), x)));
+}
+#endif
+
+// Gets the position of the i-th 1 (i >= 1) in x, where x has at least i 1s.
+// With BMI2, the i-th 1 is deposited by PDEP and located by counting the trailing zeros.
+inline uint64_t select(uint64_t x, uint64_t i) {
+    assert(i != 0);
+#if defined(__BMI2__)
+    return static_cast<uint64_t>(__builtin_ctzll(_pdep_u64(1ULL << (i - 1), x)));
+#elif defined(POPLAR_CPU_DISPATCH)
+    return host_cpu.bmi2 ? select_bmi2_(x, i) : select_portable_(x, i);
+#else
+    return select_portable_(x, i);
+#endif
+}
+
+#ifndef __GNUC__
 constexpr uint32_t MSB_TABLE[256] = {
     0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5,
     5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
@@ -283,7 +317,7 @@ constexpr uint32_t MSB_TABLE[256] = {
 #endif
 
 constexpr uint32_t msb(uint64_t x) {
-#ifdef __SSE4_2__
+#ifdef __GNUC__
     return x == 0 ? 0 : 63 - __builtin_clzll(x);
 #else
     uint64_t x1 = x >> 32;
@@ -27,6 +27,7 @@
 #include <vector>
 
 #include "bit_tools.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
@@ -103,6 +104,16 @@ class bit_vector {
         return size_;
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, size_);
+        io_tools::save_vector(os, chunks_);
+    }
+    void load(std::istream& is) {
+        size_ = io_tools::load_value(is);
+        io_tools::load_vector(is, chunks_);
+        POPLAR_THROW_IF(chunks_.size() != bit_tools::words_for(size_), "The serialized data is broken.");
+    }
+
     bit_vector(const bit_vector&) = delete;
     bit_vector& operator=(const bit_vector&) = delete;
 
@@ -0,0 +1,249 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_BLOCK_DSP_TABLE_HPP
+#define POPLAR_TRIE_BLOCK_DSP_TABLE_HPP
+
+#include <algorithm>
+#include <vector>
+
+#include "bit_tools.hpp"
+#include "exception.hpp"
+#include "io_tools.hpp"
+#include "standard_hash_table.hpp"
+
+namespace poplar {
+
+// Map from slot IDs to small values, used as AuxCht of the compact tries in place of compact_hash_table.
+// The universe of slot IDs is partitioned into blocks of 64 slots, and each block has a record of BlockWords
+// words in one cache line: a 64-bit flag vector of the registered slots followed by an area holding the values
+// of the first area_size registered slots in slot order. A value is located by the rank of the slot in the
+// flags, so get() reads one cache line without hashing. The values of the slots ranked after the area are
+// stored in SpillMap, which is rarely accessed unless the displacements concentrate in a block.
+template <uint32_t ValBits = 7, uint32_t BlockWords = 4, class SpillMap = standard_hash_table<>>
+class block_dsp_table {
+    static_assert(0 < ValBits and ValBits < 64);
+    static_assert(BlockWords == 2 or BlockWords == 4 or BlockWords == 8);
+
+  public:
+    using this_type = block_dsp_table<ValBits, BlockWords, SpillMap>;
+    using spill_map_type = SpillMap;
+
+    static constexpr uint32_t val_bits = ValBits;
+    static constexpr uint64_t val_mask = (1ULL << ValBits) - 1;
+    static constexpr uint64_t nil = UINT64_MAX;
+
+    static constexpr uint64_t block_bits = 64;
+    static constexpr uint64_t area_size = (BlockWords - 1) * 64 / ValBits;
+
+  public:
+    block_dsp_table() = default;
+
+    // The capacity is determined by the universe, so capa_bits is ignored.
+    explicit block_dsp_table(uint32_t univ_bits, uint32_t capa_bits = 0) {
+        static_cast<void>(capa_bits);
+        POPLAR_THROW_IF(64 <= univ_bits, "univ_bits overflow.");
+
+        univ_bits_ = univ_bits;
+        allocate_(std::max<uint64_t>(1, (1ULL << univ_bits) / block_bits) * BlockWords);
+    }
+
+    ~block_dsp_table() = default;
+
+    uint64_t get(uint64_t key) const {
+        assert(key < univ_size());
+
+        const uint64_t* block = &data_[key / block_bits * BlockWords];
+        const uint64_t bit = key % block_bits;
+
+        if (!bit_tools::get_bit(block[0], bit)) {
+            return nil;
+        }
+        const uint64_t rank = bit_tools::popcnt(block[0], bit);
+        if (rank < area_size) {
+            return get_val_(block, rank);
+        }
+        return spill_map_.get(key);
+    }
+
+    bool set(uint64_t key, uint64_t val) {
+        assert(key < univ_size());
+        assert(val < val_mask);
+        assert(!is_view());
+
+        uint64_t* block = &words_[key / block_bits * BlockWords];
+        const uint64_t bit = key % block_bits;
+        const uint64_t flags = block[0];
+        const uint64_t rank = bit_tools::popcnt(flags, bit);
+
+        if (bit_tools::get_bit(flags, bit)) {  // already registered?
+            if (rank < area_size) {
+                set_val_(block, rank, val);
+            } else {
+                spill_map_.set(key, val);
+            }
+            return false;
+        }
+
+        if (rank < area_size) {
+            const uint64_t num = bit_tools::popcnt(flags);
+            if (area_size <= num) {
+                // the last value in the area is pushed out to the spill map
+                const uint64_t last_key = key - bit + bit_tools::select(flags, area_size);
+                spill_map_.set(last_key, get_val_(block, area_size - 1));
+            }
+            for (uint64_t j = std::min(num, area_size - 1); j > rank; --j) {
+                set_val_(block, j, get_val_(block, j - 1));
+            }
+            set_val_(block, rank, val);
+        } else {
+            spill_map_.set(key, val);
+        }
+
+        block[0] |= 1ULL << bit;
+        ++size_;
+        return true;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+    uint64_t univ_size() const {
+        return 1ULL << univ_bits_;
+    }
+    uint32_t univ_bits() const {
+        return univ_bits_;
+    }
+    uint64_t num_blocks() const {
+        return num_words_ / BlockWords;
+    }
+    // # of values stored in the spill map
+    uint64_t spill_size() const {
+        return spill_map_.size();
+    }
+    // Whether the blocks are a read-only view over mapped bytes.
+    bool is_view() const {
+        return data_ != words_;
+    }
+    uint64_t alloc_bytes() const {
+        return chunks_.capacity() * sizeof(uint64_t) + spill_map_.alloc_bytes();
+    }
+
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, univ_bits_);
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, num_words_);
+        io_tools::save_bytes(os, data_, num_words_ * sizeof(uint64_t));
+        spill_map_.save(os);
+    }
+    void load(std::istream& is) {
+        const uint64_t univ_bits = io_tools::load_value(is);
+        const uint64_t size = io_tools::load_value(is);
+        const uint64_t num_words = io_tools::load_value(is);
+        POPLAR_THROW_IF(64 <= univ_bits or num_words % BlockWords != 0, "The serialized data is broken.");
+        *this = this_type{};
+        univ_bits_ = static_cast<uint32_t>(univ_bits);
+        size_ = size;
+        allocate_(num_words);
+        io_tools::load_bytes(is, words_, num_words * sizeof(uint64_t));
+        spill_map_.load(is);
+    }
+    // Makes the blocks a read-only view over the bytes written by save(), without copying them.
+    // The blocks are not aligned to cache lines unless the mapped bytes are 64-byte aligned.
+    void load_view(io_tools::mapper& mapper) {
+        const uint64_t univ_bits = mapper.map_value();
+        const uint64_t size = mapper.map_value();
+        const uint64_t num_words = mapper.map_value();
+        POPLAR_THROW_IF(64 <= univ_bits or num_words % BlockWords != 0, "The serialized data is broken.");
+        *this = this_type{};
+        univ_bits_ = static_cast<uint32_t>(univ_bits);
+        size_ = size;
+        num_words_ = num_words;
+        data_ = mapper.map_array<uint64_t>(num_words);
+        spill_map_.load_view(mapper);
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "block_dsp_table");
+        show_stat(os, indent, "val_bits", val_bits);
+        show_stat(os, indent, "block_words", BlockWords);
+        show_stat(os, indent, "area_size", area_size);
+        show_stat(os, indent, "size", size());
+        show_stat(os, indent, "univ_size", univ_size());
+        show_stat(os, indent, "num_blocks", num_blocks());
+        show_stat(os, indent, "spill_size", spill_size());
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_member(os, indent, "spill_map_");
+        spill_map_.show_stats(os, n + 1);
+    }
+
+    block_dsp_table(const block_dsp_table&) = delete;
+    block_dsp_table& operator=(const block_dsp_table&) = delete;
+
+    block_dsp_table(block_dsp_table&&) noexcept = default;
+    block_dsp_table& operator=(block_dsp_table&&) noexcept = default;
+
+  private:
+    static constexpr uint64_t line_words = 8;
+
+    std::vector<uint64_t> chunks_;
+    uint64_t* words_ = nullptr;  // the first 64-byte aligned word of chunks_
+    const uint64_t* data_ = nullptr;  // words_ or the mapped bytes
+    uint64_t num_words_ = 0;
+    uint64_t size_ = 0;
+    uint32_t univ_bits_ = 0;
+    spill_map_type spill_map_;
+
+    void allocate_(uint64_t num_words) {
+        chunks_.resize(num_words + line_words - 1, 0);
+        const uint64_t misalign = reinterpret_cast<uintptr_t>(chunks_.data()) / sizeof(uint64_t) % line_words;
+        words_ = chunks_.data() + (line_words - misalign) % line_words;
+        data_ = words_;
+        num_words_ = num_words;
+    }
+
+    // The j-th value of the area starts at bit 64 + j * ValBits of the block.
+    static uint64_t get_val_(const uint64_t* block, uint64_t j) {
+        auto [quo, mod] = decompose_value<64>(64 + j * ValBits);
+        uint64_t x = block[quo] >> mod;
+        if (64 < mod + ValBits) {
+            x |= block[quo + 1] << (64 - mod);
+        }
+        return x & val_mask;
+    }
+    static void set_val_(uint64_t* block, uint64_t j, uint64_t v) {
+        auto [quo, mod] = decompose_value<64>(64 + j * ValBits);
+        block[quo] &= ~(val_mask << mod);
+        block[quo] |= v << mod;
+        if (64 < mod + ValBits) {
+            const uint64_t diff = 64 - mod;
+            block[quo + 1] &= ~(val_mask >> diff);
+            block[quo + 1] |= v >> diff;
+        }
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_BLOCK_DSP_TABLE_HPP
@@ -0,0 +1,236 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_BUCKET_VECTOR_HPP
+#define POPLAR_TRIE_BUCKET_VECTOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "bit_tools.hpp"
+#include "exception.hpp"
+#include "io_tools.hpp"
+
+namespace poplar {
+
+// Vector of records consisting of NumFields integers of fixed widths, packed into buckets of 64 bytes, i.e.,
+// cache lines. Every bucket holds the same # of records, and no record crosses the boundary of buckets, so
+// all the fields of a record are read from one cache line. In a bucket, the values of each field are arranged
+// consecutively. The unused bits at the tail of each bucket are less than the bits of a record.
+template <uint32_t NumFields>
+class bucket_vector {
+  public:
+    static constexpr uint64_t bucket_words = 8;
+    static constexpr uint64_t bucket_bits = bucket_words * 64;
+    // The bucket of a record is computed by a multiplication valid for 32-bit record IDs.
+    static constexpr uint64_t max_size = 1ULL << 32;
+
+    // A bucket holds at least two records, which keeps the divisor of get_bucket_() in 64 bits.
+    static_assert(0 < NumFields and NumFields * 63 <= bucket_bits / 2);
+
+  public:
+    bucket_vector() = default;
+
+    bucket_vector(uint64_t size, const std::array<uint32_t, NumFields>& widths) {
+        POPLAR_THROW_IF(max_size < size, "size overflow.");
+
+        uint64_t record_bits = 0;
+        for (uint32_t f = 0; f < NumFields; ++f) {
+            POPLAR_THROW_IF(64 <= widths[f], "width overflow.");
+            widths_[f] = widths[f];
+            masks_[f] = (1ULL << widths[f]) - 1;
+            record_bits += widths[f];
+        }
+        POPLAR_THROW_IF(record_bits == 0 or bucket_bits < record_bits, "The record does not fit in a bucket.");
+
+        size_ = size;
+        bucket_size_ = bucket_bits / record_bits;
+        divisor_ = UINT64_MAX / bucket_size_ + 1;
+        for (uint32_t f = 0, offset = 0; f < NumFields; ++f) {
+            offsets_[f] = offset;
+            offset += bucket_size_ * widths_[f];
+        }
+        allocate_(num_buckets() * bucket_words);
+    }
+
+    ~bucket_vector() = default;
+
+    uint64_t get(uint64_t i, uint32_t f) const {
+        assert(i < size_);
+        assert(f < NumFields);
+
+        auto [quo, mod] = decompose_value<64>(get_pos_(i, f));
+
+        if (mod + widths_[f] <= 64) {
+            return (data_[quo] >> mod) & masks_[f];
+        } else {
+            return ((data_[quo] >> mod) | (data_[quo + 1] << (64 - mod))) & masks_[f];
+        }
+    }
+
+    void set(uint64_t i, uint32_t f, uint64_t v) {
+        assert(i < size_);
+        assert(f < NumFields);
+        assert(v <= masks_[f]);
+        assert(!is_view());
+
+        auto [quo, mod] = decompose_value<64>(get_pos_(i, f));
+        const uint64_t mask = masks_[f];
+
+        words_[quo] &= ~(mask << mod);
+        words_[quo] |= v << mod;
+
+        if (64 < mod + widths_[f]) {
+            const uint64_t diff = 64 - mod;
+            words_[quo + 1] &= ~(mask >> diff);
+            words_[quo + 1] |= v >> diff;
+        }
+    }
+
+    // Sets field f of all the records to v, keeping the other fields. Field f is filled in the first bucket,
+    // and its bit range is copied to the others through per-word masks.
+    void fill(uint32_t f, uint64_t v) {
+        assert(f < NumFields);
+        assert(v <= masks_[f]);
+        assert(!is_view());
+
+        if (size_ == 0) {
+            return;
+        }
+        for (uint64_t j = 0; j < std::min(bucket_size_, size_); ++j) {
+            set(j, f, v);
+        }
+
+        // the bits of [begin, end) in each word of a bucket
+        const uint64_t begin = offsets_[f], end = offsets_[f] + bucket_size_ * widths_[f];
+        std::array<uint64_t, bucket_words> word_masks = {};
+        for (uint64_t k = 0; k < bucket_words; ++k) {
+            const uint64_t lo = std::max(begin, k * 64), hi = std::min(end, k * 64 + 64);
+            if (lo < hi) {
+                const uint64_t len = hi - lo;
+                word_masks[k] = (len == 64 ? UINT64_MAX : (1ULL << len) - 1) << (lo - k * 64);
+            }
+        }
+        for (uint64_t i = bucket_words; i < num_buckets() * bucket_words; ++i) {
+            const uint64_t mask = word_masks[i % bucket_words];
+            words_[i] = (words_[i] & ~mask) | (words_[i % bucket_words] & mask);
+        }
+    }
+
+    // Prefetches the bucket of the i-th record.
+    void prefetch(uint64_t i) const {
+        assert(i < size_);
+        prefetch_address(&data_[get_bucket_(i) * bucket_words]);
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+    uint32_t width(uint32_t f) const {
+        return widths_[f];
+    }
+    // # of records in a bucket
+    uint64_t bucket_size() const {
+        return bucket_size_;
+    }
+    uint64_t num_buckets() const {
+        return bucket_size_ == 0 ? 0 : (size_ + bucket_size_ - 1) / bucket_size_;
+    }
+    // Whether the vector is a read-only view over mapped bytes.
+    bool is_view() const {
+        return data_ != words_;
+    }
+    uint64_t alloc_bytes() const {
+        return chunks_.capacity() * sizeof(uint64_t);
+    }
+
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, size_);
+        for (uint32_t f = 0; f < NumFields; ++f) {
+            io_tools::save_value(os, widths_[f]);
+        }
+        io_tools::save_bytes(os, data_, num_buckets() * bucket_words * sizeof(uint64_t));
+    }
+    void load(std::istream& is) {
+        *this = bucket_vector{io_tools::load_value(is), load_widths_([&]() { return io_tools::load_value(is); })};
+        io_tools::load_bytes(is, words_, num_buckets() * bucket_words * sizeof(uint64_t));
+    }
+    // Makes the vector a read-only view over the bytes written by save(), without copying them.
+    // The buckets are not aligned to cache lines unless the mapped bytes are 64-byte aligned.
+    void load_view(io_tools::mapper& mapper) {
+        const uint64_t size = mapper.map_value();
+        *this = bucket_vector{0, load_widths_([&]() { return mapper.map_value(); })};
+        chunks_ = std::vector<uint64_t>{};
+        words_ = nullptr;
+        size_ = size;
+        data_ = mapper.map_array<uint64_t>(num_buckets() * bucket_words);
+    }
+
+    bucket_vector(const bucket_vector&) = delete;
+    bucket_vector& operator=(const bucket_vector&) = delete;
+
+    bucket_vector(bucket_vector&&) noexcept = default;
+    bucket_vector& operator=(bucket_vector&&) noexcept = default;
+
+  private:
+    std::vector<uint64_t> chunks_;
+    uint64_t* words_ = nullptr;  // the first 64-byte aligned word of chunks_
+    const uint64_t* data_ = nullptr;  // words_ or the mapped bytes
+    uint64_t size_ = 0;
+    uint64_t bucket_size_ = 0;
+    uint64_t divisor_ = 0;  // ceil(2**64 / bucket_size_)
+    std::array<uint64_t, NumFields> widths_ = {};
+    std::array<uint64_t, NumFields> masks_ = {};
+    std::array<uint64_t, NumFields> offsets_ = {};  // bit offsets of the fields in a bucket
+
+    void allocate_(uint64_t num_words) {
+        chunks_.resize(num_words + bucket_words - 1, 0);
+        const uint64_t misalign = reinterpret_cast<uintptr_t>(chunks_.data()) / sizeof(uint64_t) % bucket_words;
+        words_ = chunks_.data() + (bucket_words - misalign) % bucket_words;
+        data_ = words_;
+    }
+
+    template <class LoadValue>
+    static std::array<uint32_t, NumFields> load_widths_(LoadValue load_value) {
+        std::array<uint32_t, NumFields> widths = {};
+        for (uint32_t f = 0; f < NumFields; ++f) {
+            widths[f] = static_cast<uint32_t>(load_value());
+        }
+        return widths;
+    }
+
+    // Computes i / bucket_size_ as (i * divisor_) >> 64, which is exact for i < 2**32.
+    uint64_t get_bucket_(uint64_t i) const {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(divisor_) * i) >> 64);
+    }
+    uint64_t get_pos_(uint64_t i, uint32_t f) const {
+        const uint64_t bucket_id = get_bucket_(i);
+        const uint64_t pos_in_bucket = i - bucket_id * bucket_size_;
+        return bucket_id * bucket_bits + offsets_[f] + pos_in_bucket * widths_[f];
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_BUCKET_VECTOR_HPP
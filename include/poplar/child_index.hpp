@@ -0,0 +1,165 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_CHILD_INDEX_HPP
+#define POPLAR_TRIE_CHILD_INDEX_HPP
+
+#include <algorithm>
+
+#include "compact_vector.hpp"
+#include "io_tools.hpp"
+
+namespace poplar {
+
+// Links from each node to its first child and next sibling, used to enumerate the children of a node
+// whose IDs are hashed. Node ID 0 indicates none, since it is never a child in either trie type
+// (the empty slot of Bonsai tries or the root of FK-hash tries).
+// The capacity follows the node IDs: grown by add() for FK-hash tries and remapped by expand()
+// for Bonsai tries.
+class child_index {
+  public:
+    static constexpr uint64_t nil_id = 0;
+
+  public:
+    child_index() = default;
+
+    explicit child_index(uint32_t capa_bits)
+        : firsts_(1ULL << capa_bits, capa_bits), nexts_(1ULL << capa_bits, capa_bits) {}
+
+    ~child_index() = default;
+
+    // Registers child as the first child of parent.
+    void add(uint64_t parent, uint64_t child) {
+        assert(child != nil_id);
+
+        while (firsts_.size() <= std::max(parent, child)) {
+            grow_();
+        }
+        nexts_.set(child, firsts_[parent]);
+        firsts_.set(parent, child);
+    }
+
+    // Unlinks child from the children of parent.
+    void remove(uint64_t parent, uint64_t child) {
+        assert(child != nil_id);
+
+        const uint64_t next = nexts_[child];
+        if (firsts_[parent] == child) {
+            firsts_.set(parent, next);
+        } else {
+            uint64_t prev = firsts_[parent];
+            while (nexts_[prev] != child) {
+                assert(prev != nil_id);
+                prev = nexts_[prev];
+            }
+            nexts_.set(prev, next);
+        }
+        nexts_.set(child, nil_id);
+    }
+
+    uint64_t first_child(uint64_t node_id) const {
+        return node_id < firsts_.size() ? firsts_[node_id] : nil_id;
+    }
+    uint64_t next_sibling(uint64_t node_id) const {
+        return node_id < nexts_.size() ? nexts_[node_id] : nil_id;
+    }
+
+    // Remaps the node IDs by node_map after the Bonsai trie is expanded to 2**capa_bits slots.
+    template <typename T>
+    void expand(const T& node_map, uint32_t capa_bits) {
+        *this = build_expanded(node_map, capa_bits);
+    }
+
+    // Builds the index remapped as expand(), but leaves this index unchanged.
+    template <typename T>
+    child_index build_expanded(const T& node_map, uint32_t capa_bits) const {
+        const auto remap = [&](uint64_t node_id) { return node_id == nil_id ? nil_id : node_map[node_id]; };
+
+        child_index new_index{capa_bits};
+        for (uint64_t i = 0; i < node_map.size(); ++i) {
+            const uint64_t new_id = node_map[i];
+            if (new_id == UINT64_MAX) {
+                continue;
+            }
+            new_index.firsts_.set(new_id, remap(firsts_[i]));
+            new_index.nexts_.set(new_id, remap(nexts_[i]));
+        }
+        return new_index;
+    }
+
+    uint64_t size() const {
+        return firsts_.size();
+    }
+    uint64_t alloc_bytes() const {
+        return firsts_.alloc_bytes() + nexts_.alloc_bytes();
+    }
+
+    void save(std::ostream& os) const {
+        firsts_.save(os);
+        nexts_.save(os);
+    }
+    void load(std::istream& is) {
+        firsts_.load(is);
+        nexts_.load(is);
+        POPLAR_THROW_IF(firsts_.size() != nexts_.size(), "The serialized data is broken.");
+    }
+    void load_view(io_tools::mapper& mapper) {
+        firsts_.load_view(mapper);
+        nexts_.load_view(mapper);
+        POPLAR_THROW_IF(firsts_.size() != nexts_.size(), "The serialized data is broken.");
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "child_index");
+        show_stat(os, indent, "size", size());
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+    }
+
+    child_index(const child_index&) = delete;
+    child_index& operator=(const child_index&) = delete;
+
+    child_index(child_index&&) noexcept = default;
+    child_index& operator=(child_index&&) noexcept = default;
+
+  private:
+    compact_vector firsts_;
+    compact_vector nexts_;
+
+    // Doubles the capacity keeping the node IDs.
+    void grow_() {
+        const uint32_t capa_bits = firsts_.width() + 1;
+        child_index new_index{capa_bits};
+        auto first_it = firsts_.begin();
+        auto next_it = nexts_.begin();
+        for (uint64_t i = 0; i < firsts_.size(); ++i, ++first_it, ++next_it) {
+            new_index.firsts_.set(i, *first_it);
+            new_index.nexts_.set(i, *next_it);
+        }
+        *this = std::move(new_index);
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_CHILD_INDEX_HPP
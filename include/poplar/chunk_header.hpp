@@ -0,0 +1,95 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_CHUNK_HEADER_HPP
+#define POPLAR_TRIE_CHUNK_HEADER_HPP
+
+#include "vbyte.hpp"
+
+// Offset index put at the head of a chunk of vbyte-prefixed labels, so that the i-th label is
+// reached without decoding the preceding ones. For a chunk of n labels, the header consists of
+// the width w (1, 2 or 4) in one byte and the offsets of the 2nd to n-th labels from the end of the
+// header in w bytes each.
+namespace poplar::chunk_header {
+
+inline uint8_t width(uint64_t data_bytes) {
+    return data_bytes <= UINT8_MAX ? 1 : (data_bytes <= UINT16_MAX ? 2 : 4);
+}
+
+// Gets the header bytes of a chunk of num_labels labels of data_bytes bytes in total.
+inline uint64_t size(uint64_t num_labels, uint64_t data_bytes) {
+    assert(num_labels != 0);
+    return 1 + (num_labels - 1) * width(data_bytes);
+}
+
+// Gets the header bytes of the chunk.
+inline uint64_t size(const uint8_t* chunk, uint64_t num_labels) {
+    assert(num_labels != 0);
+    return 1 + (num_labels - 1) * chunk[0];
+}
+
+// Gets the offset of the i-th label from the end of the header.
+inline uint64_t get_offset(const uint8_t* chunk, uint64_t i) {
+    if (i == 0) {
+        return 0;
+    }
+    uint64_t offset = 0;
+    std::memcpy(&offset, chunk + (1 + (i - 1) * chunk[0]), chunk[0]);
+    return offset;
+}
+
+// Gets the pointer to the i-th label.
+inline const uint8_t* get_label(const uint8_t* chunk, uint64_t num_labels, uint64_t i) {
+    return chunk + size(chunk, num_labels) + get_offset(chunk, i);
+}
+
+// Gets the total bytes of the labels following the header.
+inline uint64_t get_data_bytes(const uint8_t* chunk, uint64_t num_labels) {
+    const uint64_t offset = get_offset(chunk, num_labels - 1);
+    const uint8_t* ptr = chunk + size(chunk, num_labels) + offset;
+    uint64_t alloc = 0;
+    uint64_t vsize = vbyte::decode(ptr, alloc);
+    return offset + vsize + alloc;
+}
+
+// Writes the header of the labels placed at chunk + size(num_labels, data_bytes).
+inline void write(uint8_t* chunk, uint64_t num_labels, uint64_t data_bytes) {
+    const uint8_t w = width(data_bytes);
+    chunk[0] = w;
+
+    uint8_t* head = chunk + 1;
+    const uint8_t* data = chunk + size(num_labels, data_bytes);
+
+    uint64_t offset = 0, alloc = 0;
+    for (uint64_t i = 1; i < num_labels; ++i) {
+        offset += vbyte::decode(data + offset, alloc);
+        offset += alloc;
+        std::memcpy(head, &offset, w);  // little endian
+        head += w;
+    }
+    assert(offset < data_bytes);
+}
+
+}  // namespace poplar::chunk_header
+
+#endif  // POPLAR_TRIE_CHUNK_HEADER_HPP
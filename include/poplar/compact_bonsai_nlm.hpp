@@ -24,19 +24,29 @@
 #ifndef POPLAR_TRIE_COMPACT_BONSAI_NLM_HPP
 #define POPLAR_TRIE_COMPACT_BONSAI_NLM_HPP
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <memory>
 #include <vector>
 
+#include "chunk_header.hpp"
+#include "io_tools.hpp"
+#include "parallel_tools.hpp"
+#include "slab_allocator.hpp"
 #include "vbyte.hpp"
 
 namespace poplar {
 
-template <typename Value, uint64_t ChunkSize = 16>
+// Chunk buffers are obtained from Allocator, so that a buffer can grow in place within its size class.
+// If OffsetIndex is true, each chunk starts with the chunk_header of its labels, so that a label is
+// reached in constant time instead of decoding the preceding labels.
+template <typename Value, uint64_t ChunkSize = 16, class Allocator = slab_allocator<>, bool OffsetIndex = false>
 class compact_bonsai_nlm {
   public:
-    using this_type = compact_bonsai_nlm<Value, ChunkSize>;
+    using this_type = compact_bonsai_nlm<Value, ChunkSize, Allocator, OffsetIndex>;
+    using expanded_type = this_type;  // result of build_expanded()
     using value_type = Value;
+    using allocator_type = Allocator;
     using chunk_type = typename chunk_type_traits<ChunkSize>::type;
 
     static constexpr auto trie_type_id = trie_type_ids::BONSAI_TRIE;
@@ -49,40 +59,50 @@ class compact_bonsai_nlm {
     ~compact_bonsai_nlm() = default;
 
     std::pair<const value_type*, uint64_t> compare(uint64_t pos, const char_range& key) const {
-        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
-
-        assert(ptrs_[chunk_id]);
-        assert(bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk));
-
-        const uint8_t* ptr = ptrs_[chunk_id].get();
-        const uint64_t offset = bit_tools::popcnt(chunks_[chunk_id], pos_in_chunk);
-
         uint64_t alloc = 0;
-        for (uint64_t i = 0; i < offset; ++i) {
-            ptr += vbyte::decode(ptr, alloc);
-            ptr += alloc;
-        }
-        ptr += vbyte::decode(ptr, alloc);
-
-        if (key.empty()) {
-            return {reinterpret_cast<const value_type*>(ptr), 0};
-        }
+        const uint8_t* ptr = get_label_(pos, alloc);
 
-        uint64_t length = alloc - sizeof(value_type);
-        for (uint64_t i = 0; i < length; ++i) {
-            if (key[i] != ptr[i]) {
-                return {nullptr, i};
-            }
+        const uint64_t length = alloc - sizeof(value_type);
+        const uint64_t min_length = std::min(key.length(), length);
+        if (uint64_t i = find_mismatch(key.begin, ptr, min_length); i != min_length) {
+            return {nullptr, i};
         }
 
-        if (key[length] != '\0') {
-            return {nullptr, length};
+        // The virtual terminator of the shorter one mismatches.
+        if (key.length() != length) {
+            return {nullptr, min_length};
         }
 
-        // +1 considers the terminator '\0'
+        // +1 considers the terminator
         return {reinterpret_cast<const value_type*>(ptr + length), length + 1};
     };
 
+    bool has_label(uint64_t pos) const {
+        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
+        return bit_tools::get_bit(get_chunk_(chunk_id), pos_in_chunk);
+    }
+
+    // Gets the label associated with pos and the value pointer.
+    // The label is empty if the key is terminated by the edge to pos.
+    std::pair<char_range, const value_type*> get_label(uint64_t pos) const {
+        uint64_t alloc = 0;
+        const uint8_t* ptr = get_label_(pos, alloc);
+        const uint64_t length = alloc - sizeof(value_type);
+        return {char_range{ptr, ptr + length}, reinterpret_cast<const value_type*>(ptr + length)};
+    }
+
+    // Prefetches the chunk including the label associated with pos.
+    void prefetch(uint64_t pos) const {
+        auto chunk_id = pos / ChunkSize;
+        if (view_pool_ != nullptr) {
+            prefetch_address(&view_chunks_[chunk_id]);
+            prefetch_address(&view_offsets_[chunk_id]);
+        } else {
+            prefetch_address(&chunks_[chunk_id]);
+            prefetch_address(ptrs_[chunk_id]);
+        }
+    }
+
     value_type* insert(uint64_t pos, const char_range& key) {
         auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
 
@@ -96,75 +116,181 @@ class compact_bonsai_nlm {
         sum_length_ += key.length();
 #endif
 
-        if (!ptrs_[chunk_id]) {
+        const uint64_t len = key.length();
+        const uint64_t new_alloc = vbyte::size(len + sizeof(value_type)) + len + sizeof(value_type);
+        label_bytes_ += new_alloc;
+
+        uint8_t* new_ptr = nullptr;
+        uint64_t num = 1, data_bytes = new_alloc;
+
+        if (ptrs_[chunk_id] == nullptr) {
             // First association in the group
-            uint64_t length = key.empty() ? 0 : key.length() - 1;
-            uint64_t new_alloc = vbyte::size(length + sizeof(value_type)) + length + sizeof(value_type);
-            label_bytes_ += new_alloc;
+            const uint64_t head = OffsetIndex ? chunk_header::size(num, data_bytes) : 0;
+            ptrs_[chunk_id] = alloc_.allocate(head + new_alloc);
+            new_ptr = ptrs_[chunk_id] + head;
+        } else if constexpr (OffsetIndex) {
+            // Second and subsequent association in the group
+            num = bit_tools::popcnt(chunks_[chunk_id]);
+            const uint8_t* ptr = ptrs_[chunk_id];
+            const uint64_t old_data_bytes = chunk_header::get_data_bytes(ptr, num - 1);
+            const uint64_t offset = bit_tools::popcnt(chunks_[chunk_id], pos_in_chunk);
+            const uint64_t front = offset < num - 1 ? chunk_header::get_offset(ptr, offset) : old_data_bytes;
+
+            data_bytes += old_data_bytes;
+            new_ptr = make_room_(ptrs_[chunk_id], chunk_header::size(ptr, num - 1), chunk_header::size(num, data_bytes),
+                                 front, old_data_bytes - front, new_alloc);
+        } else {
+            // Second and subsequent association in the group
+            auto fr_alloc = get_allocs_(chunk_id, pos_in_chunk);
+            new_ptr = make_room_(ptrs_[chunk_id], 0, 0, fr_alloc.first, fr_alloc.second, new_alloc);
+        }
 
-            ptrs_[chunk_id] = std::make_unique<uint8_t[]>(new_alloc);
-            uint8_t* ptr = ptrs_[chunk_id].get();
+        new_ptr += vbyte::encode(new_ptr, len + sizeof(value_type));
+        copy_bytes(new_ptr, key.begin, len);
 
-            ptr += vbyte::encode(ptr, length + sizeof(value_type));
-            copy_bytes(ptr, key.begin, length);
+        auto ret_ptr = reinterpret_cast<value_type*>(new_ptr + len);
+        *ret_ptr = static_cast<value_type>(0);
 
-            auto ret_ptr = reinterpret_cast<value_type*>(ptr + length);
-            *ret_ptr = static_cast<value_type>(0);
+        if constexpr (OffsetIndex) {
+            chunk_header::write(ptrs_[chunk_id], num, data_bytes);
+        }
 
-            return ret_ptr;
+        return ret_ptr;
+    }
+
+    // Inserts labels[i].second with the value values[i] at the position labels[i].first for each i,
+    // where the positions are in empty chunks. As build_expanded(), the first pass sums up the bytes of
+    // each chunk, so that the chunk is allocated just once.
+    void insert_bulk(const std::vector<std::pair<uint64_t, char_range>>& labels, const std::vector<value_type>& values) {
+        assert(labels.size() == values.size());
+
+        std::vector<uint64_t> bytes(ptrs_.size());
+        std::vector<uint64_t> nums(ptrs_.size());
+        for (const auto& [pos, key] : labels) {
+            const uint64_t len = key.length();
+            bytes[pos / ChunkSize] += vbyte::size(len + sizeof(value_type)) + len + sizeof(value_type);
+            nums[pos / ChunkSize] += 1;
         }
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            assert(bytes[chunk_id] == 0 or ptrs_[chunk_id] == nullptr);
+            label_bytes_ += bytes[chunk_id];
+        }
+        allocate_chunks_(bytes, nums, 0, ptrs_.size(), alloc_);
 
-        // Second and subsequent association in the group
-        auto fr_alloc = get_allocs_(chunk_id, pos_in_chunk);
+        std::vector<uint8_t> slice;
+        for (uint64_t i = 0; i < labels.size(); ++i) {
+            const auto& [pos, key] = labels[i];
+            const uint64_t len = key.length();
 
-        const uint64_t len = key.empty() ? 0 : key.length() - 1;
-        const uint64_t new_alloc = vbyte::size(len + sizeof(value_type)) + len + sizeof(value_type);
-        label_bytes_ += new_alloc;
+#ifdef POPLAR_EXTRA_STATS
+            max_length_ = std::max<uint64_t>(max_length_, key.length());
+            sum_length_ += key.length();
+#endif
 
-        auto new_unique = std::make_unique<uint8_t[]>(fr_alloc.first + new_alloc + fr_alloc.second);
+            slice.clear();
+            vbyte::append(slice, len + sizeof(value_type));
+            slice.insert(slice.end(), key.begin, key.begin + len);
+            slice.resize(slice.size() + sizeof(value_type));
+            std::memcpy(slice.data() + slice.size() - sizeof(value_type), &values[i], sizeof(value_type));
 
-        // Get raw pointers
-        const uint8_t* orig_ptr = ptrs_[chunk_id].get();
-        uint8_t* new_ptr = new_unique.get();
+            auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
+            set_slice_(chunk_id, pos_in_chunk, char_range{slice.data(), slice.data() + slice.size()});
+        }
+        finish_chunks_(bytes, nums, 0, ptrs_.size());
 
-        // Copy the front allocation
-        copy_bytes(new_ptr, orig_ptr, fr_alloc.first);
-        orig_ptr += fr_alloc.first;
-        new_ptr += fr_alloc.first;
+        size_ += labels.size();
+    }
 
-        // Set new allocation
-        new_ptr += vbyte::encode(new_ptr, len + sizeof(value_type));
-        copy_bytes(new_ptr, key.begin, len);
-        new_ptr += len;
-        *reinterpret_cast<value_type*>(new_ptr) = static_cast<value_type>(0);
+    // Removes the label associated with pos and shrinks the buffer of the chunk.
+    void erase(uint64_t pos) {
+        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
+
+        assert(bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk));
+
+        const uint64_t num = bit_tools::popcnt(chunks_[chunk_id]);
+        const uint64_t offset = bit_tools::popcnt(chunks_[chunk_id], pos_in_chunk);
+        const uint8_t* ptr = ptrs_[chunk_id];
+
+        // Bytes of the header, the labels before pos, and all the labels
+        uint64_t head = 0, front = 0, data_bytes = 0;
+        if constexpr (OffsetIndex) {
+            head = chunk_header::size(ptr, num);
+            front = chunk_header::get_offset(ptr, offset);
+            data_bytes = chunk_header::get_data_bytes(ptr, num);
+        } else {
+            for (uint64_t i = 0; i < num; ++i) {
+                if (i == offset) {
+                    front = data_bytes;
+                }
+                uint64_t alloc = 0;
+                data_bytes += vbyte::decode(ptr + data_bytes, alloc);
+                data_bytes += alloc;
+            }
+        }
+
+        uint64_t alloc = 0;
+        const uint64_t len = vbyte::decode(ptr + head + front, alloc) + alloc;
+
+        bit_tools::set_bit(chunks_[chunk_id], pos_in_chunk, false);
+        --size_;
+        label_bytes_ -= len;
+
+        if (num == 1) {
+            alloc_.deallocate(ptrs_[chunk_id], head + data_bytes);
+            ptrs_[chunk_id] = nullptr;
+            return;
+        }
 
-        // Copy the back allocation
-        copy_bytes(new_ptr + sizeof(value_type), orig_ptr, fr_alloc.second);
+        const uint64_t new_data_bytes = data_bytes - len;
+        const uint64_t new_head = OffsetIndex ? chunk_header::size(num - 1, new_data_bytes) : 0;
+        remove_room_(ptrs_[chunk_id], head, new_head, front, data_bytes - front - len, len);
 
-        // Overwrite
-        ptrs_[chunk_id] = std::move(new_unique);
+        if constexpr (OffsetIndex) {
+            chunk_header::write(ptrs_[chunk_id], num - 1, new_data_bytes);
+        }
+    }
 
-        return reinterpret_cast<value_type*>(new_ptr);
+    template <typename T>
+    void expand(const T& pos_map, uint32_t num_threads = 1) {
+        apply_expanded(build_expanded(pos_map, num_threads));
     }
 
+    // Builds the store of the labels moved by pos_map as expand(), but leaves this store unchanged,
+    // so that it can be done while this store is read.
     template <typename T>
-    void expand(const T& pos_map) {
+    expanded_type build_expanded(const T& pos_map, uint32_t num_threads = 1) const {
+        if (1 < num_threads) {
+            return build_expanded_parallel_(pos_map, num_threads);
+        }
+
         this_type new_ls(bit_tools::ceil_log2(ptrs_.size() * ChunkSize * 2));
+        assert(pos_map.size() == ptrs_.size() * ChunkSize);
+
+        // The first pass sums up the bytes of each new chunk, so that the chunk is allocated just once.
+        // The old chunks are released at once with the old allocator.
+        std::vector<uint64_t> new_bytes(new_ls.ptrs_.size());
+        std::vector<uint64_t> new_nums(new_ls.ptrs_.size());
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            for_each_slice_(chunk_id, [&](uint64_t pos_in_chunk, char_range slice) {
+                uint64_t new_pos = pos_map[chunk_id * ChunkSize + pos_in_chunk];
+                if (new_pos != UINT64_MAX) {
+                    new_bytes[new_pos / ChunkSize] += slice.length();
+                    new_nums[new_pos / ChunkSize] += 1;
+                }
+            });
+        }
+        new_ls.allocate_chunks_(new_bytes, new_nums, 0, new_bytes.size(), new_ls.alloc_);
 
-        for (uint64_t pos = 0; pos < pos_map.size(); ++pos) {
-            auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
-            uint64_t new_pos = pos_map[pos];
-            if (new_pos != UINT64_MAX) {
-                auto orig_slice = get_slice_(chunk_id, pos_in_chunk);
-                if (!orig_slice.empty()) {
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            for_each_slice_(chunk_id, [&](uint64_t pos_in_chunk, char_range slice) {
+                uint64_t new_pos = pos_map[chunk_id * ChunkSize + pos_in_chunk];
+                if (new_pos != UINT64_MAX) {
                     auto [new_chunk_id, new_pos_in_chunk] = decompose_value<ChunkSize>(new_pos);
-                    new_ls.set_slice_(new_chunk_id, new_pos_in_chunk, orig_slice);
+                    new_ls.set_slice_(new_chunk_id, new_pos_in_chunk, slice);
                 }
-            }
-            if (pos_in_chunk == ChunkSize - 1) {
-                ptrs_[chunk_id].reset();
-            }
+            });
         }
+        new_ls.finish_chunks_(new_bytes, new_nums, 0, new_bytes.size());
 
         new_ls.size_ = size_;
 #ifdef POPLAR_EXTRA_STATS
@@ -172,6 +298,11 @@ class compact_bonsai_nlm {
         new_ls.sum_length_ = sum_length_;
 #endif
         new_ls.label_bytes_ = label_bytes_;
+        return new_ls;
+    }
+
+    // Replaces this store with that built by build_expanded().
+    void apply_expanded(expanded_type&& new_ls) {
         *this = std::move(new_ls);
     }
 
@@ -183,23 +314,89 @@ class compact_bonsai_nlm {
     }
     uint64_t alloc_bytes() const {
         uint64_t bytes = 0;
-        bytes += ptrs_.capacity() * sizeof(std::unique_ptr<uint8_t[]>);
+        bytes += ptrs_.capacity() * sizeof(uint8_t*);
         bytes += chunks_.capacity() * sizeof(chunk_type);
-        bytes += label_bytes_;
+        bytes += alloc_.alloc_bytes();
         return bytes;
     }
 
+    // The chunk buffers are serialized as one pool with the offsets of the chunks.
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, sizeof(value_type));
+        io_tools::save_param(os, ChunkSize);
+        io_tools::save_param(os, OffsetIndex);
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, label_bytes_);
+        io_tools::save_vector(os, chunks_);
+
+        std::vector<uint64_t> offsets(ptrs_.size() + 1);
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            offsets[chunk_id + 1] = offsets[chunk_id] + get_chunk_bytes_(chunk_id);
+        }
+        io_tools::save_vector(os, offsets);
+
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            io_tools::save_raw(os, ptrs_[chunk_id], offsets[chunk_id + 1] - offsets[chunk_id]);
+        }
+        io_tools::save_zeros(os, io_tools::padding_bytes(offsets.back()));
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, sizeof(value_type));
+        io_tools::load_param(is, ChunkSize);
+        io_tools::load_param(is, OffsetIndex);
+
+        *this = this_type{};
+        size_ = io_tools::load_value(is);
+        label_bytes_ = io_tools::load_value(is);
+        io_tools::load_vector(is, chunks_);
+
+        std::vector<uint64_t> offsets;
+        io_tools::load_vector(is, offsets);
+        POPLAR_THROW_IF(offsets.size() != chunks_.size() + 1, "The serialized data is broken.");
+
+        ptrs_.resize(chunks_.size(), nullptr);
+        for (uint64_t chunk_id = 0; chunk_id < ptrs_.size(); ++chunk_id) {
+            const uint64_t bytes = offsets[chunk_id + 1] - offsets[chunk_id];
+            if (bytes != 0) {
+                ptrs_[chunk_id] = alloc_.allocate(bytes);
+                io_tools::load_raw(is, ptrs_[chunk_id], bytes);
+            }
+        }
+        io_tools::skip_bytes(is, io_tools::padding_bytes(offsets.back()));
+    }
+    // Makes the NLM a read-only view over the bytes written by save(). The chunks are referred to by
+    // the serialized offsets instead of ptrs_.
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(sizeof(value_type));
+        mapper.map_param(ChunkSize);
+        mapper.map_param(OffsetIndex);
+
+        *this = this_type{};
+        size_ = mapper.map_value();
+        label_bytes_ = mapper.map_value();
+
+        const uint64_t num_chunks = mapper.map_value();
+        view_chunks_ = mapper.map_array<chunk_type>(num_chunks);
+
+        POPLAR_THROW_IF(mapper.map_value() != num_chunks + 1, "The serialized data is broken.");
+        view_offsets_ = mapper.map_array<uint64_t>(num_chunks + 1);
+        view_pool_ = mapper.map_bytes(view_offsets_[num_chunks]);
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "compact_bonsai_nlm");
         show_stat(os, indent, "size", size());
         show_stat(os, indent, "num_ptrs", num_ptrs());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_stat(os, indent, "label_bytes", label_bytes_);
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "max_length", max_length_);
         show_stat(os, indent, "ave_length", double(sum_length_) / size());
 #endif
         show_stat(os, indent, "chunk_size", ChunkSize);
+        show_member(os, indent, "alloc_");
+        alloc_.show_stats(os, n + 1);
     }
 
     compact_bonsai_nlm(const compact_bonsai_nlm&) = delete;
@@ -209,8 +406,13 @@ class compact_bonsai_nlm {
     compact_bonsai_nlm& operator=(compact_bonsai_nlm&&) noexcept = default;
 
   private:
-    std::vector<std::unique_ptr<uint8_t[]>> ptrs_;
+    std::vector<uint8_t*> ptrs_;
     std::vector<chunk_type> chunks_;
+    Allocator alloc_;
+    // Read-only view over the mapped bytes, used instead of chunks_ and ptrs_ if view_pool_ is not null
+    const chunk_type* view_chunks_ = nullptr;
+    const uint64_t* view_offsets_ = nullptr;
+    const uint8_t* view_pool_ = nullptr;
     uint64_t size_ = 0;
     uint64_t label_bytes_ = 0;
 
@@ -219,10 +421,77 @@ class compact_bonsai_nlm {
     uint64_t sum_length_ = 0;
 #endif
 
+    // Each thread re-layouts its own range of the new chunks.
+    template <typename T>
+    this_type build_expanded_parallel_(const T& pos_map, uint32_t num_threads) const {
+        this_type new_ls(bit_tools::ceil_log2(ptrs_.size() * ChunkSize * 2));
+
+        assert(pos_map.size() == ptrs_.size() * ChunkSize);
+
+        num_threads = parallel_tools::get_num_threads(num_threads, pos_map.size());
+        const uint64_t old_range_size = parallel_tools::get_range_size(num_threads, ptrs_.size(), 1);
+        const uint64_t new_range_size = parallel_tools::get_range_size(num_threads, new_ls.ptrs_.size(), 1);
+        const uint64_t num_ranges = (new_ls.ptrs_.size() + new_range_size - 1) / new_range_size;
+
+        // Each destination range has its own allocator, merged after the join.
+        std::vector<Allocator> allocs(num_ranges);
+        std::vector<uint64_t> new_bytes(new_ls.ptrs_.size());
+        std::vector<uint64_t> new_nums(new_ls.ptrs_.size());
+
+        // Pairs (new_pos, slice) grouped by the source and destination ranges
+        std::vector<std::vector<std::vector<std::pair<uint64_t, char_range>>>> moves(
+            num_threads, std::vector<std::vector<std::pair<uint64_t, char_range>>>(num_ranges));
+
+        parallel_tools::run_ranges(ptrs_.size(), old_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+            for (uint64_t chunk_id = begin; chunk_id < end; ++chunk_id) {
+                for_each_slice_(chunk_id, [&](uint64_t pos_in_chunk, char_range slice) {
+                    uint64_t new_pos = pos_map[chunk_id * ChunkSize + pos_in_chunk];
+                    if (new_pos != UINT64_MAX) {
+                        moves[tid][new_pos / ChunkSize / new_range_size].emplace_back(new_pos, slice);
+                    }
+                });
+            }
+        });
+
+        parallel_tools::run_ranges(num_ranges, 1, [&](uint64_t, uint64_t r, uint64_t) {
+            for (const auto& tid_moves : moves) {
+                for (auto [new_pos, slice] : tid_moves[r]) {
+                    new_bytes[new_pos / ChunkSize] += slice.length();
+                    new_nums[new_pos / ChunkSize] += 1;
+                }
+            }
+            const uint64_t begin = r * new_range_size;
+            const uint64_t end = std::min(begin + new_range_size, new_ls.ptrs_.size());
+            new_ls.allocate_chunks_(new_bytes, new_nums, begin, end, allocs[r]);
+
+            for (const auto& tid_moves : moves) {
+                for (auto [new_pos, slice] : tid_moves[r]) {
+                    auto [new_chunk_id, new_pos_in_chunk] = decompose_value<ChunkSize>(new_pos);
+                    new_ls.set_slice_(new_chunk_id, new_pos_in_chunk, slice);
+                }
+            }
+            new_ls.finish_chunks_(new_bytes, new_nums, begin, end);
+        });
+
+        for (auto& alloc : allocs) {
+            new_ls.alloc_.merge(std::move(alloc));
+        }
+
+        new_ls.size_ = size_;
+#ifdef POPLAR_EXTRA_STATS
+        new_ls.max_length_ = max_length_;
+        new_ls.sum_length_ = sum_length_;
+#endif
+        new_ls.label_bytes_ = label_bytes_;
+        return new_ls;
+    }
+
+    // Gets the bytes of the labels before and after pos_in_chunk by decoding the labels from the head of the buffer.
+    // Only for a chunk without the header.
     std::pair<uint64_t, uint64_t> get_allocs_(uint64_t chunk_id, uint64_t pos_in_chunk) {
         assert(bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk));
 
-        const uint8_t* ptr = ptrs_[chunk_id].get();
+        const uint8_t* ptr = ptrs_[chunk_id];
         assert(ptr != nullptr);
 
         // -1 means the difference of the above bit_tools::set_bit
@@ -245,59 +514,152 @@ class compact_bonsai_nlm {
         return {front_alloc, back_alloc};
     }
 
-    char_range get_slice_(uint64_t chunk_id, uint64_t pos_in_chunk) const {
-        if (!bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk)) {
-            // pos indicates a step node
-            return {nullptr, nullptr};
-        }
+    chunk_type get_chunk_(uint64_t chunk_id) const {
+        return view_pool_ != nullptr ? view_chunks_[chunk_id] : chunks_[chunk_id];
+    }
+    const uint8_t* get_ptr_(uint64_t chunk_id) const {
+        return view_pool_ != nullptr ? view_pool_ + view_offsets_[chunk_id] : ptrs_[chunk_id];
+    }
+
+    // Gets the pointer to the label associated with pos and the bytes of the label and value.
+    const uint8_t* get_label_(uint64_t pos, uint64_t& alloc) const {
+        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
+
+        const chunk_type chunk = get_chunk_(chunk_id);
+        const uint8_t* ptr = get_ptr_(chunk_id);
 
-        const uint8_t* ptr = ptrs_[chunk_id].get();
         assert(ptr != nullptr);
+        assert(bit_tools::get_bit(chunk, pos_in_chunk));
 
-        const uint64_t offset = bit_tools::popcnt(chunks_[chunk_id], pos_in_chunk);
+        const uint64_t offset = bit_tools::popcnt(chunk, pos_in_chunk);
 
-        // Proceeds the target position
-        uint64_t len = 0;
-        for (uint64_t i = 0; i < offset; ++i) {
-            ptr += vbyte::decode(ptr, len);
-            ptr += len;
+        if constexpr (OffsetIndex) {
+            ptr = chunk_header::get_label(ptr, bit_tools::popcnt(chunk), offset);
+        } else {
+            for (uint64_t i = 0; i < offset; ++i) {
+                ptr += vbyte::decode(ptr, alloc);
+                ptr += alloc;
+            }
+        }
+        return ptr + vbyte::decode(ptr, alloc);
+    }
+
+    // Gets the bytes used in the buffer of the chunk.
+    uint64_t get_chunk_bytes_(uint64_t chunk_id) const {
+        const uint8_t* ptr = ptrs_[chunk_id];
+        if (ptr == nullptr) {
+            return 0;
+        }
+        const uint64_t num = bit_tools::popcnt(chunks_[chunk_id]);
+        if constexpr (OffsetIndex) {
+            return chunk_header::size(ptr, num) + chunk_header::get_data_bytes(ptr, num);
+        }
+        uint64_t bytes = 0;
+        for_each_slice_(chunk_id, [&](uint64_t, char_range slice) { bytes += slice.length(); });
+        return bytes;
+    }
+
+    // Calls fn(pos_in_chunk, slice) for the labels in the chunk in order.
+    template <class Fn>
+    void for_each_slice_(uint64_t chunk_id, Fn&& fn) const {
+        const uint8_t* ptr = ptrs_[chunk_id];
+        if constexpr (OffsetIndex) {
+            if (ptr != nullptr) {
+                ptr += chunk_header::size(ptr, bit_tools::popcnt(chunks_[chunk_id]));
+            }
+        }
+        for (uint64_t pos_in_chunk = 0; pos_in_chunk < ChunkSize; ++pos_in_chunk) {
+            if (bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk)) {
+                uint64_t len = 0;
+                uint64_t vsize = vbyte::decode(ptr, len);
+                fn(pos_in_chunk, char_range{ptr, ptr + (vsize + len)});
+                ptr += vsize + len;
+            }
+        }
+    }
+
+    // Allocates the buffers of the chunks in [begin, end) for the given # of labels of the given bytes.
+    void allocate_chunks_(const std::vector<uint64_t>& bytes, const std::vector<uint64_t>& nums, uint64_t begin,
+                          uint64_t end, Allocator& alloc) {
+        for (uint64_t chunk_id = begin; chunk_id < end; ++chunk_id) {
+            if (bytes[chunk_id] != 0) {
+                const uint64_t head = OffsetIndex ? chunk_header::size(nums[chunk_id], bytes[chunk_id]) : 0;
+                ptrs_[chunk_id] = alloc.allocate(head + bytes[chunk_id]);
+            }
         }
+    }
 
-        uint64_t vsize = vbyte::decode(ptr, len);
-        return {ptr, ptr + (vsize + len)};
+    // Puts the headers in front of the labels put by set_slice_ in the chunks in [begin, end).
+    void finish_chunks_(const std::vector<uint64_t>& bytes, const std::vector<uint64_t>& nums, uint64_t begin,
+                        uint64_t end) {
+        if constexpr (OffsetIndex) {
+            for (uint64_t chunk_id = begin; chunk_id < end; ++chunk_id) {
+                if (bytes[chunk_id] != 0) {
+                    uint8_t* ptr = ptrs_[chunk_id];
+                    std::memmove(ptr + chunk_header::size(nums[chunk_id], bytes[chunk_id]), ptr, bytes[chunk_id]);
+                    chunk_header::write(ptr, nums[chunk_id], bytes[chunk_id]);
+                }
+            }
+        }
     }
 
+    // Puts the slice into the chunk, whose buffer has been allocated for all the labels by allocate_chunks_.
+    // The labels are put from the head of the buffer until finish_chunks_ is called.
     void set_slice_(uint64_t chunk_id, uint64_t pos_in_chunk, char_range new_slice) {
         assert(!bit_tools::get_bit(chunks_[chunk_id], pos_in_chunk));
+        assert(ptrs_[chunk_id] != nullptr);
 
         bit_tools::set_bit(chunks_[chunk_id], pos_in_chunk);
-        const uint8_t* ptr = ptrs_[chunk_id].get();
 
-        if (ptr == nullptr) {
-            // First association in the group
-            ptrs_[chunk_id] = std::make_unique<uint8_t[]>(new_slice.length());
-            copy_bytes(ptrs_[chunk_id].get(), new_slice.begin, new_slice.length());
-            return;
-        }
-
-        // Second and subsequent association in the group
         auto fr_alloc = get_allocs_(chunk_id, pos_in_chunk);
-        auto new_unique = std::make_unique<uint8_t[]>(fr_alloc.first + new_slice.length() + fr_alloc.second);
+        uint8_t* ptr = ptrs_[chunk_id] + fr_alloc.first;
+        std::memmove(ptr + new_slice.length(), ptr, fr_alloc.second);
+        copy_bytes(ptr, new_slice.begin, new_slice.length());
+    }
+
+    // Opens len bytes between the front and back bytes of the labels and returns the position.
+    // The header before the labels is enlarged from old_head to new_head bytes, where its content is left.
+    // The buffer is grown in place if its block has enough capacity; otherwise, it is reallocated.
+    uint8_t* make_room_(uint8_t*& ptr, uint64_t old_head, uint64_t new_head, uint64_t front, uint64_t back,
+                        uint64_t len) {
+        assert(old_head <= new_head);
+
+        const uint64_t used = old_head + front + back;
+        const uint64_t new_used = new_head + front + len + back;
+        if (new_used <= Allocator::capacity(used)) {
+            std::memmove(ptr + new_head + front + len, ptr + old_head + front, back);
+            std::memmove(ptr + new_head, ptr + old_head, front);
+            return ptr + new_head + front;
+        }
 
-        uint8_t* new_ptr = new_unique.get();
+        uint8_t* new_ptr = alloc_.allocate(new_used);
+        copy_bytes(new_ptr + new_head, ptr + old_head, front);
+        copy_bytes(new_ptr + new_head + front + len, ptr + old_head + front, back);
+        alloc_.deallocate(ptr, used);
 
-        // Copy the front allocation
-        copy_bytes(new_ptr, ptr, fr_alloc.first);
-        ptr += fr_alloc.first;
-        new_ptr += fr_alloc.first;
+        ptr = new_ptr;
+        return new_ptr + new_head + front;
+    }
 
-        // Set new label
-        copy_bytes(new_ptr, new_slice.begin, new_slice.length());
-        new_ptr += new_slice.length();
+    // Closes the len bytes between the front and back bytes of the labels, as the inverse of make_room_.
+    // The buffer is reallocated if a smaller block can hold the rest.
+    void remove_room_(uint8_t*& ptr, uint64_t old_head, uint64_t new_head, uint64_t front, uint64_t back,
+                      uint64_t len) {
+        assert(new_head <= old_head);
+
+        const uint64_t used = old_head + front + len + back;
+        const uint64_t new_used = new_head + front + back;
+        if (Allocator::capacity(new_used) == Allocator::capacity(used)) {
+            std::memmove(ptr + new_head, ptr + old_head, front);
+            std::memmove(ptr + new_head + front, ptr + old_head + front + len, back);
+            return;
+        }
 
-        // Copy back
-        copy_bytes(new_ptr, ptr, fr_alloc.second);
-        ptrs_[chunk_id] = std::move(new_unique);
+        uint8_t* new_ptr = alloc_.allocate(new_used);
+        copy_bytes(new_ptr + new_head, ptr + old_head, front);
+        copy_bytes(new_ptr + new_head + front, ptr + old_head + front + len, back);
+        alloc_.deallocate(ptr, used);
+        ptr = new_ptr;
     }
 };
 
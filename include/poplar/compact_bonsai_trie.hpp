@@ -28,10 +28,17 @@
 #include "bit_vector.hpp"
 #include "compact_hash_table.hpp"
 #include "compact_vector.hpp"
+#include "io_tools.hpp"
+#include "parallel_tools.hpp"
 #include "standard_hash_table.hpp"
 
 namespace poplar {
 
+// A node removed by erase() keeps its slot content and is flagged as a tombstone, that is skipped by
+// find_child() and reused by add_child() if the displacement fits in the first Dsp1Bits bits, so that
+// stale entries in the auxiliary tables are never referred to. The tombstones are counted toward
+// MaxFactor and are dropped by expand().
+// AuxCht can be block_dsp_table, with which the 2nd dsp is read from one cache line without hashing.
 template <uint32_t MaxFactor = 90, uint32_t Dsp1Bits = 4, class AuxCht = compact_hash_table<7>,
           class AuxMap = standard_hash_table<>, class Hasher = bijective_hash::split_mix_hasher>
 class compact_bonsai_trie {
@@ -45,6 +52,8 @@ class compact_bonsai_trie {
 
     static constexpr uint64_t nil_id = UINT64_MAX;
     static constexpr uint32_t min_capa_bits = 16;
+    static constexpr uint32_t max_factor = MaxFactor;
+    static constexpr bool reversible = true;
 
     static constexpr uint32_t dsp1_bits = Dsp1Bits;
     static constexpr uint64_t dsp1_mask = (1ULL << dsp1_bits) - 1;
@@ -100,18 +109,29 @@ class compact_bonsai_trie {
                 return nil_id;
             }
 
-            if (compare_dsp_(i, cnt) and quo == get_quo_(i)) {
+            if (compare_dsp_(i, cnt) and quo == get_quo_(i) and !is_tomb_(i)) {
                 return i;
             }
         }
     }
 
+    // Prefetches the initial slot probed by find_child(node_id, symb).
+    void prefetch_child(uint64_t node_id, uint64_t symb) const {
+        assert(node_id < capa_size_.size());
+        assert(symb < symb_size_.size());
+
+        auto [quo, mod] = decompose_(hasher_.hash(make_key_(node_id, symb)));
+        table_.prefetch(mod);
+    }
+
     bool add_child(uint64_t& node_id, uint64_t symb) {
         assert(node_id < capa_size_.size());
         assert(symb < symb_size_.size());
 
         auto [quo, mod] = decompose_(hasher_.hash(make_key_(node_id, symb)));
 
+        uint64_t tomb_id = nil_id, tomb_cnt = 0;
+
         for (uint64_t i = mod, cnt = 1;; i = right_(i), ++cnt) {
             // because the root's dsp value is zero though it is defined
             if (i == get_root()) {
@@ -120,7 +140,14 @@ class compact_bonsai_trie {
 
             if (compare_dsp_(i, 0)) {
                 // this slot is empty
-                if (size_ == max_size_) {
+                if (tomb_id != nil_id) {
+                    // reuse the first tombstone on the probe
+                    i = tomb_id;
+                    cnt = tomb_cnt;
+                    table_.set(i, 0);
+                    tombs_.set(i, 0);
+                    --num_tombs_;
+                } else if (size_ + num_tombs_ == max_size_) {
                     return false;  // needs to expand
                 }
 
@@ -132,6 +159,14 @@ class compact_bonsai_trie {
                 return true;
             }
 
+            if (is_tomb_(i)) {
+                if (tomb_id == nil_id and cnt < dsp1_mask) {
+                    tomb_id = i;
+                    tomb_cnt = cnt;
+                }
+                continue;
+            }
+
             if (compare_dsp_(i, cnt) and quo == get_quo_(i)) {
                 node_id = i;
                 return false;  // already stored
@@ -139,10 +174,23 @@ class compact_bonsai_trie {
         }
     }
 
+    // Removes the leaf node by flagging it as a tombstone. The node ID can be reused by add_child().
+    void erase(uint64_t node_id) {
+        assert(node_id != get_root());
+        assert(!compare_dsp_(node_id, 0) and !is_tomb_(node_id));
+
+        if (tombs_.size() == 0) {
+            tombs_ = compact_vector{capa_size_.size(), 1};
+        }
+        tombs_.set(node_id, 1);
+        --size_;
+        ++num_tombs_;
+    }
+
     std::pair<uint64_t, uint64_t> get_parent_and_symb(uint64_t node_id) const {
         assert(node_id < capa_size_.size());
 
-        if (compare_dsp_(node_id, 0)) {
+        if (compare_dsp_(node_id, 0) or is_tomb_(node_id)) {
             // root or not exist
             return {nil_id, 0};
         }
@@ -192,10 +240,16 @@ class compact_bonsai_trie {
     };
 
     bool needs_to_expand() const {
-        return max_size() <= size();
+        return max_size() <= size() + num_tombs();
     }
 
-    node_map expand() {
+    // Doubles the capacity and returns the mapping from the old node IDs to the new ones.
+    // If num_threads > 1, the new table is built in parallel.
+    node_map expand(uint32_t num_threads = 1) {
+        if (1 < num_threads) {
+            return expand_parallel_(num_threads);
+        }
+
         // this_type new_ht{capa_bits() + 1, symb_size_.bits(), aux_cht_.capa_bits()};
         this_type new_ht{capa_bits() + 1, symb_size_.bits()};
         new_ht.add_root();
@@ -236,8 +290,8 @@ class compact_bonsai_trie {
 
         // 0 is root
         for (uint64_t i = 1; i < table_.size(); ++i) {
-            if (done_flags[i] or compare_dsp_(i, 0)) {
-                // skip already processed or empty elements
+            if (done_flags[i] or compare_dsp_(i, 0) or is_tomb_(i)) {
+                // skip already processed, empty or erased elements
                 continue;
             }
 
@@ -266,9 +320,46 @@ class compact_bonsai_trie {
         return node_map;
     }
 
+    // Builds the trie of twice the capacity as expand(), but leaves this trie unchanged,
+    // so that it can be done while this trie is read.
+    std::pair<this_type, node_map> build_expanded(uint32_t num_threads = 1) const {
+        this_type new_ht{capa_bits() + 1, symb_size_.bits()};
+        new_ht.add_root();
+
+#ifdef POPLAR_EXTRA_STATS
+        new_ht.num_resize_ = num_resize_ + 1;
+#endif
+
+        compact_vector map{capa_size(), new_ht.capa_bits()};
+        bit_vector done_flags(capa_size());
+
+        parallel_tools::rebuild_bonsai(
+            num_threads, capa_size(), get_root(), new_ht.capa_size(), new_ht.get_root(),
+            [&](uint64_t i) { return !compare_dsp_(i, 0) and !is_tomb_(i); },
+            [&](uint64_t i) { return get_parent_and_symb(i); },
+            [&](uint64_t new_parent, uint64_t symb) {
+                return new_ht.decompose_(new_ht.hasher_.hash(new_ht.make_key_(new_parent, symb)));
+            },
+            [&](uint64_t quo, uint64_t slot, uint64_t end) { return new_ht.try_place_(quo, slot, end); },
+            [&](uint64_t quo, uint64_t slot) { return new_ht.place_(quo, slot); },
+            map, done_flags);
+
+        new_ht.size_ = size_;
+#ifdef POPLAR_EXTRA_STATS
+        // try_place_() does not count the displacements
+        new_ht.num_dsps_[0] = size_ - 1 - new_ht.num_dsps_[1] - new_ht.num_dsps_[2];
+#endif
+
+        return {std::move(new_ht), node_map{compact_vector{}, std::move(map), std::move(done_flags)}};
+    }
+
     uint64_t size() const {
         return size_;
     }
+    // # of tombstones left by erase()
+    uint64_t num_tombs() const {
+        return num_tombs_;
+    }
     uint64_t max_size() const {
         return max_size_;
     }
@@ -292,17 +383,65 @@ class compact_bonsai_trie {
     uint64_t alloc_bytes() const {
         uint64_t bytes = 0;
         bytes += table_.alloc_bytes();
+        bytes += tombs_.alloc_bytes();
         bytes += aux_cht_.alloc_bytes();
         bytes += aux_map_.alloc_bytes();
         return bytes;
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, dsp1_bits);
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, symb_size_.bits());
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, num_tombs_);
+        hasher_.save(os);
+        table_.save(os);
+        tombs_.save(os);
+        aux_cht_.save(os);
+        aux_map_.save(os);
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, dsp1_bits);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        symb_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = io_tools::load_value(is);
+        num_tombs_ = io_tools::load_value(is);
+        hasher_.load(is);
+        table_.load(is);
+        tombs_.load(is);
+        aux_cht_.load(is);
+        aux_map_.load(is);
+        POPLAR_THROW_IF(table_.size() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+    // Makes the trie a read-only view over the bytes written by save().
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(dsp1_bits);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        symb_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = mapper.map_value();
+        num_tombs_ = mapper.map_value();
+        hasher_.load_view(mapper);
+        table_.load_view(mapper);
+        tombs_.load_view(mapper);
+        aux_cht_.load_view(mapper);
+        aux_map_.load_view(mapper);
+        POPLAR_THROW_IF(table_.size() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "compact_hash_trie");
         show_stat(os, indent, "factor", double(size()) / capa_size() * 100);
         show_stat(os, indent, "max_factor", MaxFactor);
         show_stat(os, indent, "size", size());
+        show_stat(os, indent, "num_tombs", num_tombs());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
         show_stat(os, indent, "capa_bits", capa_bits());
         show_stat(os, indent, "symb_bits", symb_bits());
@@ -331,9 +470,11 @@ class compact_bonsai_trie {
   private:
     Hasher hasher_;
     compact_vector table_;
+    compact_vector tombs_;  // tombstone flags (allocated at the first erase())
     aux_cht_type aux_cht_;  // 2nd dsp
     aux_map_type aux_map_;  // 3rd dsp
     uint64_t size_ = 0;  // # of registered nodes
+    uint64_t num_tombs_ = 0;
     uint64_t max_size_ = 0;  // MaxFactor% of the capacity
     size_p2 capa_size_;
     size_p2 symb_size_;
@@ -352,6 +493,10 @@ class compact_bonsai_trie {
         return (slot_id + 1) & capa_size_.mask();
     }
 
+    bool is_tomb_(uint64_t slot_id) const {
+        return tombs_.size() != 0 and tombs_[slot_id] != 0;
+    }
+
     uint64_t get_quo_(uint64_t slot_id) const {
         return table_[slot_id] >> dsp1_bits;
     }
@@ -421,6 +566,39 @@ class compact_bonsai_trie {
 
         table_.set(slot_id, v);
     }
+
+    node_map expand_parallel_(uint32_t num_threads) {
+        auto [new_ht, node_map] = build_expanded(num_threads);
+        std::swap(*this, new_ht);
+        return std::move(node_map);
+    }
+
+    // Places the item in the empty slot of [slot, end) if exists and its displacement
+    // can be stored without the auxiliary tables (that are not thread-safe).
+    uint64_t try_place_(uint64_t quo, uint64_t slot, uint64_t end) {
+        for (uint64_t i = slot, cnt = 1; i < end and cnt < dsp1_mask; ++i, ++cnt) {
+            if (i == get_root()) {
+                continue;
+            }
+            if ((table_[i] & dsp1_mask) == 0) {
+                table_.set(i, quo << dsp1_bits | cnt);
+                return i;
+            }
+        }
+        return nil_id;
+    }
+
+    uint64_t place_(uint64_t quo, uint64_t slot) {
+        for (uint64_t i = slot, cnt = 1;; i = right_(i), ++cnt) {
+            if (i == get_root()) {
+                continue;
+            }
+            if (compare_dsp_(i, 0)) {
+                update_slot_(i, quo, cnt);
+                return i;
+            }
+        }
+    }
 };
 
 }  // namespace poplar
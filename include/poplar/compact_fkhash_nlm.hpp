@@ -24,18 +24,23 @@
 #ifndef POPLAR_TRIE_COMPACT_FKHASH_NLM_HPP
 #define POPLAR_TRIE_COMPACT_FKHASH_NLM_HPP
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <vector>
 
+#include "chunk_header.hpp"
+#include "io_tools.hpp"
 #include "vbyte.hpp"
 
 namespace poplar {
 
-template <typename Value, uint64_t ChunkSize = 16>
+// If OffsetIndex is true, each released chunk starts with the chunk_header of its labels, so that a label is
+// reached in constant time instead of decoding the preceding labels.
+template <typename Value, uint64_t ChunkSize = 16, bool OffsetIndex = false>
 class compact_fkhash_nlm {
   public:
-    using this_type = compact_fkhash_nlm<Value, ChunkSize>;
+    using this_type = compact_fkhash_nlm<Value, ChunkSize, OffsetIndex>;
     using value_type = Value;
     using chunk_type = typename chunk_type_traits<ChunkSize>::type;
 
@@ -52,46 +57,50 @@ class compact_fkhash_nlm {
     ~compact_fkhash_nlm() = default;
 
     std::pair<const value_type*, uint64_t> compare(uint64_t pos, const char_range& key) const {
-        assert(pos < size_);
-
-        const uint8_t* char_ptr = nullptr;
-        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
-
-        if (chunk_id < chunk_ptrs_.size()) {
-            char_ptr = chunk_ptrs_[chunk_id].get();
-        } else {
-            assert(chunk_id == chunk_ptrs_.size());
-            char_ptr = chunk_buf_.data();
-        }
-
         uint64_t alloc = 0;
-        for (uint64_t i = 0; i < pos_in_chunk; ++i) {
-            char_ptr += vbyte::decode(char_ptr, alloc);
-            char_ptr += alloc;
-        }
-        char_ptr += vbyte::decode(char_ptr, alloc);
-
-        if (key.empty()) {
-            return {reinterpret_cast<const value_type*>(char_ptr), 0};
-        }
+        const uint8_t* char_ptr = get_label_(pos, alloc);
 
         assert(sizeof(value_type) <= alloc);
 
-        uint64_t length = alloc - sizeof(value_type);
-        for (uint64_t i = 0; i < length; ++i) {
-            if (key[i] != char_ptr[i]) {
-                return {nullptr, i};
-            }
+        const uint64_t length = alloc - sizeof(value_type);
+        const uint64_t min_length = std::min(key.length(), length);
+        if (uint64_t i = find_mismatch(key.begin, char_ptr, min_length); i != min_length) {
+            return {nullptr, i};
         }
 
-        if (key[length] != '\0') {
-            return {nullptr, length};
+        // The virtual terminator of the shorter one mismatches.
+        if (key.length() != length) {
+            return {nullptr, min_length};
         }
 
-        // +1 considers the terminator '\0'
+        // +1 considers the terminator
         return {reinterpret_cast<const value_type*>(char_ptr + length), length + 1};
     };
 
+    bool has_label(uint64_t pos) const {
+        uint64_t alloc = 0;
+        get_label_(pos, alloc);
+        return alloc != 0;  // not dummy
+    }
+
+    // Gets the label associated with pos and the value pointer.
+    // The label is empty if the key is terminated by the edge to pos.
+    std::pair<char_range, const value_type*> get_label(uint64_t pos) const {
+        uint64_t alloc = 0;
+        const uint8_t* ptr = get_label_(pos, alloc);
+        assert(sizeof(value_type) <= alloc);
+        const uint64_t length = alloc - sizeof(value_type);
+        return {char_range{ptr, ptr + length}, reinterpret_cast<const value_type*>(ptr + length)};
+    }
+
+    // Prefetches the chunk including the label associated with pos.
+    void prefetch(uint64_t pos) const {
+        auto chunk_id = pos / ChunkSize;
+        if (chunk_id < get_num_chunks_()) {
+            prefetch_address(get_chunk_ptr_(chunk_id));
+        }
+    }
+
     value_type* append(const char_range& key) {
         auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(size_++);
         if (chunk_id != 0 && pos_in_chunk == 0) {
@@ -103,7 +112,7 @@ class compact_fkhash_nlm {
         sum_length_ += key.length();
 #endif
 
-        uint64_t length = key.empty() ? 0 : key.length() - 1;
+        uint64_t length = key.length();
         vbyte::append(chunk_buf_, length + sizeof(value_type));
         std::copy(key.begin, key.begin + length, std::back_inserter(chunk_buf_));
         for (size_t i = 0; i < sizeof(value_type); ++i) {
@@ -137,6 +146,67 @@ class compact_fkhash_nlm {
         return bytes;
     }
 
+    // The released chunks are serialized as one pool with the offsets of the chunks.
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, sizeof(value_type));
+        io_tools::save_param(os, ChunkSize);
+        io_tools::save_param(os, OffsetIndex);
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, label_bytes_);
+
+        std::vector<uint64_t> offsets(chunk_ptrs_.size() + 1);
+        for (uint64_t chunk_id = 0; chunk_id < chunk_ptrs_.size(); ++chunk_id) {
+            offsets[chunk_id + 1] = offsets[chunk_id] + get_chunk_bytes_(chunk_id);
+        }
+        io_tools::save_vector(os, offsets);
+
+        for (uint64_t chunk_id = 0; chunk_id < chunk_ptrs_.size(); ++chunk_id) {
+            io_tools::save_raw(os, chunk_ptrs_[chunk_id].get(), offsets[chunk_id + 1] - offsets[chunk_id]);
+        }
+        io_tools::save_zeros(os, io_tools::padding_bytes(offsets.back()));
+        io_tools::save_vector(os, chunk_buf_);
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, sizeof(value_type));
+        io_tools::load_param(is, ChunkSize);
+        io_tools::load_param(is, OffsetIndex);
+
+        *this = this_type{};
+        size_ = io_tools::load_value(is);
+        label_bytes_ = io_tools::load_value(is);
+
+        std::vector<uint64_t> offsets;
+        io_tools::load_vector(is, offsets);
+        POPLAR_THROW_IF(offsets.empty(), "The serialized data is broken.");
+
+        chunk_ptrs_.resize(offsets.size() - 1);
+        for (uint64_t chunk_id = 0; chunk_id < chunk_ptrs_.size(); ++chunk_id) {
+            const uint64_t bytes = offsets[chunk_id + 1] - offsets[chunk_id];
+            chunk_ptrs_[chunk_id] = std::make_unique<uint8_t[]>(bytes);
+            io_tools::load_raw(is, chunk_ptrs_[chunk_id].get(), bytes);
+        }
+        io_tools::skip_bytes(is, io_tools::padding_bytes(offsets.back()));
+        io_tools::load_vector(is, chunk_buf_);
+    }
+    // Makes the NLM a read-only view over the bytes written by save(). The chunks are referred to by
+    // the serialized offsets instead of chunk_ptrs_.
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(sizeof(value_type));
+        mapper.map_param(ChunkSize);
+        mapper.map_param(OffsetIndex);
+
+        *this = this_type{};
+        size_ = mapper.map_value();
+        label_bytes_ = mapper.map_value();
+
+        const uint64_t num_offsets = mapper.map_value();
+        POPLAR_THROW_IF(num_offsets == 0, "The serialized data is broken.");
+        view_num_chunks_ = num_offsets - 1;
+        view_offsets_ = mapper.map_array<uint64_t>(num_offsets);
+        view_pool_ = mapper.map_bytes(view_offsets_[view_num_chunks_]);
+        view_buf_ = mapper.map_array<uint8_t>(mapper.map_value());
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "compact_fkhash_nlm");
@@ -159,6 +229,11 @@ class compact_fkhash_nlm {
   private:
     std::vector<std::unique_ptr<uint8_t[]>> chunk_ptrs_;
     std::vector<uint8_t> chunk_buf_;  // for the last chunk
+    // Read-only view over the mapped bytes, used instead of chunk_ptrs_ and chunk_buf_ if view_pool_ is not null
+    uint64_t view_num_chunks_ = 0;
+    const uint64_t* view_offsets_ = nullptr;
+    const uint8_t* view_pool_ = nullptr;
+    const uint8_t* view_buf_ = nullptr;
     uint64_t size_ = 0;
     uint64_t label_bytes_ = 0;
 
@@ -167,10 +242,62 @@ class compact_fkhash_nlm {
     uint64_t sum_length_ = 0;
 #endif
 
+    // Gets the pointer to the label associated with pos and the bytes of the label and value.
+    const uint8_t* get_label_(uint64_t pos, uint64_t& alloc) const {
+        assert(pos < size_);
+
+        const uint8_t* char_ptr = nullptr;
+        auto [chunk_id, pos_in_chunk] = decompose_value<ChunkSize>(pos);
+
+        if (chunk_id < get_num_chunks_()) {
+            char_ptr = get_chunk_ptr_(chunk_id);
+            if constexpr (OffsetIndex) {
+                char_ptr = chunk_header::get_label(char_ptr, ChunkSize, pos_in_chunk);
+                pos_in_chunk = 0;
+            }
+        } else {
+            // The last chunk has no header
+            assert(chunk_id == get_num_chunks_());
+            char_ptr = view_pool_ != nullptr ? view_buf_ : chunk_buf_.data();
+        }
+
+        for (uint64_t i = 0; i < pos_in_chunk; ++i) {
+            char_ptr += vbyte::decode(char_ptr, alloc);
+            char_ptr += alloc;
+        }
+        return char_ptr + vbyte::decode(char_ptr, alloc);
+    }
+
+    uint64_t get_num_chunks_() const {
+        return view_pool_ != nullptr ? view_num_chunks_ : chunk_ptrs_.size();
+    }
+    const uint8_t* get_chunk_ptr_(uint64_t chunk_id) const {
+        return view_pool_ != nullptr ? view_pool_ + view_offsets_[chunk_id] : chunk_ptrs_[chunk_id].get();
+    }
+
+    // Gets the bytes of the released chunk.
+    uint64_t get_chunk_bytes_(uint64_t chunk_id) const {
+        const uint8_t* ptr = chunk_ptrs_[chunk_id].get();
+        if constexpr (OffsetIndex) {
+            return chunk_header::size(ptr, ChunkSize) + chunk_header::get_data_bytes(ptr, ChunkSize);
+        }
+        const uint8_t* begin = ptr;
+        uint64_t alloc = 0;
+        for (uint64_t i = 0; i < ChunkSize; ++i) {
+            ptr += vbyte::decode(ptr, alloc);
+            ptr += alloc;
+        }
+        return static_cast<uint64_t>(ptr - begin);
+    }
+
     void release_buf_() {
-        label_bytes_ += chunk_buf_.size();
-        auto new_uptr = std::make_unique<uint8_t[]>(chunk_buf_.size());
-        std::copy(chunk_buf_.begin(), chunk_buf_.end(), new_uptr.get());
+        const uint64_t head = OffsetIndex ? chunk_header::size(ChunkSize, chunk_buf_.size()) : 0;
+        label_bytes_ += head + chunk_buf_.size();
+        auto new_uptr = std::make_unique<uint8_t[]>(head + chunk_buf_.size());
+        std::copy(chunk_buf_.begin(), chunk_buf_.end(), new_uptr.get() + head);
+        if constexpr (OffsetIndex) {
+            chunk_header::write(new_uptr.get(), ChunkSize, chunk_buf_.size());
+        }
         chunk_ptrs_.emplace_back(std::move(new_uptr));
         chunk_buf_.clear();
     }
@@ -24,27 +24,44 @@
 #ifndef POPLAR_TRIE_COMPACT_FKHASH_TRIE_HPP
 #define POPLAR_TRIE_COMPACT_FKHASH_TRIE_HPP
 
+#include <memory>
+
 #include "bijective_hash.hpp"
 #include "bit_vector.hpp"
+#include "bucket_vector.hpp"
 #include "compact_hash_table.hpp"
 #include "compact_vector.hpp"
+#include "io_tools.hpp"
 #include "standard_hash_table.hpp"
 
 namespace poplar {
 
+// If Incremental is true, the hash table is resized incrementally as in plain_fkhash_trie.
+// If Reversible is true, the slot of each node is also kept to support get_parent_and_symb(),
+// where the key of the slot is restored with the inverse of the bijective hash function.
+// If Bucketed is true, the quotient, the first dsp and the ID of each slot are stored together in
+// 64-byte buckets, so that a probe usually touches one cache line instead of one line in each array.
+// With AuxCht = block_dsp_table, a long displacement costs one more cache line instead of a hash lookup.
 template <uint32_t MaxFactor = 90, uint32_t Dsp1Bits = 4, class AuxCht = compact_hash_table<7>,
-          class AuxMap = standard_hash_table<>, class Hasher = bijective_hash::split_mix_hasher>
+          class AuxMap = standard_hash_table<>, class Hasher = bijective_hash::split_mix_hasher,
+          bool Incremental = false, bool Reversible = false, bool Bucketed = false>
 class compact_fkhash_trie {
     static_assert(0 < MaxFactor and MaxFactor < 100);
     static_assert(0 < Dsp1Bits and Dsp1Bits < 64);
 
   public:
-    using this_type = compact_fkhash_trie<MaxFactor, Dsp1Bits, AuxCht, AuxMap, Hasher>;
+    using this_type =
+        compact_fkhash_trie<MaxFactor, Dsp1Bits, AuxCht, AuxMap, Hasher, Incremental, Reversible, Bucketed>;
     using aux_cht_type = AuxCht;
     using aux_map_type = AuxMap;
 
     static constexpr uint64_t nil_id = UINT64_MAX;
     static constexpr uint32_t min_capa_bits = 16;
+    static constexpr uint32_t max_factor = MaxFactor;
+    static constexpr bool incremental = Incremental;
+    static constexpr bool reversible = Reversible;
+    static constexpr bool bucketed = Bucketed;
+    static constexpr uint64_t migration_step = 200 / MaxFactor + 1;
 
     static constexpr uint32_t dsp1_bits = Dsp1Bits;
     static constexpr uint64_t dsp1_mask = (1ULL << dsp1_bits) - 1;
@@ -61,9 +78,17 @@ class compact_fkhash_trie {
         symb_size_ = size_p2{symb_bits};
         max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
         hasher_ = Hasher{capa_size_.bits() + symb_size_.bits()};
-        table_ = compact_vector{capa_size_.size(), symb_size_.bits() + dsp1_bits};
+        if constexpr (Bucketed) {
+            buckets_ = bucket_vector<2>{capa_size_.size(), {symb_size_.bits() + dsp1_bits, capa_size_.bits()}};
+            buckets_.fill(id_field, capa_size_.mask());
+        } else {
+            table_ = compact_vector{capa_size_.size(), symb_size_.bits() + dsp1_bits};
+            ids_ = compact_vector{capa_size_.size(), capa_size_.bits(), capa_size_.mask()};
+        }
         aux_cht_ = aux_cht_type{capa_size_.bits(), cht_capa_bits};
-        ids_ = compact_vector{capa_size_.size(), capa_size_.bits(), capa_size_.mask()};
+        if constexpr (Reversible) {
+            slots_ = compact_vector{capa_size_.size(), capa_size_.bits()};
+        }
     }
 
     ~compact_fkhash_trie() = default;
@@ -87,11 +112,11 @@ class compact_fkhash_trie {
         auto [quo, mod] = decompose_(hasher_.hash(make_key_(node_id, symb)));
 
         for (uint64_t i = mod, cnt = 0;; i = right_(i), ++cnt) {
-            uint64_t child_id = ids_[i];
+            uint64_t child_id = get_id_(i);
 
             if (child_id == capa_size_.mask()) {
                 // encounter an empty slot
-                return nil_id;
+                return find_old_child_(node_id, symb);
             }
 
             if (compare_dsp_(i, cnt) and quo == get_quo_(i)) {
@@ -100,18 +125,58 @@ class compact_fkhash_trie {
         }
     }
 
+    // Prefetches the initial slot probed by find_child(node_id, symb).
+    void prefetch_child(uint64_t node_id, uint64_t symb) const {
+        assert(node_id < capa_size_.size());
+        assert(symb < symb_size_.size());
+
+        auto [quo, mod] = decompose_(hasher_.hash(make_key_(node_id, symb)));
+        if constexpr (Bucketed) {
+            buckets_.prefetch(mod);
+        } else {
+            ids_.prefetch(mod);
+            table_.prefetch(mod);
+        }
+    }
+
+    // Expands the hash table in advance so that num_nodes nodes can be stored without resizing.
+    void reserve(uint64_t num_nodes) {
+        uint32_t new_capa_bits = capa_bits();
+        while (static_cast<uint64_t>((1ULL << new_capa_bits) * MaxFactor / 100.0) <= num_nodes) {
+            ++new_capa_bits;
+        }
+        if (capa_bits() < new_capa_bits) {
+            expand_(new_capa_bits);
+        }
+    }
+
     bool add_child(uint64_t& node_id, uint64_t symb) {
         assert(node_id < capa_size_.size());
         assert(symb < symb_size_.size());
 
         if (max_size() <= size()) {
-            expand_();
+            if constexpr (Incremental) {
+                start_expansion_();
+            } else {
+                expand_(capa_bits() + 1);
+            }
+        }
+
+        if constexpr (Incremental) {
+            if (old_ht_) {
+                migrate_(migration_step);
+                uint64_t child_id = find_old_child_(node_id, symb);
+                if (child_id != nil_id) {
+                    node_id = child_id;
+                    return false;  // already stored
+                }
+            }
         }
 
         auto [quo, mod] = decompose_(hasher_.hash(make_key_(node_id, symb)));
 
         for (uint64_t i = mod, cnt = 0;; i = right_(i), ++cnt) {
-            uint64_t child_id = ids_[i];
+            uint64_t child_id = get_id_(i);
 
             if (child_id == capa_size_.mask()) {
                 // encounter an empty slot
@@ -127,6 +192,25 @@ class compact_fkhash_trie {
         }
     }
 
+    std::pair<uint64_t, uint64_t> get_parent_and_symb(uint64_t node_id) const {
+        static_assert(Reversible, "get_parent_and_symb() needs Reversible.");
+        assert(node_id < size_);
+
+        if (node_id == get_root()) {
+            return {nil_id, 0};
+        }
+        if constexpr (Incremental) {
+            // The node is still in the old table if its slot has not been migrated.
+            if (old_ht_ and node_id < old_ht_->size() and num_migrated_ <= old_ht_->slots_[node_id]) {
+                return old_ht_->get_parent_and_symb(node_id);
+            }
+        }
+
+        uint64_t key = get_key_(slots_[node_id]);
+        // Returns pair (parent, label)
+        return std::make_pair(key >> symb_size_.bits(), key & symb_size_.mask());
+    }
+
     bool needs_to_expand() const {
         return max_size() <= size();
     }
@@ -160,9 +244,102 @@ class compact_fkhash_trie {
         bytes += aux_cht_.alloc_bytes();
         bytes += aux_map_.alloc_bytes();
         bytes += ids_.alloc_bytes();
+        bytes += buckets_.alloc_bytes();
+        bytes += slots_.alloc_bytes();
+        if (old_ht_) {
+            bytes += old_ht_->alloc_bytes();
+        }
         return bytes;
     }
 
+    // The old table under migration is also saved.
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, dsp1_bits);
+        io_tools::save_param(os, Reversible);
+        io_tools::save_param(os, Bucketed);
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, symb_size_.bits());
+        io_tools::save_value(os, size_);
+        hasher_.save(os);
+        if constexpr (Bucketed) {
+            buckets_.save(os);
+        } else {
+            table_.save(os);
+            ids_.save(os);
+        }
+        aux_cht_.save(os);
+        aux_map_.save(os);
+        if constexpr (Reversible) {
+            slots_.save(os);
+        }
+        io_tools::save_value(os, old_ht_ ? 1 : 0);
+        if (old_ht_) {
+            io_tools::save_value(os, num_migrated_);
+            old_ht_->save(os);
+        }
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, dsp1_bits);
+        io_tools::load_param(is, Reversible);
+        io_tools::load_param(is, Bucketed);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        symb_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = io_tools::load_value(is);
+        hasher_.load(is);
+        if constexpr (Bucketed) {
+            buckets_.load(is);
+        } else {
+            table_.load(is);
+            ids_.load(is);
+        }
+        aux_cht_.load(is);
+        aux_map_.load(is);
+        if constexpr (Reversible) {
+            slots_.load(is);
+        }
+        if (io_tools::load_value(is) != 0) {
+            POPLAR_THROW_IF(!Incremental, "The serialized data structure has a different type.");
+            num_migrated_ = io_tools::load_value(is);
+            old_ht_ = std::make_unique<this_type>();
+            old_ht_->load(is);
+        }
+        POPLAR_THROW_IF(table_size_() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+    // Makes the trie a read-only view over the bytes written by save().
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(dsp1_bits);
+        mapper.map_param(Reversible);
+        mapper.map_param(Bucketed);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        symb_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = mapper.map_value();
+        hasher_.load_view(mapper);
+        if constexpr (Bucketed) {
+            buckets_.load_view(mapper);
+        } else {
+            table_.load_view(mapper);
+            ids_.load_view(mapper);
+        }
+        aux_cht_.load_view(mapper);
+        aux_map_.load_view(mapper);
+        if constexpr (Reversible) {
+            slots_.load_view(mapper);
+        }
+        if (mapper.map_value() != 0) {
+            POPLAR_THROW_IF(!Incremental, "The serialized data structure has a different type.");
+            num_migrated_ = mapper.map_value();
+            old_ht_ = std::make_unique<this_type>();
+            old_ht_->load_view(mapper);
+        }
+        POPLAR_THROW_IF(table_size_() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "compact_fkhash_trie");
@@ -174,6 +351,7 @@ class compact_fkhash_trie {
         show_stat(os, indent, "symb_bits", symb_bits());
         show_stat(os, indent, "dsp1st_bits", dsp1_bits);
         show_stat(os, indent, "dsp2nd_bits", dsp2_bits);
+        show_stat(os, indent, "bucketed", Bucketed);
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "rate_dsp1st", double(num_dsps_[0]) / size());
         show_stat(os, indent, "rate_dsp2nd", double(num_dsps_[1]) / size());
@@ -200,15 +378,23 @@ class compact_fkhash_trie {
     aux_cht_type aux_cht_;  // 2nd dsp
     aux_map_type aux_map_;  // 3rd dsp
     compact_vector ids_;
+    bucket_vector<2> buckets_;  // fields of table_ and ids_ in buckets (only if Bucketed)
+    compact_vector slots_;  // slot IDs of the nodes (only if Reversible)
     uint64_t size_ = 0;  // # of registered nodes
     uint64_t max_size_ = 0;  // MaxFactor% of the capacity
     size_p2 capa_size_;
     size_p2 symb_size_;
+    // The old table under migration and the # of its slots already migrated (only if Incremental)
+    std::unique_ptr<this_type> old_ht_;
+    uint64_t num_migrated_ = 0;
 #ifdef POPLAR_EXTRA_STATS
     uint64_t num_resize_ = 0;
     uint64_t num_dsps_[3] = {};
 #endif
 
+    static constexpr uint32_t table_field = 0;
+    static constexpr uint32_t id_field = 1;
+
     uint64_t make_key_(uint64_t node_id, uint64_t symb) const {
         return (node_id << symb_size_.bits()) | symb;
     }
@@ -219,11 +405,38 @@ class compact_fkhash_trie {
         return (slot_id + 1) & capa_size_.mask();
     }
 
+    uint64_t get_table_(uint64_t slot_id) const {
+        if constexpr (Bucketed) {
+            return buckets_.get(slot_id, table_field);
+        } else {
+            return table_[slot_id];
+        }
+    }
+    uint64_t get_id_(uint64_t slot_id) const {
+        if constexpr (Bucketed) {
+            return buckets_.get(slot_id, id_field);
+        } else {
+            return ids_[slot_id];
+        }
+    }
+    void set_slot_(uint64_t slot_id, uint64_t v, uint64_t node_id) {
+        if constexpr (Bucketed) {
+            buckets_.set(slot_id, table_field, v);
+            buckets_.set(slot_id, id_field, node_id);
+        } else {
+            table_.set(slot_id, v);
+            ids_.set(slot_id, node_id);
+        }
+    }
+    uint64_t table_size_() const {
+        return Bucketed ? buckets_.size() : table_.size();
+    }
+
     uint64_t get_quo_(uint64_t slot_id) const {
-        return table_[slot_id] >> dsp1_bits;
+        return get_table_(slot_id) >> dsp1_bits;
     }
     uint64_t get_dsp_(uint64_t slot_id) const {
-        uint64_t dsp = table_[slot_id] & dsp1_mask;
+        uint64_t dsp = get_table_(slot_id) & dsp1_mask;
         if (dsp < dsp1_mask) {
             return dsp;
         }
@@ -237,7 +450,7 @@ class compact_fkhash_trie {
     }
 
     bool compare_dsp_(uint64_t slot_id, uint64_t rhs) const {
-        uint64_t lhs = table_[slot_id] & dsp1_mask;
+        uint64_t lhs = get_table_(slot_id) & dsp1_mask;
         if (lhs < dsp1_mask) {
             return lhs == rhs;
         }
@@ -258,8 +471,15 @@ class compact_fkhash_trie {
         return val == rhs;
     }
 
+    // Restores the key stored in the slot.
+    uint64_t get_key_(uint64_t slot_id) const {
+        uint64_t dist = get_dsp_(slot_id);
+        uint64_t init_id = dist <= slot_id ? slot_id - dist : capa_size_.size() - (dist - slot_id);
+        return hasher_.hash_inv(get_quo_(slot_id) << capa_size_.bits() | init_id);
+    }
+
     void update_slot_(uint64_t slot_id, uint64_t quo, uint64_t dsp, uint64_t node_id) {
-        assert(table_[slot_id] == 0);
+        assert(get_table_(slot_id) == 0);
         assert(quo < symb_size_.size());
 
         uint64_t v = quo << dsp1_bits;
@@ -286,42 +506,95 @@ class compact_fkhash_trie {
         }
 #endif
 
-        table_.set(slot_id, v);
-        ids_.set(slot_id, node_id);
+        set_slot_(slot_id, v, node_id);
+        if constexpr (Reversible) {
+            slots_.set(node_id, slot_id);
+        }
     }
 
-    void expand_() {
-        this_type new_ht{capa_bits() + 1, symb_size_.bits()};
-#ifdef POPLAR_EXTRA_STATS
-        new_ht.num_resize_ = num_resize_ + 1;
-#endif
+    uint64_t find_old_child_(uint64_t node_id, uint64_t symb) const {
+        if constexpr (Incremental) {
+            // Nodes added after starting the migration do not appear in the old table.
+            if (old_ht_ and node_id < old_ht_->size()) {
+                return old_ht_->find_child(node_id, symb);
+            }
+        }
+        return nil_id;
+    }
+
+    // Moves the item in slot i of ht to this table.
+    void move_slot_(const this_type& ht, uint64_t i) {
+        move_slot_(ht, i, ht.get_id_(i));
+    }
+    void move_slot_(const this_type& ht, uint64_t i, uint64_t node_id) {
+        if (node_id == ht.capa_size_.mask()) {
+            // encounter an empty slot
+            return;
+        }
+
+        uint64_t key = ht.get_key_(i);
 
-        for (uint64_t i = 0; i < capa_size_.size(); ++i) {
-            uint64_t node_id = ids_[i];
+        auto [quo, mod] = decompose_(hasher_.hash(key));
 
-            if (node_id == capa_size_.mask()) {
+        for (uint64_t new_i = mod, cnt = 0;; new_i = right_(new_i), ++cnt) {
+            if (get_id_(new_i) == capa_size_.mask()) {
                 // encounter an empty slot
-                continue;
+                update_slot_(new_i, quo, cnt, node_id);
+                break;
             }
+        }
+    }
 
-            uint64_t dist = get_dsp_(i);
-            uint64_t init_id = dist <= i ? i - dist : table_.size() - (dist - i);
-            uint64_t key = hasher_.hash_inv(get_quo_(i) << capa_size_.bits() | init_id);
+    void expand_(uint32_t new_capa_bits) {
+        migrate_(UINT64_MAX);
 
-            auto [quo, mod] = new_ht.decompose_(new_ht.hasher_.hash(key));
+        this_type new_ht{new_capa_bits, symb_size_.bits()};
+#ifdef POPLAR_EXTRA_STATS
+        new_ht.num_resize_ = num_resize_ + 1;
+#endif
 
-            for (uint64_t new_i = mod, cnt = 0;; new_i = new_ht.right_(new_i), ++cnt) {
-                if (new_ht.ids_[new_i] == new_ht.capa_size_.mask()) {
-                    // encounter an empty slot
-                    new_ht.update_slot_(new_i, quo, cnt, node_id);
-                    break;
-                }
+        if constexpr (Bucketed) {
+            for (uint64_t i = 0; i < capa_size_.size(); ++i) {
+                new_ht.move_slot_(*this, i);
+            }
+        } else {
+            uint64_t i = 0;
+            for (uint64_t node_id : ids_) {
+                new_ht.move_slot_(*this, i++, node_id);
             }
         }
 
         new_ht.size_ = size_;
         std::swap(*this, new_ht);
     }
+
+    void start_expansion_() {
+        migrate_(UINT64_MAX);
+
+        auto old_ht = std::make_unique<this_type>(std::move(*this));
+        *this = this_type{old_ht->capa_bits() + 1, old_ht->symb_bits()};
+#ifdef POPLAR_EXTRA_STATS
+        num_resize_ = old_ht->num_resize_ + 1;
+#endif
+        size_ = old_ht->size_;
+        old_ht_ = std::move(old_ht);
+        num_migrated_ = 0;
+    }
+
+    void migrate_(uint64_t num_slots) {
+        if (!old_ht_) {
+            return;
+        }
+
+        const uint64_t end = std::min(old_ht_->capa_size(), num_migrated_ + std::min(num_slots, old_ht_->capa_size()));
+        for (; num_migrated_ < end; ++num_migrated_) {
+            move_slot_(*old_ht_, num_migrated_);
+        }
+
+        if (num_migrated_ == old_ht_->capa_size()) {
+            old_ht_.reset();
+        }
+    }
 };
 
 }  // namespace poplar
@@ -28,6 +28,7 @@
 #include "bit_tools.hpp"
 #include "compact_vector.hpp"
 #include "exception.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
@@ -47,17 +48,7 @@ class compact_hash_table {
     compact_hash_table() = default;
 
     explicit compact_hash_table(uint32_t univ_bits, uint32_t capa_bits = min_capa_bits) {
-        univ_size_ = size_p2{univ_bits};
-        capa_size_ = size_p2{std::max(min_capa_bits, capa_bits)};
-
-        assert(capa_size_.bits() <= univ_size_.bits());
-
-        quo_size_ = size_p2{univ_size_.bits() - capa_size_.bits()};
-        quo_shift_ = 2 + val_bits;
-        quo_invmask_ = ~(quo_size_.mask() << quo_shift_);
-
-        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
-
+        set_sizes_(univ_bits, std::max(min_capa_bits, capa_bits));
         hasher_ = Hasher{univ_size_.bits()};
         table_ = compact_vector{capa_size_.size(), quo_size_.bits() + val_bits + 2, (val_mask << 2) | 1ULL};
     }
@@ -230,6 +221,44 @@ class compact_hash_table {
         return table_.alloc_bytes();
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, val_bits);
+        io_tools::save_value(os, univ_size_.bits());
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, size_);
+        hasher_.save(os);
+        table_.save(os);
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, val_bits);
+        const uint64_t univ_bits = io_tools::load_value(is);
+        const uint64_t capa_bits = io_tools::load_value(is);
+        const uint64_t size = io_tools::load_value(is);
+        if (univ_bits == 0) {
+            *this = this_type{};  // default constructed
+        } else {
+            POPLAR_THROW_IF(64 <= univ_bits or univ_bits < capa_bits, "The serialized data is broken.");
+            *this = this_type{static_cast<uint32_t>(univ_bits), static_cast<uint32_t>(capa_bits)};
+        }
+        size_ = size;
+        hasher_.load(is);
+        table_.load(is);
+    }
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(val_bits);
+        const uint64_t univ_bits = mapper.map_value();
+        const uint64_t capa_bits = mapper.map_value();
+        const uint64_t size = mapper.map_value();
+        POPLAR_THROW_IF(64 <= univ_bits or univ_bits < capa_bits, "The serialized data is broken.");
+        *this = this_type{};
+        if (univ_bits != 0) {
+            set_sizes_(static_cast<uint32_t>(univ_bits), static_cast<uint32_t>(capa_bits));
+        }
+        size_ = size;
+        hasher_.load_view(mapper);
+        table_.load_view(mapper);
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "compact_hash_table");
@@ -271,6 +300,19 @@ class compact_hash_table {
         }
     };
 
+    void set_sizes_(uint32_t univ_bits, uint32_t capa_bits) {
+        univ_size_ = size_p2{univ_bits};
+        capa_size_ = size_p2{capa_bits};
+
+        assert(capa_size_.bits() <= univ_size_.bits());
+
+        quo_size_ = size_p2{univ_size_.bits() - capa_size_.bits()};
+        quo_shift_ = 2 + val_bits;
+        quo_invmask_ = ~(quo_size_.mask() << quo_shift_);
+
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+    }
+
     uint64_t find_ass_cbit_(uint64_t slot_id) const {
         uint64_t dummy = 0;
         return find_ass_cbit_(slot_id, dummy);
@@ -24,14 +24,63 @@
 #ifndef POPLAR_TRIE_COMPACT_VECTOR_HPP
 #define POPLAR_TRIE_COMPACT_VECTOR_HPP
 
+#include <algorithm>
+#include <iterator>
 #include <vector>
 
 #include "bit_tools.hpp"
 #include "exception.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
 class compact_vector {
+  public:
+    // Forward iterator over the values, which advances a running bit offset instead of recomputing it
+    // from the index.
+    class const_iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = uint64_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = uint64_t;
+
+        const_iterator() = default;
+
+        uint64_t operator*() const {
+            return get_bits_(data_, pos_, width_, mask_);
+        }
+        const_iterator& operator++() {
+            ++i_;
+            pos_ += width_;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++*this;
+            return it;
+        }
+        bool operator==(const const_iterator& rhs) const {
+            return i_ == rhs.i_;
+        }
+        bool operator!=(const const_iterator& rhs) const {
+            return i_ != rhs.i_;
+        }
+
+      private:
+        friend class compact_vector;
+
+        const uint64_t* data_ = nullptr;
+        uint64_t i_ = 0;
+        uint64_t pos_ = 0;
+        uint64_t width_ = 0;
+        uint64_t mask_ = 0;
+
+        const_iterator(const compact_vector& vec, uint64_t i)
+            : data_{vec.data_}, i_{i}, pos_{i * vec.width_}, width_{vec.width_}, mask_{vec.mask_} {}
+    };
+
   public:
     compact_vector() = default;
 
@@ -42,12 +91,11 @@ class compact_vector {
         mask_ = (1ULL << width) - 1;
         width_ = width;
         chunks_.resize(bit_tools::words_for(size_ * width_), 0);
+        data_ = chunks_.data();
     }
 
     compact_vector(uint64_t size, uint32_t width, uint64_t init) : compact_vector{size, width} {
-        for (uint64_t i = 0; i < size; ++i) {
-            set(i, init);
-        }
+        fill(init);
     }
 
     ~compact_vector() = default;
@@ -55,6 +103,17 @@ class compact_vector {
     void resize(uint64_t size) {
         size_ = size;
         chunks_.resize(bit_tools::words_for(size_ * width_));
+        data_ = chunks_.data();
+    }
+
+    void reserve(uint64_t capa) {
+        chunks_.reserve(bit_tools::words_for(capa * width_));
+        data_ = chunks_.data();
+    }
+
+    void push_back(uint64_t v) {
+        resize(size_ + 1);
+        set(size_ - 1, v);
     }
 
     uint64_t operator[](uint64_t i) const {
@@ -63,19 +122,21 @@ class compact_vector {
 
     uint64_t get(uint64_t i) const {
         assert(i < size_);
+        return get_bits_(data_, i * width_, width_, mask_);
+    }
 
-        auto [quo, mod] = decompose_value<64>(i * width_);
-
-        if (mod + width_ <= 64) {
-            return (chunks_[quo] >> mod) & mask_;
-        } else {
-            return ((chunks_[quo] >> mod) | (chunks_[quo + 1] << (64 - mod))) & mask_;
+    // Decodes the n values from the i-th one into out[0..n).
+    void get_range(uint64_t i, uint64_t n, uint64_t* out) const {
+        assert(i + n <= size_);
+        for (uint64_t j = 0, pos = i * width_; j < n; ++j, pos += width_) {
+            out[j] = get_bits_(data_, pos, width_, mask_);
         }
     }
 
     void set(uint64_t i, uint64_t v) {
         assert(i < size_);
         assert(v <= mask_);
+        assert(!is_view());
 
         auto [quo, mod] = decompose_value<64>(i * width_);
 
@@ -89,16 +150,95 @@ class compact_vector {
         }
     }
 
+    // Sets all the values to v. The bits of v repeat every width/gcd(width,64) words, so only that period
+    // is packed and the rest is copied word by word.
+    void fill(uint64_t v) {
+        assert(v <= mask_);
+        assert(!is_view());
+
+        const uint64_t num_words = bit_tools::words_for(size_ * width_);
+        if (num_words == 0) {
+            return;
+        }
+
+        uint64_t period = width_;  // width / gcd(width, 64)
+        while (period % 2 == 0) {
+            period /= 2;
+        }
+
+        uint64_t word = 0, mod = 0;
+        for (uint64_t quo = 0; quo < std::min(period, num_words);) {
+            word |= v << mod;
+            mod += width_;
+            if (64 <= mod) {
+                chunks_[quo++] = word;
+                mod -= 64;
+                word = mod == 0 ? 0 : v >> (width_ - mod);
+            }
+        }
+        for (uint64_t quo = period; quo < num_words; ++quo) {
+            chunks_[quo] = chunks_[quo - period];
+        }
+
+        // clears the bits beyond the last value
+        if (const uint64_t rest = (size_ * width_) % 64; rest != 0) {
+            chunks_[num_words - 1] &= (1ULL << rest) - 1;
+        }
+    }
+
+    void prefetch(uint64_t i) const {
+        assert(i < size_);
+        prefetch_address(&data_[i * width_ / 64]);
+    }
+
+    const_iterator begin() const {
+        return const_iterator{*this, 0};
+    }
+    const_iterator end() const {
+        return const_iterator{*this, size_};
+    }
+
     uint64_t size() const {
         return size_;
     }
     uint32_t width() const {
         return width_;
     }
+    // Whether the vector is a read-only view over mapped bytes.
+    bool is_view() const {
+        return data_ != chunks_.data();
+    }
     uint64_t alloc_bytes() const {
         return chunks_.capacity() * sizeof(uint64_t);
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, width_);
+        io_tools::save_value(os, bit_tools::words_for(size_ * width_));
+        io_tools::save_bytes(os, data_, bit_tools::words_for(size_ * width_) * sizeof(uint64_t));
+    }
+    void load(std::istream& is) {
+        size_ = io_tools::load_value(is);
+        width_ = io_tools::load_value(is);
+        POPLAR_THROW_IF(64 <= width_, "width overflow.");
+        mask_ = (1ULL << width_) - 1;
+        io_tools::load_vector(is, chunks_);
+        POPLAR_THROW_IF(chunks_.size() != bit_tools::words_for(size_ * width_), "The serialized data is broken.");
+        data_ = chunks_.data();
+    }
+    // Makes the vector a read-only view over the bytes written by save(), without copying them.
+    void load_view(io_tools::mapper& mapper) {
+        size_ = mapper.map_value();
+        width_ = mapper.map_value();
+        POPLAR_THROW_IF(64 <= width_, "width overflow.");
+        mask_ = (1ULL << width_) - 1;
+        chunks_ = std::vector<uint64_t>{};
+        const uint64_t num_words = mapper.map_value();
+        POPLAR_THROW_IF(num_words != bit_tools::words_for(size_ * width_), "The serialized data is broken.");
+        data_ = mapper.map_array<uint64_t>(num_words);
+    }
+
     compact_vector(const compact_vector&) = delete;
     compact_vector& operator=(const compact_vector&) = delete;
 
@@ -107,9 +247,24 @@ class compact_vector {
 
   private:
     std::vector<uint64_t> chunks_;
+    const uint64_t* data_ = nullptr;  // chunks_.data() or the mapped bytes
     uint64_t size_ = 0;
     uint64_t mask_ = 0;
     uint64_t width_ = 0;
+
+    static uint64_t get_bits_(const uint64_t* data, uint64_t pos, uint64_t width, uint64_t mask) {
+        auto [quo, mod] = decompose_value<64>(pos);
+        uint64_t x = data[quo] >> mod;
+        if (64 < mod + width) {
+            x |= data[quo + 1] << (64 - mod);
+        }
+#ifdef __BMI2__
+        static_cast<void>(mask);
+        return _bzhi_u64(x, static_cast<uint32_t>(width));
+#else
+        return x & mask;
+#endif
+    }
 };
 
 }  // namespace poplar
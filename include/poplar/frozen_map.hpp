@@ -0,0 +1,120 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_FROZEN_MAP_HPP
+#define POPLAR_TRIE_FROZEN_MAP_HPP
+
+#include "map.hpp"
+#include "mapped_file.hpp"
+
+namespace poplar {
+
+// Read-only map served directly from a file written by map::save(). The file is memory-mapped and
+// the containers are views over the mapped bytes, so opening does not parse nor copy the data.
+// Exceptionally, the page table of label_arena and the small auxiliary maps are built on opening.
+// Map is an instance of map, such as compact_bonsai_map<int>.
+template <typename Map>
+class frozen_map {
+  public:
+    using map_type = Map;
+    using value_type = typename map_type::value_type;
+    using const_iterator = typename map_type::const_iterator;
+
+  public:
+    frozen_map() = default;
+
+    explicit frozen_map(const std::string& filepath) : file_(filepath) {
+        io_tools::mapper mapper(file_.data(), file_.size());
+        map_.load_view(mapper);
+    }
+
+    ~frozen_map() = default;
+
+    const value_type* find(std::string_view key) const {
+        return map_.find(key);
+    }
+    const value_type* find(char_range key) const {
+        return map_.find(key);
+    }
+    void find_batch(const char_range* keys, uint64_t num_keys, const value_type** vptrs) const {
+        map_.find_batch(keys, num_keys, vptrs);
+    }
+
+    // Enumerates the registered keys as map (only if the trie is reversible).
+    const_iterator begin() const {
+        return map_.begin();
+    }
+    const_iterator end() const {
+        return map_.end();
+    }
+    std::vector<std::pair<const_iterator, const_iterator>> split_ranges(uint64_t num_ranges) const {
+        return map_.split_ranges(num_ranges);
+    }
+
+    // Enumerates the keys that are prefixes of the text as map.
+    template <class Fn>
+    void common_prefix_search(std::string_view text, Fn&& fn) const {
+        map_.common_prefix_search(text, std::forward<Fn>(fn));
+    }
+
+    // Enumerates the keys starting with the prefix as map (only if the map has the child index).
+    template <class Fn>
+    void predictive_search(std::string_view prefix, Fn&& fn) const {
+        map_.predictive_search(prefix, std::forward<Fn>(fn));
+    }
+
+    // Gets the number of registered keys.
+    uint64_t size() const {
+        return map_.size();
+    }
+    // Gets the bytes of the mapped file.
+    uint64_t mapped_bytes() const {
+        return file_.size();
+    }
+    // Gets the bytes allocated on the heap besides the mapped file.
+    uint64_t alloc_bytes() const {
+        return map_.alloc_bytes();
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "frozen_map");
+        show_stat(os, indent, "mapped_bytes", mapped_bytes());
+        show_member(os, indent, "map_");
+        map_.show_stats(os, n + 1);
+    }
+
+    frozen_map(const frozen_map&) = delete;
+    frozen_map& operator=(const frozen_map&) = delete;
+
+    frozen_map(frozen_map&&) noexcept = default;
+    frozen_map& operator=(frozen_map&&) noexcept = default;
+
+  private:
+    mapped_file file_;  // declared before map_ to outlive it
+    map_type map_;
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_FROZEN_MAP_HPP
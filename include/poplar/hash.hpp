@@ -51,6 +51,20 @@ struct vigna_hasher {
     uint64_t seed_ = 0x9e3779b97f4a7c15ULL;
 };
 
+// Hashes the bytes of key by folding every 8 bytes through vigna_hasher.
+inline uint64_t hash_range(char_range key) {
+    uint64_t h = key.length();
+    const uint8_t* ptr = key.begin;
+    for (; ptr + 8 <= key.end; ptr += 8) {
+        uint64_t x;
+        std::memcpy(&x, ptr, 8);
+        h = vigna_hasher::hash(h ^ x);
+    }
+    uint64_t x = 0;
+    std::memcpy(&x, ptr, static_cast<uint64_t>(key.end - ptr));
+    return vigna_hasher::hash(h ^ x);
+}
+
 }  // namespace poplar::hash
 
 #endif  // POPLAR_TRIE_HASH_HPP
@@ -0,0 +1,154 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_IO_TOOLS_HPP
+#define POPLAR_TRIE_IO_TOOLS_HPP
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+#include "basics.hpp"
+#include "exception.hpp"
+
+// Binary serialization of the data structures.
+// Every scalar is written in 8 bytes and every array is padded to a multiple of 8 bytes, so that
+// all the arrays are 8-byte aligned in a serialized file. The byte order is the native one.
+namespace poplar::io_tools {
+
+static constexpr uint64_t magic_number = 0x454952545241504FULL;  // "OPARTRIE"
+static constexpr uint64_t format_version = 2;
+
+inline uint64_t padding_bytes(uint64_t bytes) {
+    return (8 - bytes % 8) % 8;
+}
+
+inline void save_value(std::ostream& os, uint64_t v) {
+    os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+inline uint64_t load_value(std::istream& is) {
+    uint64_t v = 0;
+    is.read(reinterpret_cast<char*>(&v), sizeof(v));
+    POPLAR_THROW_IF(!is, "failed to read a value.");
+    return v;
+}
+
+// Writes an array of bytes as is.
+inline void save_raw(std::ostream& os, const void* data, uint64_t bytes) {
+    os.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+}
+inline void load_raw(std::istream& is, void* data, uint64_t bytes) {
+    is.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(bytes));
+    POPLAR_THROW_IF(!is, "failed to read bytes.");
+}
+
+// Writes the given # of zeros.
+inline void save_zeros(std::ostream& os, uint64_t bytes) {
+    static const char zeros[64] = {};
+    for (; 64 <= bytes; bytes -= 64) {
+        os.write(zeros, 64);
+    }
+    os.write(zeros, static_cast<std::streamsize>(bytes));
+}
+inline void skip_bytes(std::istream& is, uint64_t bytes) {
+    is.ignore(static_cast<std::streamsize>(bytes));
+    POPLAR_THROW_IF(!is, "failed to read bytes.");
+}
+
+// Writes an array of bytes followed by zeros padded to a multiple of 8 bytes.
+inline void save_bytes(std::ostream& os, const void* data, uint64_t bytes) {
+    save_raw(os, data, bytes);
+    save_zeros(os, padding_bytes(bytes));
+}
+inline void load_bytes(std::istream& is, void* data, uint64_t bytes) {
+    load_raw(is, data, bytes);
+    skip_bytes(is, padding_bytes(bytes));
+}
+
+template <class T>
+void save_vector(std::ostream& os, const std::vector<T>& vec) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    save_value(os, vec.size());
+    save_bytes(os, vec.data(), vec.size() * sizeof(T));
+}
+template <class T>
+void load_vector(std::istream& is, std::vector<T>& vec) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    vec.resize(load_value(is));
+    load_bytes(is, vec.data(), vec.size() * sizeof(T));
+}
+
+// Writes a template parameter or a property of the type, that is verified by load_param.
+inline void save_param(std::ostream& os, uint64_t v) {
+    save_value(os, v);
+}
+inline void load_param(std::istream& is, uint64_t expected) {
+    POPLAR_THROW_IF(load_value(is) != expected, "The serialized data structure has a different type.");
+}
+
+// Reads the bytes written by the save functions in place, for read-only views over a mapped file.
+// The given bytes should be 8-byte aligned.
+class mapper {
+  public:
+    mapper(const void* data, uint64_t bytes)
+        : ptr_(reinterpret_cast<const uint8_t*>(data)), end_(reinterpret_cast<const uint8_t*>(data) + bytes) {
+        POPLAR_THROW_IF(reinterpret_cast<uintptr_t>(data) % 8 != 0, "The mapped bytes are not 8-byte aligned.");
+    }
+
+    uint64_t map_value() {
+        uint64_t v = 0;
+        std::memcpy(&v, map_raw(sizeof(v)), sizeof(v));
+        return v;
+    }
+    // Gets the pointer to the array of bytes written by save_bytes.
+    const uint8_t* map_bytes(uint64_t bytes) {
+        const uint8_t* data = map_raw(bytes);
+        map_raw(padding_bytes(bytes));
+        return data;
+    }
+    template <class T>
+    const T* map_array(uint64_t num) {
+        static_assert(std::is_trivially_copyable_v<T> and alignof(T) <= 8);
+        return reinterpret_cast<const T*>(map_bytes(num * sizeof(T)));
+    }
+    void map_param(uint64_t expected) {
+        POPLAR_THROW_IF(map_value() != expected, "The serialized data structure has a different type.");
+    }
+    // Gets the pointer to the array of bytes written by save_raw.
+    const uint8_t* map_raw(uint64_t bytes) {
+        POPLAR_THROW_IF(static_cast<uint64_t>(end_ - ptr_) < bytes, "The mapped bytes are too short.");
+        const uint8_t* data = ptr_;
+        ptr_ += bytes;
+        return data;
+    }
+
+  private:
+    const uint8_t* ptr_ = nullptr;
+    const uint8_t* end_ = nullptr;
+};
+
+}  // namespace poplar::io_tools
+
+#endif  // POPLAR_TRIE_IO_TOOLS_HPP
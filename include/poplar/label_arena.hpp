@@ -0,0 +1,194 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_LABEL_ARENA_HPP
+#define POPLAR_TRIE_LABEL_ARENA_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "basics.hpp"
+#include "io_tools.hpp"
+
+namespace poplar {
+
+// Append-only byte arena for labels. The bytes are carved from pages of 2**PageBits bytes and are
+// referred to by offsets, that is, (page ID) * 2**PageBits + (position in the page).
+// A buffer larger than a page occupies the offsets of several consecutive pages and is allocated in one block.
+// The addresses of allocated buffers never change, and the memory is released only at destruction.
+// A buffer released by deallocate() is recycled for the next allocation of the same bytes, where the free
+// lists are not serialized.
+// Since every page is backed, the arena is serialized as the bytes of the offsets in [0, size()).
+template <uint32_t PageBits = 16>
+class label_arena {
+  public:
+    static constexpr uint64_t page_bytes = 1ULL << PageBits;
+
+  public:
+    label_arena() = default;
+
+    ~label_arena() = default;
+
+    // Allocates a buffer of the given bytes and returns its offset.
+    uint64_t allocate(uint64_t bytes) {
+        assert(bytes != 0);
+
+        if (auto it = free_lists_.find(bytes); it != free_lists_.end() and !it->second.empty()) {
+            const uint64_t offset = it->second.back();
+            it->second.pop_back();
+            --num_frees_;
+            return offset;
+        }
+
+        if ((pages_.size() << PageBits) - pos_ < bytes) {
+            pos_ = pages_.size() << PageBits;
+
+            const uint64_t num_pages = (bytes + page_bytes - 1) >> PageBits;
+            const uint64_t block_bytes = num_pages << PageBits;
+
+            blocks_.emplace_back(std::make_unique<uint8_t[]>(block_bytes));
+            alloc_block_bytes_ += block_bytes;
+            for (uint64_t i = 0; i < num_pages; ++i) {
+                pages_.push_back(blocks_.back().get() + (i << PageBits));
+            }
+
+            if (1 < num_pages) {
+                // The rest of the last page is not used for other buffers
+                const uint64_t offset = pos_;
+                pos_ = pages_.size() << PageBits;
+                return offset;
+            }
+        }
+
+        const uint64_t offset = pos_;
+        pos_ += bytes;
+        return offset;
+    }
+
+    // Releases the buffer of the given bytes at the offset. The buffers larger than a page are not recycled.
+    void deallocate(uint64_t offset, uint64_t bytes) {
+        assert(offset + bytes <= pos_);
+        if (bytes <= page_bytes) {
+            free_lists_[bytes].push_back(offset);
+            ++num_frees_;
+        }
+    }
+
+    uint8_t* get(uint64_t offset) {
+        assert(offset < pos_);
+        return pages_[offset >> PageBits] + (offset & (page_bytes - 1));
+    }
+    const uint8_t* get(uint64_t offset) const {
+        assert(offset < pos_);
+        return pages_[offset >> PageBits] + (offset & (page_bytes - 1));
+    }
+
+    // Gets the end of the offsets used so far.
+    uint64_t size() const {
+        return pos_;
+    }
+    uint64_t num_pages() const {
+        return pages_.size();
+    }
+    uint64_t alloc_bytes() const {
+        uint64_t bytes = 0;
+        bytes += pages_.capacity() * sizeof(uint8_t*);
+        bytes += blocks_.capacity() * sizeof(std::unique_ptr<uint8_t[]>);
+        bytes += alloc_block_bytes_;
+        bytes += num_frees_ * sizeof(uint64_t);
+        return bytes;
+    }
+
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, pos_);
+        for (uint64_t i = 0; i < pages_.size(); ++i) {
+            io_tools::save_raw(os, pages_[i], std::min(page_bytes, pos_ - (i << PageBits)));
+        }
+        io_tools::save_zeros(os, io_tools::padding_bytes(pos_));
+    }
+    // The pages are loaded into one block.
+    void load(std::istream& is) {
+        *this = label_arena{};
+        pos_ = io_tools::load_value(is);
+        if (pos_ == 0) {
+            return;
+        }
+
+        const uint64_t num_pages = (pos_ + page_bytes - 1) >> PageBits;
+        const uint64_t block_bytes = num_pages << PageBits;
+
+        blocks_.emplace_back(std::make_unique<uint8_t[]>(block_bytes));
+        alloc_block_bytes_ = block_bytes;
+        for (uint64_t i = 0; i < num_pages; ++i) {
+            pages_.push_back(blocks_.back().get() + (i << PageBits));
+        }
+
+        io_tools::load_raw(is, blocks_.back().get(), pos_);
+        io_tools::skip_bytes(is, io_tools::padding_bytes(pos_));
+    }
+    // Makes the arena a read-only view over the bytes written by save(). Only the page table is built,
+    // whose length is size() / page_bytes.
+    void load_view(io_tools::mapper& mapper) {
+        *this = label_arena{};
+        pos_ = mapper.map_value();
+
+        // The bytes are never written through the pages of a view.
+        uint8_t* base = const_cast<uint8_t*>(mapper.map_raw(pos_ + io_tools::padding_bytes(pos_)));
+        const uint64_t num_pages = (pos_ + page_bytes - 1) >> PageBits;
+        pages_.reserve(num_pages);
+        for (uint64_t i = 0; i < num_pages; ++i) {
+            pages_.push_back(base + (i << PageBits));
+        }
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "label_arena");
+        show_stat(os, indent, "page_bytes", page_bytes);
+        show_stat(os, indent, "size", size());
+        show_stat(os, indent, "num_pages", num_pages());
+        show_stat(os, indent, "num_frees", num_frees_);
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+    }
+
+    label_arena(const label_arena&) = delete;
+    label_arena& operator=(const label_arena&) = delete;
+
+    label_arena(label_arena&&) noexcept = default;
+    label_arena& operator=(label_arena&&) noexcept = default;
+
+  private:
+    std::vector<uint8_t*> pages_;
+    std::vector<std::unique_ptr<uint8_t[]>> blocks_;
+    uint64_t pos_ = 0;
+    uint64_t alloc_block_bytes_ = 0;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> free_lists_;  // offsets of released buffers by bytes
+    uint64_t num_frees_ = 0;
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_LABEL_ARENA_HPP
@@ -0,0 +1,214 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_LEFT_RIGHT_MAP_HPP
+#define POPLAR_TRIE_LEFT_RIGHT_MAP_HPP
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "map.hpp"
+
+namespace poplar {
+
+// Map whose readers never lock nor wait, with writers serialized, in the left-right scheme
+// (an RCU-style technique). Two copies of the map are kept. Readers go to the copy published through
+// an atomic index, while a writer modifies the other copy, publishes it, waits for the readers of the
+// old copy to leave, and replays the modification on the old copy. Thus, readers never see a partial
+// update nor block behind expansion, and nothing read is freed under them.
+// The price is twice the memory of map and twice the work of writers, amortized by update_batch().
+// Map is an instance of map, such as compact_bonsai_map<int>.
+template <typename Map>
+class left_right_map {
+  public:
+    using this_type = left_right_map<Map>;
+    using map_type = Map;
+    using value_type = typename map_type::value_type;
+
+    static constexpr uint32_t num_stripes = 32;  // # of counters that readers are spread over
+
+  public:
+    left_right_map() = default;
+
+    explicit left_right_map(uint32_t capa_bits, uint64_t lambda = 32)
+        : maps_{map_type{capa_bits, lambda}, map_type{capa_bits, lambda}} {}
+
+    ~left_right_map() = default;
+
+    // Calls fn(map) for the const reference to the published map and returns its result.
+    // Any const member function of map can be used in fn, but the pointers obtained must not be used after.
+    template <class Fn>
+    auto read(Fn&& fn) const {
+        reader_guard_ guard(*this);
+        return fn(static_cast<const map_type&>(maps_[guard.map_index]));
+    }
+
+    // Searches the given key and returns a copy of the value if registered.
+    std::optional<value_type> find(std::string_view key) const {
+        return find(make_char_range(key));
+    }
+    std::optional<value_type> find(char_range key) const {
+        return read([&](const map_type& map) {
+            auto vptr = map.find(key);
+            return vptr != nullptr ? std::optional<value_type>{*vptr} : std::nullopt;
+        });
+    }
+
+    // Calls fn(map) for both the copies and publishes the modification. fn must modify the two identical
+    // copies identically, that is, must not depend on any state other than the map.
+    template <class Fn>
+    void write(Fn&& fn) {
+        std::lock_guard lock(writer_mutex_);
+
+        const uint32_t map_index = map_index_.load(std::memory_order_relaxed);
+        fn(maps_[map_index ^ 1]);
+        map_index_.store(map_index ^ 1, std::memory_order_seq_cst);
+        wait_for_readers_();
+        fn(maps_[map_index]);
+    }
+
+    // Inserts the given key with the value.
+    void update(std::string_view key, const value_type& value) {
+        update(make_char_range(key), value);
+    }
+    void update(char_range key, const value_type& value) {
+        write([&](map_type& map) { *map.update(key) = value; });
+    }
+
+    // Inserts the given keys with values[0..num_keys) and publishes them at once.
+    void update_batch(const char_range* keys, uint64_t num_keys, const value_type* values) {
+        write([&](map_type& map) {
+            std::vector<value_type*> vptrs(num_keys);
+            map.update_batch(keys, num_keys, vptrs.data());
+            for (uint64_t i = 0; i < num_keys; ++i) {
+                *vptrs[i] = values[i];
+            }
+        });
+    }
+
+    // Removes the given key and returns true if registered (only if map_type is erasable).
+    bool erase(std::string_view key) {
+        return erase(make_char_range(key));
+    }
+    bool erase(char_range key) {
+        bool erased = false;
+        write([&](map_type& map) { erased = map.erase(key); });
+        return erased;
+    }
+
+    // Gets the number of registered keys.
+    uint64_t size() const {
+        return read([](const map_type& map) { return map.size(); });
+    }
+    // Gets the bytes of the two copies.
+    uint64_t alloc_bytes() const {
+        std::lock_guard lock(writer_mutex_);
+        return maps_[0].alloc_bytes() + maps_[1].alloc_bytes();
+    }
+
+    void save(std::ostream& os) const {
+        read([&](const map_type& map) { map.save(os); });
+    }
+    // Must not be called concurrently with any other member function.
+    // Each copy is loaded from the same bytes, so the stream must be seekable.
+    void load(std::istream& is) {
+        const auto pos = is.tellg();
+        POPLAR_THROW_IF(pos == std::istream::pos_type(-1), "The stream is not seekable.");
+        maps_[0].load(is);
+        is.seekg(pos);
+        POPLAR_THROW_IF(!is, "The stream is not seekable.");
+        maps_[1].load(is);
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "left_right_map");
+        show_stat(os, indent, "num_stripes", num_stripes);
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_member(os, indent, "map_");
+        read([&](const map_type& map) { map.show_stats(os, n + 1); });
+    }
+
+    left_right_map(const left_right_map&) = delete;
+    left_right_map& operator=(const left_right_map&) = delete;
+
+  private:
+    // Aligned to cache lines so that readers on different stripes do not share a line
+    struct alignas(64) counter_ {
+        std::atomic<uint64_t> value{0};
+    };
+
+    std::array<map_type, 2> maps_;
+    std::atomic<uint32_t> map_index_{0};  // index of the map read by readers
+    std::atomic<uint32_t> epoch_{0};  // index of the counters incremented by new readers
+    mutable std::array<std::array<counter_, num_stripes>, 2> counters_;
+    mutable std::mutex writer_mutex_;
+
+    // Registers a reader in the current epoch while it is alive.
+    struct reader_guard_ {
+        std::atomic<uint64_t>& counter;
+        uint32_t map_index;
+
+        explicit reader_guard_(const left_right_map& m)
+            : counter(m.counters_[m.epoch_.load(std::memory_order_seq_cst)][get_stripe_()].value) {
+            counter.fetch_add(1, std::memory_order_seq_cst);
+            map_index = m.map_index_.load(std::memory_order_seq_cst);
+        }
+        ~reader_guard_() {
+            counter.fetch_sub(1, std::memory_order_release);
+        }
+    };
+
+    static uint32_t get_stripe_() {
+        static thread_local const uint32_t stripe =
+            static_cast<uint32_t>(std::hash<std::thread::id>{}(std::this_thread::get_id()) % num_stripes);
+        return stripe;
+    }
+
+    // The loads are sequentially consistent to pair with the reader's increment-then-load of map_index_;
+    // an acquire load could observe 0 while a reader still uses the old index.
+    void wait_until_empty_(uint32_t epoch) const {
+        for (const auto& c : counters_[epoch]) {
+            while (c.value.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Waits until no reader may see the map unpublished by the last write. Readers registered in
+    // either epoch before the switch may have loaded the old index, so both epochs are drained in turn.
+    void wait_for_readers_() {
+        const uint32_t epoch = epoch_.load(std::memory_order_relaxed);
+        wait_until_empty_(epoch ^ 1);
+        epoch_.store(epoch ^ 1, std::memory_order_seq_cst);
+        wait_until_empty_(epoch);
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_LEFT_RIGHT_MAP_HPP
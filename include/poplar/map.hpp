@@ -24,28 +24,54 @@
 #ifndef POPLAR_TRIE_MAP_HPP
 #define POPLAR_TRIE_MAP_HPP
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "bit_tools.hpp"
+#include "child_index.hpp"
+#include "compact_vector.hpp"
 #include "exception.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
 // This class implements an updatable associative array whose keys are strings.
+// Keys are given as std::string_view or char_range delimited by the length, and may contain '\0'.
 // The data structure is based on a dynamic path-decomposed trie described in the following paper,
 // - "Dynamic Path-Decomposed Tries" available at https://arxiv.org/abs/1906.06015.
-template <typename Trie, typename NLM>
+// If ChildIndex is true, the children of each node are also linked for predictive_search().
+// For Bonsai tries, the hash table can be expanded on a background thread (see set_background_expansion()).
+template <typename Trie, typename NLM, bool ChildIndex = false>
 class map {
     static_assert(Trie::trie_type_id == NLM::trie_type_id);
 
   public:
-    using this_type = map<Trie, NLM>;
+    using this_type = map<Trie, NLM, ChildIndex>;
     using trie_type = Trie;
     using value_type = typename NLM::value_type;
 
     static constexpr auto trie_type_id = Trie::trie_type_id;
+    static constexpr bool has_child_index = ChildIndex;
+    static constexpr bool erasable = ChildIndex and trie_type_id == trie_type_ids::BONSAI_TRIE;
     static constexpr uint32_t min_capa_bits = Trie::min_capa_bits;
+    static constexpr uint64_t batch_width = 16;  // # of keys interleaved in find_batch() and update_batch()
+    // # of buffered keys moved into the map by an update() or update_batch() after a background expansion
+    static constexpr uint64_t replays_per_update = 64;
 
   public:
     // Generic constructor.
@@ -60,138 +86,689 @@ class map {
         lambda_ = lambda;
         hash_trie_ = Trie{capa_bits, 8 + bit_tools::ceil_log2(lambda_)};
         label_store_ = NLM{hash_trie_.capa_bits()};
+        if constexpr (ChildIndex) {
+            child_index_ = child_index{hash_trie_.capa_bits()};
+        }
+        if constexpr (erasable) {
+            erased_ = compact_vector{hash_trie_.capa_size(), 1};
+        }
         codes_.fill(UINT8_MAX);
-        codes_[0] = static_cast<uint8_t>(num_codes_++);  // terminator
+        num_codes_ = term_code + 1;
     }
 
     // Generic destructor.
-    ~map() = default;
+    ~map() {
+        if (expansion_ != nullptr and expansion_->thread.joinable()) {
+            expansion_->thread.join();
+        }
+    }
 
     // Searches the given key and returns the value pointer if registered;
     // otherwise returns nullptr.
-    const value_type* find(const std::string& key) const {
+    const value_type* find(std::string_view key) const {
         return find(make_char_range(key));
     }
     const value_type* find(char_range key) const {
-        POPLAR_THROW_IF(key.empty(), "key must be a non-empty string.");
-        POPLAR_THROW_IF(*(key.end - 1) != '\0', "The last character of key must be the null terminator.");
+        if (expansion_ != nullptr) {
+            auto it = expansion_->buffer.find(make_key_view_(key));
+            if (it != expansion_->buffer.end()) {
+                return &it->second;
+            }
+        }
+
+        auto [node_id, vptr] = find_node_(key);
+        return vptr != nullptr and !is_erased_(node_id) ? vptr : nullptr;
+    }
 
+    // Searches the given keys and stores the value pointers in vptrs[0..num_keys),
+    // as the same as find(). Up to batch_width searches are interleaved so that
+    // the memory accesses of a key are overlapped with the computation of the others.
+    void find_batch(const char_range* keys, uint64_t num_keys, const value_type** vptrs) const {
         if (!is_ready_ or hash_trie_.size() == 0) {
-            return nullptr;
+            std::fill(vptrs, vptrs + num_keys, nullptr);
+            return;
         }
 
-        auto node_id = hash_trie_.get_root();
-
-        while (!key.empty()) {
-            auto [vptr, match] = label_store_.compare(node_id, key);
-            if (vptr != nullptr) {
-                return vptr;
-            }
+        std::array<walk_state_, batch_width> states;
+        uint64_t num_states = 0, next_key = 0;
 
-            key.begin += match;
+        while (num_states < batch_width and next_key < num_keys) {
+            states[num_states++] = start_walk_(keys[next_key], next_key);
+            ++next_key;
+        }
 
-            while (lambda_ <= match) {
-                node_id = hash_trie_.find_child(node_id, step_symb);
-                if (node_id == nil_id) {
-                    return nullptr;
+        while (num_states != 0) {
+            for (uint64_t i = 0; i < num_states;) {
+                if (step_find_(states[i], vptrs)) {
+                    ++i;
+                } else if (next_key < num_keys) {
+                    states[i++] = start_walk_(keys[next_key], next_key);
+                    ++next_key;
+                } else {
+                    states[i] = states[--num_states];
                 }
-                match -= lambda_;
-            }
-
-            if (codes_[*key.begin] == UINT8_MAX) {
-                // Detecting an useless character
-                return nullptr;
             }
+        }
 
-            node_id = hash_trie_.find_child(node_id, make_symb_(*key.begin, match));
-            if (node_id == nil_id) {
-                return nullptr;
+        if (expansion_ != nullptr) {
+            for (uint64_t i = 0; i < num_keys; ++i) {
+                auto it = expansion_->buffer.find(make_key_view_(keys[i]));
+                if (it != expansion_->buffer.end()) {
+                    vptrs[i] = &it->second;
+                }
             }
-
-            ++key.begin;
         }
-
-        return label_store_.compare(node_id, key).first;
     }
 
     // Inserts the given key and returns the value pointer.
-    value_type* update(const std::string& key) {
+    value_type* update(std::string_view key) {
         return update(make_char_range(key));
     }
     value_type* update(char_range key) {
-        POPLAR_THROW_IF(key.empty(), "key must be a non-empty string.");
-        POPLAR_THROW_IF(*(key.end - 1) != '\0', "The last character of key must be the null terminator.");
+        if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+            if (soft_factor_ != 0 or expansion_ != nullptr) {
+                step_expansion_();
+                if (expansion_ != nullptr) {
+                    return update_expanding_(key);
+                }
+            }
+        }
+        return update_trie_(key);
+    }
+
+    // Inserts the given keys and stores the value pointers in vptrs[0..num_keys) if vptrs is not nullptr.
+    // The hash table is expanded in advance for num_keys new nodes, and up to batch_width insertions
+    // are interleaved as in find_batch(). The value pointers are collected after all the insertions,
+    // so they are not invalidated by resizing within the batch.
+    // During a background expansion, the keys are buffered as update().
+    void update_batch(const char_range* keys, uint64_t num_keys, value_type** vptrs = nullptr) {
+        if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+            if (soft_factor_ != 0 or expansion_ != nullptr) {
+                step_expansion_();
+                if (expansion_ != nullptr) {
+                    update_batch_expanding_(keys, num_keys, vptrs);
+                    return;
+                }
+            }
+        }
+
+        if (num_keys == 0) {
+            return;
+        }
+
+        reserve(hash_trie_.size() + num_keys);
 
+        uint64_t next_key = 0;
         if (hash_trie_.size() == 0) {
-            if (!is_ready_) {
-                *this = this_type{0};
+            update(keys[next_key++]);
+        }
+
+        // Pairs of the node having the value and the # of characters consumed until the node
+        std::vector<std::pair<uint64_t, uint64_t>> ends;
+        if (vptrs != nullptr) {
+            ends.resize(num_keys, {hash_trie_.get_root(), 0});
+        }
+
+        std::array<walk_state_, batch_width> states;
+        uint64_t num_states = 0;
+
+        while (num_states < batch_width and next_key < num_keys) {
+            states[num_states++] = start_walk_(keys[next_key], next_key);
+            ++next_key;
+        }
+
+        while (num_states != 0) {
+            for (uint64_t i = 0; i < num_states;) {
+                if (step_update_(states[i])) {
+                    ++i;
+                } else {
+                    if (vptrs != nullptr) {
+                        const auto& s = states[i];
+                        ends[s.key_id] = {s.node_id, s.key.begin - keys[s.key_id].begin};
+                    }
+                    if (next_key < num_keys) {
+                        states[i++] = start_walk_(keys[next_key], next_key);
+                        ++next_key;
+                    } else {
+                        states[i] = states[--num_states];
+                    }
+                }
+
+                if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+                    if (hash_trie_.needs_to_expand()) {
+                        // The node IDs held in the traversal are also updated.
+                        auto node_map = expand_bonsai_();
+                        for (uint64_t j = 0; j < num_states; ++j) {
+                            states[j].node_id = node_map[states[j].node_id];
+                        }
+                        for (uint64_t j = 0; j < ends.size(); ++j) {
+                            ends[j].first = node_map[ends[j].first];
+                        }
+                    }
+                }
             }
-            // The first insertion
+        }
+
+        for (uint64_t i = 0; i < ends.size(); ++i) {
+            if (i + batch_width < ends.size()) {
+                label_store_.prefetch(ends[i + batch_width].first);
+            }
+            auto [node_id, consumed] = ends[i];
+            char_range key{keys[i].begin + consumed, keys[i].end};
+            vptrs[i] = const_cast<value_type*>(label_store_.compare(node_id, key).first);
+        }
+    }
+
+    // Builds the empty map from the pairs of keys and values in [first, last), where the keys are convertible
+    // to std::string_view in strictly increasing order and are alive during the call.
+    // The first pass checks the order and counts the nodes, so that the hash table is sized just once.
+    // The second pass adds the nodes as update() in the order, but the node from which each key branches off
+    // is found on the path of the previous key from their longest common prefix, without comparing labels.
+    // The labels are appended to the NLM of FK-hash tries in order, or are put into the NLM of Bonsai
+    // tries at once by insert_bulk(), so that the chunks are filled without reallocation.
+    template <class Iterator>
+    void build_from_sorted(Iterator first, Iterator last) {
+        static_assert(std::is_base_of_v<std::forward_iterator_tag,
+                                        typename std::iterator_traits<Iterator>::iterator_category>,
+                      "build_from_sorted() needs forward iterators.");
+
+        wait_expansion();
+        POPLAR_THROW_IF(size_ != 0, "build_from_sorted() needs an empty map.");
+
+        uint64_t num_nodes = 0;
+        walk_sorted_(first, last, [&](char_range, const auto&, const sorted_frame_* frame, uint64_t match) {
+            if (frame != nullptr and frame->max_match / lambda_ < match / lambda_) {
+                num_nodes += match / lambda_ - frame->max_match / lambda_;  // new step nodes
+            }
+            ++num_nodes;
+            return uint64_t(0);
+        });
+
+        if (num_nodes == 0) {
+            return;
+        }
+        reserve(num_nodes);
+
+        // Labels of Bonsai tries put at once
+        std::vector<std::pair<uint64_t, char_range>> labels;
+        std::vector<value_type> values;
+
+        walk_sorted_(first, last, [&](char_range key, const auto& value, const sorted_frame_* frame, uint64_t match) {
+            uint64_t node_id = 0;
+
+            if (frame == nullptr) {
+                hash_trie_.add_root();
+                node_id = hash_trie_.get_root();
+            } else {
+                node_id = frame->node_id;
+                key.begin += frame->start + match;
+
+                while (lambda_ <= match) {
+                    if (add_child_(node_id, step_symb)) {
+#ifdef POPLAR_EXTRA_STATS
+                        ++num_steps_;
+#endif
+                        if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                            assert(node_id == label_store_.size());
+                            label_store_.append_dummy();
+                        }
+                    }
+                    match -= lambda_;
+                }
+
+                if (codes_[*key.begin] == UINT8_MAX) {
+                    // Update table
+                    codes_[*key.begin] = static_cast<uint8_t>(num_codes_++);
+                    POPLAR_THROW_IF(UINT8_MAX == num_codes_, "");
+                }
+
+                [[maybe_unused]] const bool is_added = add_child_(node_id, make_symb_(*key.begin, match));
+                assert(is_added);
+                ++key.begin;
+            }
+
             ++size_;
-            hash_trie_.add_root();
 
             if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
-                // assert(hash_trie_.get_root() == label_store_.size());
-                return label_store_.append(key);
+                assert(node_id == label_store_.size());
+                *label_store_.append(key) = static_cast<value_type>(value);
             }
             if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
-                return label_store_.insert(hash_trie_.get_root(), key);
+                labels.emplace_back(node_id, key);
+                values.push_back(static_cast<value_type>(value));
             }
-            // should not come
-            assert(false);
+            return node_id;
+        });
+
+        if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+            assert(!hash_trie_.needs_to_expand());
+            label_store_.insert_bulk(labels, values);
         }
+    }
 
-        auto node_id = hash_trie_.get_root();
+    // Removes the given key and returns true if registered (only if erasable, that is, with ChildIndex and
+    // a Bonsai trie). A leaf node is removed with its label, as well as the ancestors left without keys
+    // and children, and the slots are reused by later insertions. A node having children keeps its label
+    // for the descendants and is only marked as erased. A background expansion is finished first.
+    bool erase(std::string_view key) {
+        return erase(make_char_range(key));
+    }
+    bool erase(char_range key) {
+        static_assert(erasable, "erase() needs ChildIndex and a Bonsai trie.");
 
-        while (!key.empty()) {
-            auto [vptr, match] = label_store_.compare(node_id, key);
-            if (vptr != nullptr) {
-                return const_cast<value_type*>(vptr);
+        wait_expansion();
+
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            return false;
+        }
+
+        auto [node_id, vptr] = find_node_(key);
+        if (vptr == nullptr or is_erased_(node_id)) {
+            return false;
+        }
+
+        --size_;
+
+        if (child_index_.first_child(node_id) != child_index::nil_id) {
+            erased_.set(node_id, 1);
+            return true;
+        }
+
+        while (node_id != hash_trie_.get_root()) {
+            auto [parent, symb] = hash_trie_.get_parent_and_symb(node_id);
+            if (label_store_.has_label(node_id)) {
+                // Step nodes have no labels
+                label_store_.erase(node_id);
+                erased_.set(node_id, 0);
             }
+            child_index_.remove(parent, node_id);
+            hash_trie_.erase(node_id);
 
-            key.begin += match;
+            if (child_index_.first_child(parent) != child_index::nil_id or
+                (label_store_.has_label(parent) and !is_erased_(parent))) {
+                return true;
+            }
+            node_id = parent;
+        }
 
-            while (lambda_ <= match) {
-                if (hash_trie_.add_child(node_id, step_symb)) {
-                    expand_if_needed_(node_id);
-#ifdef POPLAR_EXTRA_STATS
-                    ++num_steps_;
-#endif
-                    if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
-                        assert(node_id == label_store_.size());
-                        label_store_.append_dummy();
-                    }
+        // The root is left without keys and children.
+        assert(size_ == 0);
+        reset_(this_type{hash_trie_.capa_bits(), lambda_});
+        return true;
+    }
+
+    // Expands the hash table in advance so that num_nodes nodes can be stored without resizing.
+    void reserve(uint64_t num_nodes) {
+        wait_expansion();
+
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            uint32_t capa_bits = is_ready_ ? hash_trie_.capa_bits() : min_capa_bits;
+            while (static_cast<uint64_t>((1ULL << capa_bits) * Trie::max_factor / 100.0) <= num_nodes) {
+                ++capa_bits;
+            }
+            if (!is_ready_ or hash_trie_.capa_bits() < capa_bits) {
+                reset_(this_type{capa_bits, lambda_});
+            }
+            return;
+        }
+
+        if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+            hash_trie_.reserve(num_nodes);
+        }
+        if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+            while (hash_trie_.max_size() <= num_nodes) {
+                expand_bonsai_();
+            }
+        }
+    }
+
+    // Starts expanding the hash table on a background thread when the load reaches soft_factor percent of
+    // the maximum (only for Bonsai tries), instead of expanding it within update() at the maximum.
+    // Meanwhile, the keys given to update() and update_batch() are buffered with their values. After the
+    // expansion ends, each update() or update_batch() moves up to replays_per_update of the buffered keys
+    // into the expanded map, so that no single call replays the whole buffer.
+    // The buffered keys are found by find() and find_batch(), but the other searches, the enumeration and
+    // save() throw an exception until wait_expansion(). soft_factor of zero disables it.
+    void set_background_expansion(uint32_t soft_factor) {
+        static_assert(trie_type_id == trie_type_ids::BONSAI_TRIE, "Background expansion needs a Bonsai trie.");
+        POPLAR_THROW_IF(100 <= soft_factor, "soft_factor must be less than 100.");
+        if (soft_factor == 0) {
+            wait_expansion();
+        }
+        soft_factor_ = soft_factor;
+    }
+    uint32_t background_expansion() const {
+        return soft_factor_;
+    }
+    // Checks if an expansion is running in the background or its buffer is not yet moved.
+    bool is_expanding() const {
+        return expansion_ != nullptr;
+    }
+    // Gets the # of the buffered keys not yet moved into the map.
+    uint64_t num_buffered() const {
+        return expansion_ != nullptr ? expansion_->buffer.size() : 0;
+    }
+    // Waits for the background expansion and moves all the buffered keys into the map.
+    void wait_expansion() {
+        if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+            if (expansion_ != nullptr) {
+                finish_expansion_();
+            }
+        }
+    }
+
+    // Pair of a registered key and its value pointer.
+    struct entry_type {
+        std::string_view key;
+        const value_type* vptr;
+    };
+
+    // Iterator over the registered keys in the order of the node IDs (only if Trie::reversible).
+    // A key is reconstructed into the buffer of the iterator by walking up the trie from its node, so
+    // the yielded key is valid until the iterator is advanced or destroyed.
+    class const_iterator {
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = entry_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = entry_type;
+
+      public:
+        const_iterator() = default;
+
+        entry_type operator*() const {
+            return {std::string_view(buf_), vptr_};
+        }
+
+        const_iterator& operator++() {
+            ++pos_;
+            skip_();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const const_iterator& rhs) const {
+            return pos_ == rhs.pos_;
+        }
+        bool operator!=(const const_iterator& rhs) const {
+            return pos_ != rhs.pos_;
+        }
+
+      private:
+        friend class map;
+
+        const map* map_ = nullptr;
+        uint64_t pos_ = 0;
+        uint64_t end_ = 0;
+        std::array<uint8_t, 256> decodes_ = {};  // inverse of codes_
+        std::string buf_;
+        const typename map::value_type* vptr_ = nullptr;
+
+        const_iterator(const map* m, uint64_t pos, uint64_t end)
+            : map_(m), pos_(pos), end_(end), decodes_(m->make_decodes_()) {
+            skip_();
+        }
+
+        // Moves to the next node having a label from pos_ and reconstructs its key.
+        void skip_() {
+            while (pos_ < end_ and (!map_->label_store_.has_label(pos_) or map_->is_erased_(pos_))) {
+                ++pos_;
+            }
+            if (pos_ < end_) {
+                restore_key_();
+            }
+        }
+
+        void restore_key_() {
+            const auto& trie = map_->hash_trie_;
+            const auto& nlm = map_->label_store_;
+
+            // The characters on the path are put in reverse order.
+            buf_.clear();
+
+            uint64_t node_id = pos_;
+            auto [parent, symb] = trie.get_parent_and_symb(node_id);
+
+            while (parent != nil_id) {
+                // Only the edge to pos_ can be the terminator.
+                const bool is_terminated = (symb & UINT8_MAX) == term_code;
+                const uint8_t c = decodes_[symb & UINT8_MAX];
+                uint64_t match = symb >> 8;
+
+                // Goes up through the step nodes to the node having the label matched.
+                auto [grand, grand_symb] = trie.get_parent_and_symb(parent);
+                while (grand_symb == step_symb and grand != nil_id) {
+                    match += map_->lambda_;
+                    parent = grand;
+                    std::tie(grand, grand_symb) = trie.get_parent_and_symb(parent);
                 }
-                match -= lambda_;
+
+                if (!is_terminated) {
+                    buf_.push_back(static_cast<char>(c));
+                }
+                const char_range label = nlm.get_label(parent).first;
+                assert(match <= label.length());
+                for (uint64_t i = match; i != 0; --i) {
+                    buf_.push_back(static_cast<char>(label[i - 1]));
+                }
+
+                node_id = parent;
+                parent = grand;
+                symb = grand_symb;
             }
+            std::reverse(buf_.begin(), buf_.end());
 
-            if (codes_[*key.begin] == UINT8_MAX) {
-                // Update table
-                codes_[*key.begin] = static_cast<uint8_t>(num_codes_++);
-                POPLAR_THROW_IF(UINT8_MAX == num_codes_, "");
+            auto [label, vptr] = nlm.get_label(pos_);
+            buf_.append(reinterpret_cast<const char*>(label.begin), label.length());
+            vptr_ = vptr;
+        }
+    };
+
+    const_iterator begin() const {
+        return const_iterator{this, 0, num_positions_()};
+    }
+    const_iterator end() const {
+        return const_iterator{this, num_positions_(), num_positions_()};
+    }
+
+    // Splits the node IDs into num_ranges ranges and gets the pairs of iterators (begin, end) over the
+    // ranges, so that the keys can be enumerated in parallel.
+    std::vector<std::pair<const_iterator, const_iterator>> split_ranges(uint64_t num_ranges) const {
+        POPLAR_THROW_IF(num_ranges == 0, "num_ranges must be positive.");
+
+        const uint64_t num_positions = num_positions_();
+        std::vector<std::pair<const_iterator, const_iterator>> ranges;
+        for (uint64_t i = 0; i < num_ranges; ++i) {
+            const uint64_t begin = num_positions * i / num_ranges;
+            const uint64_t end = num_positions * (i + 1) / num_ranges;
+            ranges.emplace_back(const_iterator{this, begin, end}, const_iterator{this, end, end});
+        }
+        return ranges;
+    }
+
+    // Calls fn(key, vptr) for every registered key that is a prefix of the given text, in increasing order
+    // of the length, where key is the string_view of the prefix in text. The keys are reported along one
+    // walk from the root as in find(), checking the terminator children at the matched label positions.
+    template <class Fn>
+    void common_prefix_search(std::string_view text, Fn&& fn) const {
+        POPLAR_THROW_IF(expansion_ != nullptr, "The search needs wait_expansion() during a background expansion.");
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            return;
+        }
+
+        auto key = reinterpret_cast<const uint8_t*>(text.data());
+        uint64_t rest = text.size();
+        uint64_t node_id = hash_trie_.get_root();
+
+        while (true) {
+            auto [label, vptr] = label_store_.get_label(node_id);
+            const uint64_t match = find_mismatch(key, label.begin, std::min(rest, label.length()));
+            const uint64_t head = text.size() - rest;
+
+            // Shorter keys end inside the label with the terminator children.
+            uint64_t step_id = node_id, offset = 0;
+            for (uint64_t i = 0; i < std::min(match + 1, label.length()); ++i) {
+                if (i - offset == lambda_) {
+                    step_id = hash_trie_.find_child(step_id, step_symb);
+                    if (step_id == nil_id) {
+                        break;
+                    }
+                    offset += lambda_;
+                }
+                const uint64_t child_id = hash_trie_.find_child(step_id, make_term_symb_(i - offset));
+                if (child_id != nil_id and !is_erased_(child_id)) {
+                    fn(text.substr(0, head + i), label_store_.get_label(child_id).second);
+                }
             }
 
-            if (hash_trie_.add_child(node_id, make_symb_(*key.begin, match))) {
-                expand_if_needed_(node_id);
-                ++key.begin;
-                ++size_;
+            if (match == label.length() and !is_erased_(node_id)) {
+                fn(text.substr(0, head + match), vptr);
+            }
+            if (step_id == nil_id or match == rest or codes_[key[match]] == UINT8_MAX) {
+                return;
+            }
 
-                if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
-                    assert(node_id == label_store_.size());
-                    return label_store_.append(key);
+            uint64_t m = match - offset;
+            while (lambda_ <= m) {
+                step_id = hash_trie_.find_child(step_id, step_symb);
+                if (step_id == nil_id) {
+                    return;
                 }
-                if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
-                    return label_store_.insert(node_id, key);
+                m -= lambda_;
+            }
+            node_id = hash_trie_.find_child(step_id, make_symb_(key[match], m));
+            if (node_id == nil_id) {
+                return;
+            }
+            key += match + 1;
+            rest -= match + 1;
+        }
+    }
+
+    // Calls fn(key, vptr) for every registered key starting with the given prefix (only if ChildIndex and
+    // Trie::reversible). The keys are visited in no particular order by descending to the node of the prefix
+    // and traversing the subtree below it through the child index, so the time is proportional to the prefix
+    // length and the number of nodes in the subtree. The key is valid only during the call.
+    template <class Fn>
+    void predictive_search(std::string_view prefix, Fn&& fn) const {
+        static_assert(ChildIndex, "predictive_search() needs ChildIndex.");
+        static_assert(Trie::reversible, "predictive_search() needs get_parent_and_symb().");
+        POPLAR_THROW_IF(expansion_ != nullptr, "The search needs wait_expansion() during a background expansion.");
+
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            return;
+        }
+
+        auto key = reinterpret_cast<const uint8_t*>(prefix.data());
+        uint64_t rest = prefix.size();
+        uint64_t node_id = hash_trie_.get_root();
+
+        // Descends to the node whose path with the label covers the prefix.
+        while (true) {
+            const char_range label = label_store_.get_label(node_id).first;
+            const uint64_t match = find_mismatch(key, label.begin, std::min(rest, label.length()));
+            if (match == rest) {
+                break;
+            }
+
+            uint64_t m = match;
+            while (lambda_ <= m) {
+                node_id = hash_trie_.find_child(node_id, step_symb);
+                if (node_id == nil_id) {
+                    return;
                 }
-                // should not come
-                assert(false);
+                m -= lambda_;
+            }
+            if (codes_[key[match]] == UINT8_MAX) {
+                return;
             }
+            node_id = hash_trie_.find_child(node_id, make_symb_(key[match], m));
+            if (node_id == nil_id) {
+                return;
+            }
+            key += match + 1;
+            rest -= match + 1;
+        }
 
-            ++key.begin;
+        const auto decodes = make_decodes_();
+        const uint64_t head = prefix.size() - rest;
+        std::string buf(prefix.substr(0, head));
+
+        // Child to be visited, with the labeled node and the # of label characters skipped by step nodes
+        // on the path to it. Branches before min_match are out of the prefix.
+        struct frame {
+            uint64_t node_id;
+            uint64_t owner_id;
+            uint64_t head;
+            uint64_t offset;
+            uint64_t min_match;
+        };
+        std::vector<frame> stack;
+
+        auto push_children = [&](uint64_t parent, uint64_t owner_id, uint64_t owner_head, uint64_t offset,
+                                 uint64_t min_match) {
+            for (auto child = child_index_.first_child(parent); child != child_index::nil_id;
+                 child = child_index_.next_sibling(child)) {
+                stack.push_back(frame{child, owner_id, owner_head, offset, min_match});
+            }
+        };
+
+        // Reports the key of the labeled node, whose path is in buf.
+        auto report = [&](uint64_t id, bool is_terminated, uint64_t min_match) {
+            auto [label, vptr] = label_store_.get_label(id);
+            const uint64_t id_head = buf.size();
+            buf.append(reinterpret_cast<const char*>(label.begin), label.length());
+            if (!is_erased_(id)) {
+                fn(std::string_view(buf), vptr);
+            }
+            buf.resize(id_head);
+            if (!is_terminated) {
+                push_children(id, id, id_head, 0, min_match);
+            }
+        };
+
+        report(node_id, false, rest);
+
+        while (!stack.empty()) {
+            const frame f = stack.back();
+            stack.pop_back();
+
+            const uint64_t symb = hash_trie_.get_parent_and_symb(f.node_id).second;
+            if (symb == step_symb) {
+                push_children(f.node_id, f.owner_id, f.head, f.offset + lambda_, f.min_match);
+                continue;
+            }
+
+            const uint64_t match = f.offset + (symb >> 8);
+            if (match < f.min_match) {
+                continue;
+            }
+
+            const char_range label = label_store_.get_label(f.owner_id).first;
+            assert(match <= label.length());
+            buf.resize(f.head);
+            buf.append(reinterpret_cast<const char*>(label.begin), match);
+
+            const bool is_terminated = (symb & UINT8_MAX) == term_code;
+            if (!is_terminated) {
+                buf.push_back(static_cast<char>(decodes[symb & UINT8_MAX]));
+            }
+            report(f.node_id, is_terminated, 0);
         }
+    }
 
-        auto vptr = label_store_.compare(node_id, key).first;
-        return vptr ? const_cast<value_type*>(vptr) : nullptr;
+    // Sets the number of threads used to expand the hash table (only for Bonsai tries).
+    void set_num_threads(uint32_t num_threads) {
+        POPLAR_THROW_IF(num_threads == 0, "num_threads must be positive.");
+        num_threads_ = num_threads;
+    }
+    uint32_t num_threads() const {
+        return num_threads_;
     }
 
     // Gets the number of registered keys.
@@ -214,16 +791,90 @@ class map {
         uint64_t bytes = 0;
         bytes += hash_trie_.alloc_bytes();
         bytes += label_store_.alloc_bytes();
+        bytes += child_index_.alloc_bytes();
+        bytes += erased_.alloc_bytes();
         bytes += codes_.size();
         return bytes;
     }
 
+    // Serializes the map into the binary stream. The stream should be opened in binary mode.
+    void save(std::ostream& os) const {
+        POPLAR_THROW_IF(expansion_ != nullptr, "save() needs wait_expansion() during a background expansion.");
+        io_tools::save_value(os, io_tools::magic_number);
+        io_tools::save_value(os, io_tools::format_version);
+        io_tools::save_param(os, static_cast<uint64_t>(trie_type_id));
+        io_tools::save_param(os, ChildIndex);
+        io_tools::save_value(os, is_ready_);
+        io_tools::save_value(os, lambda_);
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, num_codes_);
+        io_tools::save_bytes(os, codes_.data(), codes_.size());
+        hash_trie_.save(os);
+        label_store_.save(os);
+        if constexpr (ChildIndex) {
+            child_index_.save(os);
+        }
+        if constexpr (erasable) {
+            erased_.save(os);
+        }
+    }
+
+    // Deserializes the map saved by save() with the same template arguments.
+    void load(std::istream& is) {
+        POPLAR_THROW_IF(io_tools::load_value(is) != io_tools::magic_number, "The data is not a serialized map.");
+        POPLAR_THROW_IF(io_tools::load_value(is) != io_tools::format_version, "The format version is not supported.");
+        io_tools::load_param(is, static_cast<uint64_t>(trie_type_id));
+        io_tools::load_param(is, ChildIndex);
+
+        reset_(this_type{});
+
+        is_ready_ = io_tools::load_value(is) != 0;
+        lambda_ = io_tools::load_value(is);
+        size_ = io_tools::load_value(is);
+        num_codes_ = static_cast<uint32_t>(io_tools::load_value(is));
+        io_tools::load_bytes(is, codes_.data(), codes_.size());
+        hash_trie_.load(is);
+        label_store_.load(is);
+        if constexpr (ChildIndex) {
+            child_index_.load(is);
+        }
+        if constexpr (erasable) {
+            erased_.load(is);
+        }
+    }
+
+    // Makes the map a read-only view over the bytes written by save(), such as a memory-mapped file.
+    // Only the const member functions can be used, and the bytes must outlive the map.
+    void load_view(io_tools::mapper& mapper) {
+        POPLAR_THROW_IF(mapper.map_value() != io_tools::magic_number, "The data is not a serialized map.");
+        POPLAR_THROW_IF(mapper.map_value() != io_tools::format_version, "The format version is not supported.");
+        mapper.map_param(static_cast<uint64_t>(trie_type_id));
+        mapper.map_param(ChildIndex);
+
+        reset_(this_type{});
+        is_ready_ = mapper.map_value() != 0;
+        lambda_ = mapper.map_value();
+        size_ = mapper.map_value();
+        num_codes_ = static_cast<uint32_t>(mapper.map_value());
+        std::memcpy(codes_.data(), mapper.map_bytes(codes_.size()), codes_.size());
+        hash_trie_.load_view(mapper);
+        label_store_.load_view(mapper);
+        if constexpr (ChildIndex) {
+            child_index_.load_view(mapper);
+        }
+        if constexpr (erasable) {
+            erased_.load_view(mapper);
+        }
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "map");
         show_stat(os, indent, "lambda", lambda_);
         show_stat(os, indent, "size", size());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_stat(os, indent, "soft_factor", soft_factor_);
+        show_stat(os, indent, "num_buffered", num_buffered());
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "rate_steps", rate_steps());
 #endif
@@ -231,45 +882,628 @@ class map {
         hash_trie_.show_stats(os, n + 1);
         show_member(os, indent, "label_store_");
         label_store_.show_stats(os, n + 1);
+        if constexpr (ChildIndex) {
+            show_member(os, indent, "child_index_");
+            child_index_.show_stats(os, n + 1);
+        }
     }
 
     map(const map&) = delete;
     map& operator=(const map&) = delete;
 
-    map(map&&) noexcept = default;
-    map& operator=(map&&) noexcept = default;
+    // The moves are not noexcept, since they join the background expansions.
+    map(map&& rhs) {
+        *this = std::move(rhs);
+    }
+    map& operator=(map&& rhs) {
+        // The background builds refer to the maps, so they are joined and applied first. The buffered keys
+        // of rhs are moved along without being replayed, and those of this map are discarded with it.
+        apply_expansion_();
+        rhs.apply_expansion_();
+
+        is_ready_ = rhs.is_ready_;
+        lambda_ = rhs.lambda_;
+        hash_trie_ = std::move(rhs.hash_trie_);
+        label_store_ = std::move(rhs.label_store_);
+        child_index_ = std::move(rhs.child_index_);
+        erased_ = std::move(rhs.erased_);
+        codes_ = rhs.codes_;
+        num_codes_ = rhs.num_codes_;
+        size_ = rhs.size_;
+        num_threads_ = rhs.num_threads_;
+        soft_factor_ = rhs.soft_factor_;
+        expansion_ = std::move(rhs.expansion_);
+#ifdef POPLAR_EXTRA_STATS
+        num_steps_ = rhs.num_steps_;
+#endif
+        return *this;
+    }
 
   private:
     static constexpr uint64_t nil_id = Trie::nil_id;
     static constexpr uint64_t step_symb = UINT8_MAX;  // (UINT8_MAX, 0)
+    static constexpr uint64_t term_code = 0;  // code of the virtual terminator at the end of keys
+
+    // Node on the path of the previous key in build_from_sorted(), whose label starts at the start-th
+    // character of the key. max_match is the largest offset in the label from which the later keys branch off.
+    struct sorted_frame_ {
+        uint64_t node_id;
+        uint64_t start;
+        uint64_t max_match;
+    };
+
+    // Traversal state of a key in find_batch() and update_batch()
+    struct walk_state_ {
+        char_range key;
+        uint64_t key_id;
+        uint64_t node_id;
+        uint64_t match;  // # of label characters not yet consumed by step nodes
+        bool on_label;  // whether the next step is to compare the label of node_id
+    };
 
     bool is_ready_ = false;
     uint64_t lambda_ = 32;
 
     Trie hash_trie_;
     NLM label_store_;
+    child_index child_index_;
+    compact_vector erased_;  // flags of the keys erased from the nodes having children (only if erasable)
     std::array<uint8_t, 256> codes_ = {};
     uint32_t num_codes_ = 0;
     uint64_t size_ = 0;
+    uint32_t num_threads_ = 1;
+    uint32_t soft_factor_ = 0;  // load in percent of the maximum to start a background expansion (0 disables it)
+
+    // Background expansion in progress
+    struct expansion_type_ {
+        std::thread thread;
+        std::atomic<bool> done{false};
+        std::function<void(this_type&)> apply;  // moves the built structures into the map, set by the thread
+        std::deque<std::string> keys;  // buffered keys referred to by buffer
+        std::unordered_map<std::string_view, value_type> buffer;  // values of the keys updated meanwhile
+    };
+    std::unique_ptr<expansion_type_> expansion_;
+
 #ifdef POPLAR_EXTRA_STATS
     uint64_t num_steps_ = 0;
 #endif
 
+    // Gets the end of the node IDs that can have labels.
+    uint64_t num_positions_() const {
+        static_assert(Trie::reversible, "The enumeration needs get_parent_and_symb().");
+        POPLAR_THROW_IF(expansion_ != nullptr, "The enumeration needs wait_expansion() during a background expansion.");
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            return 0;
+        }
+        if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+            return hash_trie_.size();
+        }
+        return hash_trie_.capa_size();
+    }
+
+    bool is_erased_(uint64_t node_id) const {
+        if constexpr (erasable) {
+            return erased_[node_id] != 0;
+        } else {
+            return false;
+        }
+    }
+
+    // Gets the value pointer of the key associated with node_id, after registering it again if erased.
+    value_type* revive_(uint64_t node_id, const value_type* vptr) {
+        if (is_erased_(node_id)) {
+            erased_.set(node_id, 0);
+            ++size_;
+            *const_cast<value_type*>(vptr) = static_cast<value_type>(0);
+        }
+        return const_cast<value_type*>(vptr);
+    }
+
+    // Searches the node having the given key and returns the pair of the node ID and the value pointer,
+    // where the value pointer is nullptr if not found. The key may be erased.
+    std::pair<uint64_t, const value_type*> find_node_(char_range key) const {
+        if (!is_ready_ or hash_trie_.size() == 0) {
+            return {nil_id, nullptr};
+        }
+
+        auto node_id = hash_trie_.get_root();
+
+        // The loop ends as update().
+        while (true) {
+            auto [vptr, match] = label_store_.compare(node_id, key);
+            if (vptr != nullptr) {
+                return {node_id, vptr};
+            }
+
+            key.begin += match;
+
+            while (lambda_ <= match) {
+                node_id = hash_trie_.find_child(node_id, step_symb);
+                if (node_id == nil_id) {
+                    return {nil_id, nullptr};
+                }
+                match -= lambda_;
+            }
+
+            if (!key.empty() and codes_[*key.begin] == UINT8_MAX) {
+                // Detecting an useless character
+                return {nil_id, nullptr};
+            }
+
+            node_id = hash_trie_.find_child(node_id, make_symb_(key, match));
+            if (node_id == nil_id) {
+                return {nil_id, nullptr};
+            }
+
+            skip_head_(key);
+        }
+    }
+
+    // Gets the inverse of codes_.
+    std::array<uint8_t, 256> make_decodes_() const {
+        std::array<uint8_t, 256> decodes = {};
+        for (uint32_t c = 0; c < 256; ++c) {
+            if (codes_[c] != UINT8_MAX) {
+                decodes[codes_[c]] = static_cast<uint8_t>(c);
+            }
+        }
+        return decodes;
+    }
+
     uint64_t make_symb_(uint8_t c, uint64_t match) const {
         assert(codes_[c] != UINT8_MAX);
         return static_cast<uint64_t>(codes_[c]) | (match << 8);
     }
+    // Makes the symbol of the head character of key, or of the terminator if key is empty.
+    uint64_t make_symb_(const char_range& key, uint64_t match) const {
+        return key.empty() ? make_term_symb_(match) : make_symb_(*key.begin, match);
+    }
+    static uint64_t make_term_symb_(uint64_t match) {
+        return term_code | (match << 8);
+    }
+
+    // Skips the head character of key consumed by an edge, where the terminator is left as the empty key.
+    static void skip_head_(char_range& key) {
+        if (!key.empty()) {
+            ++key.begin;
+        }
+    }
+
+    walk_state_ start_walk_(const char_range& key, uint64_t key_id) const {
+        auto node_id = hash_trie_.get_root();
+        label_store_.prefetch(node_id);
+        return walk_state_{key, key_id, node_id, 0, true};
+    }
+
+    // Advances the search by one memory access and prefetches the address accessed next.
+    // Returns false if the search has finished after storing the result in vptrs[key_id].
+    bool step_find_(walk_state_& s, const value_type** vptrs) const {
+        if (s.on_label) {
+            auto [vptr, match] = label_store_.compare(s.node_id, s.key);
+            if (vptr != nullptr) {
+                vptrs[s.key_id] = is_erased_(s.node_id) ? nullptr : vptr;
+                return false;
+            }
+
+            s.key.begin += match;
+
+            if (!s.key.empty() and codes_[*s.key.begin] == UINT8_MAX) {
+                // Detecting an useless character
+                vptrs[s.key_id] = nullptr;
+                return false;
+            }
+
+            s.match = match;
+            s.on_label = false;
+        } else if (lambda_ <= s.match) {
+            s.node_id = hash_trie_.find_child(s.node_id, step_symb);
+            if (s.node_id == nil_id) {
+                vptrs[s.key_id] = nullptr;
+                return false;
+            }
+            s.match -= lambda_;
+        } else {
+            s.node_id = hash_trie_.find_child(s.node_id, make_symb_(s.key, s.match));
+            if (s.node_id == nil_id) {
+                vptrs[s.key_id] = nullptr;
+                return false;
+            }
+            skip_head_(s.key);
+            s.on_label = true;
+            label_store_.prefetch(s.node_id);
+            return true;
+        }
+
+        if (lambda_ <= s.match) {
+            hash_trie_.prefetch_child(s.node_id, step_symb);
+        } else {
+            hash_trie_.prefetch_child(s.node_id, make_symb_(s.key, s.match));
+        }
+        return true;
+    }
+
+    // Advances the insertion by one step and prefetches the address accessed next.
+    // Returns false if the insertion has finished.
+    bool step_update_(walk_state_& s) {
+        if (s.on_label) {
+            auto [vptr, match] = label_store_.compare(s.node_id, s.key);
+            if (vptr != nullptr) {
+                revive_(s.node_id, vptr);
+                return false;
+            }
+
+            s.key.begin += match;
+
+            if (!s.key.empty() and codes_[*s.key.begin] == UINT8_MAX) {
+                // Update table
+                codes_[*s.key.begin] = static_cast<uint8_t>(num_codes_++);
+                POPLAR_THROW_IF(UINT8_MAX == num_codes_, "");
+            }
+
+            s.match = match;
+            s.on_label = false;
+        } else if (lambda_ <= s.match) {
+            if (add_child_(s.node_id, step_symb)) {
+#ifdef POPLAR_EXTRA_STATS
+                ++num_steps_;
+#endif
+                if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                    assert(s.node_id == label_store_.size());
+                    label_store_.append_dummy();
+                }
+            }
+            s.match -= lambda_;
+        } else {
+            if (add_child_(s.node_id, make_symb_(s.key, s.match))) {
+                skip_head_(s.key);
+                ++size_;
+
+                if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                    assert(s.node_id == label_store_.size());
+                    label_store_.append(s.key);
+                }
+                if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+                    label_store_.insert(s.node_id, s.key);
+                }
+                return false;
+            }
+            skip_head_(s.key);
+            s.on_label = true;
+            label_store_.prefetch(s.node_id);
+            return true;
+        }
+
+        if (lambda_ <= s.match) {
+            hash_trie_.prefetch_child(s.node_id, step_symb);
+        } else {
+            hash_trie_.prefetch_child(s.node_id, make_symb_(s.key, s.match));
+        }
+        return true;
+    }
 
     void expand_if_needed_(uint64_t& node_id) {
         if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
             if (!hash_trie_.needs_to_expand()) {
                 return;
             }
-            auto node_map = hash_trie_.expand();
+            auto node_map = expand_bonsai_();
             node_id = node_map[node_id];
-            label_store_.expand(node_map);
         }
     }
+
+    // Visits the pairs in [first, last) for build_from_sorted() after checking the order of the keys.
+    // fn(key, value, frame, match) adds the node of the key branching off from the label of frame at
+    // the match-th character, or the root if frame is nullptr, and returns the node ID.
+    template <class Iterator, class Fn>
+    void walk_sorted_(Iterator first, Iterator last, Fn&& fn) const {
+        std::vector<sorted_frame_> path;  // of the previous key
+        char_range prev;
+
+        for (; first != last; ++first) {
+            const auto& [str, value] = *first;
+            const char_range key = make_char_range(str);
+
+            if (path.empty()) {
+                path.push_back({fn(key, value, nullptr, 0), 0, 0});
+                prev = key;
+                continue;
+            }
+
+            // The key branches off at lcp with a character, since the terminator of prev is the smallest.
+            const uint64_t lcp = find_mismatch(prev.begin, key.begin, std::min(prev.length(), key.length()));
+            POPLAR_THROW_IF(lcp == key.length() or (lcp < prev.length() and key[lcp] < prev[lcp]),
+                            "The keys must be sorted in increasing order without duplicates.");
+
+            while (lcp < path.back().start) {
+                path.pop_back();
+            }
+
+            auto& frame = path.back();
+            const uint64_t match = lcp - frame.start;
+            const uint64_t child_id = fn(key, value, &frame, match);
+            frame.max_match = std::max(frame.max_match, match);
+            path.push_back({child_id, lcp + 1, 0});
+            prev = key;
+        }
+    }
+
+    // Adds the child as in Trie::add_child() and links it in the child index.
+    bool add_child_(uint64_t& node_id, uint64_t symb) {
+        if constexpr (ChildIndex) {
+            const uint64_t parent = node_id;
+            if (!hash_trie_.add_child(node_id, symb)) {
+                return false;
+            }
+            child_index_.add(parent, node_id);
+            return true;
+        } else {
+            return hash_trie_.add_child(node_id, symb);
+        }
+    }
+
+    // Expands the Bonsai trie and moves the labels and child links to the new node IDs.
+    auto expand_bonsai_() {
+        auto node_map = hash_trie_.expand(num_threads_);
+        label_store_.expand(node_map, num_threads_);
+        if constexpr (ChildIndex) {
+            child_index_.expand(node_map, hash_trie_.capa_bits());
+        }
+        if constexpr (erasable) {
+            compact_vector erased{hash_trie_.capa_size(), 1};
+            for (uint64_t i = 0; i < node_map.size(); ++i) {
+                if (erased_[i] != 0) {
+                    erased.set(node_map[i], 1);
+                }
+            }
+            erased_ = std::move(erased);
+        }
+        return node_map;
+    }
+
+    // Replaces the map with the given one, keeping the settings.
+    void reset_(this_type&& other) {
+        auto num_threads = num_threads_;
+        auto soft_factor = soft_factor_;
+        *this = std::move(other);
+        num_threads_ = num_threads;
+        soft_factor_ = soft_factor;
+    }
+
+    static std::string_view make_key_view_(char_range key) {
+        return {reinterpret_cast<const char*>(key.begin), key.length()};
+    }
+
+    // Advances the background expansion by a foreground update. Once the build is done, the built structures
+    // are applied and up to replays_per_update buffered keys are moved into the map. The next expansion is
+    // started if the load reaches soft_factor_, even while keys remain in the buffer, since the replays would
+    // otherwise fill the table and expand it within update().
+    void step_expansion_() {
+        if (expansion_ != nullptr) {
+            if (!expansion_->done.load(std::memory_order_acquire)) {
+                return;
+            }
+            apply_expansion_();
+            replay_buffer_(replays_per_update);
+            if (expansion_->buffer.empty()) {
+                expansion_.reset();
+            }
+        }
+        if (soft_factor_ == 0 or !is_ready_ or hash_trie_.size() == 0) {
+            return;
+        }
+        if ((hash_trie_.size() + hash_trie_.num_tombs()) * 100 < hash_trie_.max_size() * soft_factor_) {
+            return;
+        }
+        start_expansion_();
+    }
+
+    // Builds the expanded trie, labels, child links and erased flags on a background thread.
+    // The current ones are only read by both the threads until finish_expansion_().
+    void start_expansion_() {
+        struct built_type {
+            Trie trie;
+            typename NLM::expanded_type labels;
+            child_index index;
+            compact_vector erased;
+        };
+
+        if (expansion_ == nullptr) {
+            expansion_ = std::make_unique<expansion_type_>();
+        } else {
+            // The keys left in the buffer are kept for the next build.
+            expansion_->done.store(false, std::memory_order_relaxed);
+        }
+        expansion_->thread = std::thread([this, job = expansion_.get(), num_threads = num_threads_]() {
+            auto built = std::make_shared<built_type>();
+            auto [trie, node_map] = hash_trie_.build_expanded(num_threads);
+            built->labels = label_store_.build_expanded(node_map, num_threads);
+            if constexpr (ChildIndex) {
+                built->index = child_index_.build_expanded(node_map, trie.capa_bits());
+            }
+            if constexpr (erasable) {
+                built->erased = compact_vector{trie.capa_size(), 1};
+                for (uint64_t i = 0; i < node_map.size(); ++i) {
+                    if (erased_[i] != 0) {
+                        built->erased.set(node_map[i], 1);
+                    }
+                }
+            }
+            built->trie = std::move(trie);
+
+            job->apply = [built](this_type& m) {
+                m.hash_trie_ = std::move(built->trie);
+                m.label_store_.apply_expanded(std::move(built->labels));
+                m.child_index_ = std::move(built->index);
+                m.erased_ = std::move(built->erased);
+            };
+            job->done.store(true, std::memory_order_release);
+        });
+    }
+
+    // Joins the background build if not yet, and moves the built structures into the map.
+    // The thread is joinable until then.
+    void apply_expansion_() {
+        if (expansion_ != nullptr and expansion_->thread.joinable()) {
+            expansion_->thread.join();
+            expansion_->apply(*this);
+        }
+    }
+
+    // Joins the background expansion and inserts all the buffered keys into the expanded map.
+    void finish_expansion_() {
+        apply_expansion_();
+        replay_buffer_(UINT64_MAX);
+        expansion_.reset();
+    }
+
+    // Moves up to num buffered keys into the applied map.
+    void replay_buffer_(uint64_t num) {
+        auto& buffer = expansion_->buffer;
+        for (uint64_t i = 0; i < num and !buffer.empty(); ++i) {
+            auto it = buffer.begin();
+            // The buffered keys are already counted in size_.
+            const uint64_t size = size_;
+            *update_trie_(make_char_range(it->first)) = it->second;
+            size_ = size;
+            buffer.erase(it);
+        }
+    }
+
+    // Updates the key during the background expansion: in the buffer while the build is running, and
+    // otherwise in the buffer if still there or in the applied map.
+    value_type* update_expanding_(char_range key) {
+        if (expansion_->thread.joinable()) {
+            return buffer_update_(key);
+        }
+        if (auto it = expansion_->buffer.find(make_key_view_(key)); it != expansion_->buffer.end()) {
+            return &it->second;
+        }
+        return update_trie_(key);
+    }
+
+    // update_batch() during the background expansion. The pointers into the buffer are stable, while those
+    // into the applied map are collected afterward with find_node_(), since the insertions may move the labels.
+    void update_batch_expanding_(const char_range* keys, uint64_t num_keys, value_type** vptrs) {
+        if (expansion_->thread.joinable()) {
+            for (uint64_t i = 0; i < num_keys; ++i) {
+                value_type* vptr = buffer_update_(keys[i]);
+                if (vptrs != nullptr) {
+                    vptrs[i] = vptr;
+                }
+            }
+            return;
+        }
+
+        auto& buffer = expansion_->buffer;
+        for (uint64_t i = 0; i < num_keys; ++i) {
+            value_type* vptr = nullptr;
+            if (auto it = buffer.find(make_key_view_(keys[i])); it != buffer.end()) {
+                vptr = &it->second;
+            } else {
+                update_trie_(keys[i]);
+            }
+            if (vptrs != nullptr) {
+                vptrs[i] = vptr;
+            }
+        }
+        for (uint64_t i = 0; vptrs != nullptr and i < num_keys; ++i) {
+            if (vptrs[i] == nullptr) {
+                vptrs[i] = const_cast<value_type*>(find_node_(keys[i]).second);
+            }
+        }
+    }
+
+    // Inserts the given key into the trie and returns the value pointer, regardless of the background expansion.
+    value_type* update_trie_(char_range key) {
+        if (hash_trie_.size() == 0) {
+            if (!is_ready_) {
+                reset_(this_type{0});
+            }
+            // The first insertion
+            ++size_;
+            hash_trie_.add_root();
+
+            if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                // assert(hash_trie_.get_root() == label_store_.size());
+                return label_store_.append(key);
+            }
+            if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+                return label_store_.insert(hash_trie_.get_root(), key);
+            }
+            // should not come
+            assert(false);
+        }
+
+        auto node_id = hash_trie_.get_root();
+
+        // The loop ends at the node whose label matches the rest of key, since the node reached through
+        // the terminator has the empty label.
+        while (true) {
+            auto [vptr, match] = label_store_.compare(node_id, key);
+            if (vptr != nullptr) {
+                return revive_(node_id, vptr);
+            }
+
+            key.begin += match;
+
+            while (lambda_ <= match) {
+                if (add_child_(node_id, step_symb)) {
+                    expand_if_needed_(node_id);
+#ifdef POPLAR_EXTRA_STATS
+                    ++num_steps_;
+#endif
+                    if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                        assert(node_id == label_store_.size());
+                        label_store_.append_dummy();
+                    }
+                }
+                match -= lambda_;
+            }
+
+            if (!key.empty() and codes_[*key.begin] == UINT8_MAX) {
+                // Update table
+                codes_[*key.begin] = static_cast<uint8_t>(num_codes_++);
+                POPLAR_THROW_IF(UINT8_MAX == num_codes_, "");
+            }
+
+            if (add_child_(node_id, make_symb_(key, match))) {
+                expand_if_needed_(node_id);
+                skip_head_(key);
+                ++size_;
+
+                if constexpr (trie_type_id == trie_type_ids::FKHASH_TRIE) {
+                    assert(node_id == label_store_.size());
+                    return label_store_.append(key);
+                }
+                if constexpr (trie_type_id == trie_type_ids::BONSAI_TRIE) {
+                    return label_store_.insert(node_id, key);
+                }
+                // should not come
+                assert(false);
+            }
+
+            skip_head_(key);
+        }
+    }
+
+    // Updates the key in the buffer during the background expansion, starting from the current value.
+    value_type* buffer_update_(char_range key) {
+        auto& buffer = expansion_->buffer;
+        if (auto it = buffer.find(make_key_view_(key)); it != buffer.end()) {
+            return &it->second;
+        }
+
+        value_type value{};
+        auto [node_id, vptr] = find_node_(key);
+        if (vptr != nullptr and !is_erased_(node_id)) {
+            value = *vptr;
+        } else {
+            ++size_;
+        }
+
+        const auto& stored = expansion_->keys.emplace_back(reinterpret_cast<const char*>(key.begin), key.length());
+        return &buffer.emplace(std::string_view{stored}, value).first->second;
+    }
 };
 
 }  // namespace poplar
@@ -0,0 +1,98 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_MAPPED_FILE_HPP
+#define POPLAR_TRIE_MAPPED_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+
+#include "basics.hpp"
+#include "exception.hpp"
+
+namespace poplar {
+
+// Read-only memory mapping of a whole file (POSIX only). The mapping is shared, so processes mapping
+// the same file share one copy in the page cache.
+class mapped_file {
+  public:
+    mapped_file() = default;
+
+    explicit mapped_file(const std::string& filepath) {
+        const int fd = ::open(filepath.c_str(), O_RDONLY);
+        POPLAR_THROW_IF(fd == -1, "failed to open the file.");
+
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            ::close(fd);
+            POPLAR_THROW("failed to get the file size.");
+        }
+        size_ = static_cast<uint64_t>(st.st_size);
+
+        if (size_ != 0) {
+            void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            POPLAR_THROW_IF(addr == MAP_FAILED, "failed to map the file.");
+            data_ = static_cast<const uint8_t*>(addr);
+        } else {
+            ::close(fd);
+        }
+    }
+
+    ~mapped_file() {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<uint8_t*>(data_), size_);
+        }
+    }
+
+    const uint8_t* data() const {
+        return data_;
+    }
+    uint64_t size() const {
+        return size_;
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    mapped_file(mapped_file&& rhs) noexcept
+        : data_(std::exchange(rhs.data_, nullptr)), size_(std::exchange(rhs.size_, 0)) {}
+    mapped_file& operator=(mapped_file&& rhs) noexcept {
+        std::swap(data_, rhs.data_);
+        std::swap(size_, rhs.size_);
+        return *this;
+    }
+
+  private:
+    const uint8_t* data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_MAPPED_FILE_HPP
@@ -0,0 +1,255 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_PARALLEL_TOOLS_HPP
+#define POPLAR_TRIE_PARALLEL_TOOLS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "bit_vector.hpp"
+#include "compact_vector.hpp"
+
+namespace poplar::parallel_tools {
+
+// Minimum # of items assigned to a thread
+static constexpr uint64_t min_grain = 1ULL << 12;
+
+// Gets the # of threads used for n items.
+inline uint32_t get_num_threads(uint32_t num_threads, uint64_t n) {
+    uint64_t max_threads = std::max<uint64_t>(1, n / min_grain);
+    return static_cast<uint32_t>(std::min<uint64_t>(std::max<uint32_t>(num_threads, 1), max_threads));
+}
+
+// Gets the length of ranges when [0, n) is split into num_threads ranges aligned to align.
+inline uint64_t get_range_size(uint32_t num_threads, uint64_t n, uint64_t align) {
+    uint64_t size = (n + num_threads - 1) / num_threads;
+    return std::max<uint64_t>(align, (size + align - 1) / align * align);
+}
+
+#ifdef POPLAR_EXTRA_STATS
+// # of ranges that run_ranges() has run on threads other than the caller
+inline std::atomic<uint64_t> num_forked_ranges{0};
+#endif
+
+// Splits [0, n) into ranges of range_size and runs fn(tid, begin, end) for each range in parallel.
+template <class Fn>
+void run_ranges(uint64_t n, uint64_t range_size, Fn&& fn) {
+    std::vector<std::thread> threads;
+    for (uint64_t begin = range_size, tid = 1; begin < n; begin += range_size, ++tid) {
+        threads.emplace_back(fn, tid, begin, std::min(n, begin + range_size));
+#ifdef POPLAR_EXTRA_STATS
+        num_forked_ranges.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+    fn(uint64_t(0), uint64_t(0), std::min(n, range_size));
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Splits [0, n) into num_threads ranges aligned to align and runs fn(tid, begin, end) in parallel.
+template <class Fn>
+void for_each_range(uint32_t num_threads, uint64_t n, uint64_t align, Fn&& fn) {
+    if (n == 0) {
+        return;
+    }
+    num_threads = get_num_threads(num_threads, n);
+    run_ranges(n, get_range_size(num_threads, n, align), std::forward<Fn>(fn));
+}
+
+// Computes the new IDs of the nodes when a Bonsai trie is rebuilt into a larger table.
+// Because the slot of a node depends on the new ID of its parent, the nodes are processed level by level.
+// In each level, thread t places the nodes whose initial slots are in the t-th range of the new table
+// through try_place, and the nodes not placed within the range are placed serially through place.
+// The ranges are aligned to 64 slots so that no two threads write the same word of a compact_vector.
+//  - is_node(i) returns if a non-root node is at slot i of the old table.
+//  - get_parent_and_symb(i) returns the parent and symbol of the node at slot i of the old table.
+//  - locate(new_parent, symb) returns the pair (payload, initial slot) in the new table.
+//  - try_place(payload, slot, end) places the node in [slot, end) and returns its ID, or UINT64_MAX.
+//  - place(payload, slot) places the node and returns its ID.
+// The mapping is written to map and done_flags.
+template <class IsNode, class GetParentAndSymb, class Locate, class TryPlace, class Place>
+void rebuild_bonsai(uint32_t num_threads, uint64_t capa_size, uint64_t root, uint64_t new_capa_size,
+                    uint64_t new_root, IsNode is_node, GetParentAndSymb get_parent_and_symb, Locate locate,
+                    TryPlace try_place, Place place, compact_vector& map, bit_vector& done_flags) {
+    num_threads = get_num_threads(num_threads, capa_size);
+    const uint64_t old_range_size = get_range_size(num_threads, capa_size, 64);
+
+    map.set(root, new_root);
+    done_flags.set(root);
+
+    // 1) Computes the depth of each node (the root is 1)
+    std::vector<std::atomic<uint32_t>> depths(capa_size);
+    depths[root].store(1, std::memory_order_relaxed);
+
+    std::vector<uint32_t> max_depths(num_threads, 1);
+
+    run_ranges(capa_size, old_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+        std::vector<uint64_t> path;
+        for (uint64_t i = begin; i < end; ++i) {
+            if (i == root or !is_node(i)) {
+                continue;
+            }
+            done_flags.set(i);
+
+            path.clear();
+            uint64_t node_id = i;
+            while (depths[node_id].load(std::memory_order_relaxed) == 0) {
+                path.push_back(node_id);
+                node_id = get_parent_and_symb(node_id).first;
+            }
+
+            uint32_t depth = depths[node_id].load(std::memory_order_relaxed);
+            for (auto rit = path.rbegin(); rit != path.rend(); ++rit) {
+                depths[*rit].store(++depth, std::memory_order_relaxed);
+            }
+            max_depths[tid] = std::max(max_depths[tid], depths[i].load(std::memory_order_relaxed));
+        }
+    });
+
+    // 2) Sorts the nodes by depth (in each level, the nodes are sorted by ID)
+    const uint32_t max_depth = *std::max_element(max_depths.begin(), max_depths.end());
+    std::vector<std::vector<uint64_t>> offsets(num_threads, std::vector<uint64_t>(max_depth + 2));
+
+    run_ranges(capa_size, old_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; ++i) {
+            if (i != root and done_flags[i]) {
+                ++offsets[tid][depths[i].load(std::memory_order_relaxed)];
+            }
+        }
+    });
+
+    std::vector<uint64_t> level_begins(max_depth + 2);
+    for (uint64_t d = 0, sum = 0; d <= max_depth; ++d) {
+        level_begins[d] = sum;
+        for (uint32_t t = 0; t < num_threads; ++t) {
+            uint64_t num = offsets[t][d];
+            offsets[t][d] = sum;
+            sum += num;
+        }
+        level_begins[d + 1] = sum;
+    }
+
+    std::vector<uint64_t> order(level_begins[max_depth + 1]);
+
+    run_ranges(capa_size, old_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; ++i) {
+            if (i != root and done_flags[i]) {
+                order[offsets[tid][depths[i].load(std::memory_order_relaxed)]++] = i;
+            }
+        }
+    });
+
+    depths = std::vector<std::atomic<uint32_t>>();
+
+    // 3) Places the nodes level by level
+    const uint64_t new_range_size = get_range_size(num_threads, new_capa_size, 64);
+    const uint64_t num_ranges = (new_capa_size + new_range_size - 1) / new_range_size;
+
+    std::vector<uint64_t> payloads, slots, new_ids, perm;
+    std::vector<std::vector<uint64_t>> counts(num_threads, std::vector<uint64_t>(num_ranges + 1));
+    std::vector<std::vector<uint64_t>> deferred(num_ranges);
+
+    for (uint32_t d = 2; d <= max_depth; ++d) {
+        const uint64_t* nodes = order.data() + level_begins[d];
+        const uint64_t num_nodes = level_begins[d + 1] - level_begins[d];
+        const uint32_t level_threads = get_num_threads(num_threads, num_nodes);
+        const uint64_t level_range_size = get_range_size(level_threads, num_nodes, 1);
+
+        payloads.resize(num_nodes);
+        slots.resize(num_nodes);
+        new_ids.resize(num_nodes);
+        perm.resize(num_nodes);
+
+        for (auto& c : counts) {
+            std::fill(c.begin(), c.end(), 0);
+        }
+
+        // Locates the nodes in the new table
+        run_ranges(num_nodes, level_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+            for (uint64_t k = begin; k < end; ++k) {
+                auto [parent, symb] = get_parent_and_symb(nodes[k]);
+                std::tie(payloads[k], slots[k]) = locate(map[parent], symb);
+                ++counts[tid][slots[k] / new_range_size];
+            }
+        });
+
+        // Groups the nodes by the ranges of their initial slots
+        std::vector<uint64_t> range_begins(num_ranges + 1);
+        for (uint64_t r = 0, sum = 0; r < num_ranges; ++r) {
+            range_begins[r] = sum;
+            for (uint32_t t = 0; t < level_threads; ++t) {
+                uint64_t num = counts[t][r];
+                counts[t][r] = sum;
+                sum += num;
+            }
+            range_begins[r + 1] = sum;
+        }
+
+        run_ranges(num_nodes, level_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+            for (uint64_t k = begin; k < end; ++k) {
+                perm[counts[tid][slots[k] / new_range_size]++] = k;
+            }
+        });
+
+        // Places the nodes within the ranges
+        run_ranges(num_ranges, 1, [&](uint64_t, uint64_t r, uint64_t) {
+            const uint64_t end = std::min(new_capa_size, (r + 1) * new_range_size);
+            deferred[r].clear();
+            for (uint64_t j = range_begins[r]; j < range_begins[r + 1]; ++j) {
+                const uint64_t k = perm[j];
+                new_ids[k] = try_place(payloads[k], slots[k], end);
+                if (new_ids[k] == UINT64_MAX) {
+                    deferred[r].push_back(k);
+                }
+            }
+        });
+
+        for (const auto& ks : deferred) {
+            for (uint64_t k : ks) {
+                new_ids[k] = place(payloads[k], slots[k]);
+            }
+        }
+
+        // Writes the mapping. The ranges are split at the boundaries of 64 slots.
+        run_ranges(num_nodes, level_range_size, [&](uint64_t, uint64_t begin, uint64_t end) {
+            while (begin != 0 and begin < num_nodes and nodes[begin - 1] / 64 == nodes[begin] / 64) {
+                ++begin;
+            }
+            while (end < num_nodes and nodes[end - 1] / 64 == nodes[end] / 64) {
+                ++end;
+            }
+            for (uint64_t k = begin; k < end; ++k) {
+                map.set(nodes[k], new_ids[k]);
+            }
+        });
+    }
+}
+
+}  // namespace poplar::parallel_tools
+
+#endif  // POPLAR_TRIE_PARALLEL_TOOLS_HPP
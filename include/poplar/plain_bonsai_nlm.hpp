@@ -24,17 +24,27 @@
 #ifndef POPLAR_TRIE_PLAIN_BONSAI_NLM_HPP
 #define POPLAR_TRIE_PLAIN_BONSAI_NLM_HPP
 
-#include <memory>
+#include <algorithm>
+#include <cstring>
 #include <vector>
 
 #include "basics.hpp"
 #include "compact_vector.hpp"
+#include "label_arena.hpp"
+#include "parallel_tools.hpp"
+#include "vbyte.hpp"
 
 namespace poplar {
 
-template <typename Value>
+// Labels are stored in an append-only arena and are referred to by OffsetBits-bit offsets.
+// Each label is preceded by its length in VByte and followed by the value.
+template <typename Value, uint32_t OffsetBits = 40>
 class plain_bonsai_nlm {
+    static_assert(OffsetBits < 64);
+
   public:
+    using this_type = plain_bonsai_nlm<Value, OffsetBits>;
+    using expanded_type = compact_vector;  // result of build_expanded()
     using value_type = Value;
 
     static constexpr auto trie_type_id = trie_type_ids::BONSAI_TRIE;
@@ -42,40 +52,68 @@ class plain_bonsai_nlm {
   public:
     plain_bonsai_nlm() = default;
 
-    explicit plain_bonsai_nlm(uint32_t capa_bits) : ptrs_(1ULL << capa_bits) {}
+    explicit plain_bonsai_nlm(uint32_t capa_bits) : offsets_(1ULL << capa_bits, OffsetBits) {}
 
     ~plain_bonsai_nlm() = default;
 
     std::pair<const value_type*, uint64_t> compare(uint64_t pos, const char_range& key) const {
-        assert(pos < ptrs_.size());
-        assert(ptrs_[pos]);
+        assert(pos < offsets_.size());
+        assert(offsets_[pos] != 0);
 
-        const uint8_t* ptr = ptrs_[pos].get();
+        uint64_t length = 0;
+        const uint8_t* ptr = get_label_(pos, length);
 
-        if (key.empty()) {
-            return {reinterpret_cast<const value_type*>(ptr), 0};
+        const uint64_t min_length = std::min(key.length(), length);
+        if (uint64_t i = find_mismatch(key.begin, ptr, min_length); i != min_length) {
+            return {nullptr, i};
         }
 
-        for (uint64_t i = 0; i < key.length(); ++i) {
-            if (key[i] != ptr[i]) {
-                return {nullptr, i};
-            }
+        // The virtual terminator of the shorter one mismatches.
+        if (key.length() != length) {
+            return {nullptr, min_length};
         }
 
-        return {reinterpret_cast<const value_type*>(ptr + key.length()), key.length()};
+        // +1 considers the terminator
+        return {reinterpret_cast<const value_type*>(ptr + length), length + 1};
+    }
+
+    bool has_label(uint64_t pos) const {
+        return offsets_[pos] != 0;
+    }
+
+    // Gets the label associated with pos and the value pointer.
+    // The label is empty if the key is terminated by the edge to pos.
+    std::pair<char_range, const value_type*> get_label(uint64_t pos) const {
+        assert(offsets_[pos] != 0);
+        uint64_t length = 0;
+        const uint8_t* ptr = get_label_(pos, length);
+        return {char_range{ptr, ptr + length}, reinterpret_cast<const value_type*>(ptr + length)};
+    }
+
+    // Prefetches the label associated with pos.
+    void prefetch(uint64_t pos) const {
+        assert(pos < offsets_.size());
+        if (uint64_t offset = offsets_[pos]; offset != 0) {
+            prefetch_address(arena_.get(offset - 1));
+        }
     }
 
     value_type* insert(uint64_t pos, const char_range& key) {
-        assert(!ptrs_[pos]);
+        assert(offsets_[pos] == 0);
 
         ++size_;
 
-        uint64_t length = key.length();
-        ptrs_[pos] = std::make_unique<uint8_t[]>(length + sizeof(value_type));
-        auto ptr = ptrs_[pos].get();
+        const uint64_t length = key.length();
+        const uint64_t bytes = vbyte::size(length) + length + sizeof(value_type);
+        uint64_t offset = arena_.allocate(bytes);
+        POPLAR_THROW_IF((offset + 1) >> OffsetBits != 0, "The offset of labels overflows OffsetBits.");
+
+        offsets_.set(pos, offset + 1);
+        auto ptr = arena_.get(offset);
+        ptr += vbyte::encode(ptr, length);
         copy_bytes(ptr, key.begin, length);
 
-        label_bytes_ += length + sizeof(value_type);
+        label_bytes_ += bytes;
 
 #ifdef POPLAR_EXTRA_STATS
         max_length_ = std::max(max_length_, length);
@@ -88,40 +126,139 @@ class plain_bonsai_nlm {
         return ret;
     }
 
+    // Inserts labels[i].second with the value values[i] at the position labels[i].first for each i.
+    void insert_bulk(const std::vector<std::pair<uint64_t, char_range>>& labels, const std::vector<value_type>& values) {
+        assert(labels.size() == values.size());
+        for (uint64_t i = 0; i < labels.size(); ++i) {
+            *insert(labels[i].first, labels[i].second) = values[i];
+        }
+    }
+
+    // Removes the label associated with pos, whose bytes are recycled by the arena.
+    void erase(uint64_t pos) {
+        assert(offsets_[pos] != 0);
+
+        const uint64_t offset = offsets_[pos] - 1;
+        uint64_t length = 0;
+        get_label_(pos, length);
+        const uint64_t bytes = vbyte::size(length) + length + sizeof(value_type);
+        arena_.deallocate(offset, bytes);
+        offsets_.set(pos, 0);
+
+        --size_;
+        label_bytes_ -= bytes;
+    }
+
     template <typename T>
-    void expand(const T& pos_map) {
-        std::vector<std::unique_ptr<uint8_t[]>> new_ptrs(ptrs_.size() * 2);
-        for (uint64_t i = 0; i < pos_map.size(); ++i) {
-            if (pos_map[i] != UINT64_MAX) {
-                new_ptrs[pos_map[i]] = std::move(ptrs_[i]);
+    void expand(const T& pos_map, uint32_t num_threads = 1) {
+        apply_expanded(build_expanded(pos_map, num_threads));
+    }
+
+    // Builds the offsets moved by pos_map as expand(), but leaves this store unchanged,
+    // so that it can be done while this store is read. The new offsets refer to the arena of this store.
+    template <typename T>
+    expanded_type build_expanded(const T& pos_map, uint32_t num_threads = 1) const {
+        assert(pos_map.size() == offsets_.size());
+
+        compact_vector new_offsets(offsets_.size() * 2, OffsetBits);
+        num_threads = parallel_tools::get_num_threads(num_threads, pos_map.size());
+
+        if (num_threads == 1) {
+            auto offset_it = offsets_.begin();
+            for (uint64_t i = 0; i < pos_map.size(); ++i, ++offset_it) {
+                if (pos_map[i] != UINT64_MAX) {
+                    new_offsets.set(pos_map[i], *offset_it);
+                }
             }
+            return new_offsets;
         }
-        ptrs_ = std::move(new_ptrs);
+
+        // The destination ranges are aligned to 64 slots so that no two threads write the same word.
+        const uint64_t old_range_size = parallel_tools::get_range_size(num_threads, pos_map.size(), 1);
+        const uint64_t new_range_size = parallel_tools::get_range_size(num_threads, new_offsets.size(), 64);
+        const uint64_t num_ranges = (new_offsets.size() + new_range_size - 1) / new_range_size;
+
+        // Pairs (new_pos, offset) grouped by the source and destination ranges
+        std::vector<std::vector<std::vector<std::pair<uint64_t, uint64_t>>>> moves(
+            num_threads, std::vector<std::vector<std::pair<uint64_t, uint64_t>>>(num_ranges));
+
+        parallel_tools::run_ranges(pos_map.size(), old_range_size, [&](uint64_t tid, uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; ++i) {
+                uint64_t offset = offsets_[i];
+                if (pos_map[i] != UINT64_MAX and offset != 0) {
+                    moves[tid][pos_map[i] / new_range_size].emplace_back(pos_map[i], offset);
+                }
+            }
+        });
+
+        parallel_tools::run_ranges(num_ranges, 1, [&](uint64_t, uint64_t r, uint64_t) {
+            for (const auto& tid_moves : moves) {
+                for (auto [new_pos, offset] : tid_moves[r]) {
+                    new_offsets.set(new_pos, offset);
+                }
+            }
+        });
+
+        return new_offsets;
+    }
+
+    // Replaces the offsets with those built by build_expanded().
+    void apply_expanded(expanded_type&& new_offsets) {
+        offsets_ = std::move(new_offsets);
     }
 
     uint64_t size() const {
         return size_;
     }
     uint64_t num_ptrs() const {
-        return ptrs_.size();
+        return offsets_.size();
     }
     uint64_t alloc_bytes() const {
         uint64_t bytes = 0;
-        bytes += ptrs_.capacity() * sizeof(std::unique_ptr<uint8_t[]>);
-        bytes += label_bytes_;
+        bytes += offsets_.alloc_bytes();
+        bytes += arena_.alloc_bytes();
         return bytes;
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, sizeof(value_type));
+        io_tools::save_param(os, OffsetBits);
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, label_bytes_);
+        offsets_.save(os);
+        arena_.save(os);
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, sizeof(value_type));
+        io_tools::load_param(is, OffsetBits);
+        size_ = io_tools::load_value(is);
+        label_bytes_ = io_tools::load_value(is);
+        offsets_.load(is);
+        arena_.load(is);
+    }
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(sizeof(value_type));
+        mapper.map_param(OffsetBits);
+        size_ = mapper.map_value();
+        label_bytes_ = mapper.map_value();
+        offsets_.load_view(mapper);
+        arena_.load_view(mapper);
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "plain_bonsai_nlm");
         show_stat(os, indent, "size", size());
         show_stat(os, indent, "num_ptrs", num_ptrs());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_stat(os, indent, "label_bytes", label_bytes_);
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "max_length", max_length_);
         show_stat(os, indent, "ave_length", double(sum_length_) / size());
 #endif
+        show_stat(os, indent, "offset_bits", OffsetBits);
+        show_member(os, indent, "arena_");
+        arena_.show_stats(os, n + 1);
     }
 
     plain_bonsai_nlm(const plain_bonsai_nlm&) = delete;
@@ -131,13 +268,21 @@ class plain_bonsai_nlm {
     plain_bonsai_nlm& operator=(plain_bonsai_nlm&&) noexcept = default;
 
   private:
-    std::vector<std::unique_ptr<uint8_t[]>> ptrs_;
+    // Offset of the label plus one, or zero if no label is associated
+    compact_vector offsets_;
+    label_arena<> arena_;
     uint64_t size_ = 0;
     uint64_t label_bytes_ = 0;
 #ifdef POPLAR_EXTRA_STATS
     uint64_t max_length_ = 0;
     uint64_t sum_length_ = 0;
 #endif
+
+    // Gets the pointer to the label associated with pos, which is preceded by its length.
+    const uint8_t* get_label_(uint64_t pos, uint64_t& length) const {
+        const uint8_t* ptr = arena_.get(offsets_[pos] - 1);
+        return ptr + vbyte::decode(ptr, length);
+    }
 };
 
 }  // namespace poplar
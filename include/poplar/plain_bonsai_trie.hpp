@@ -28,9 +28,13 @@
 #include "bit_vector.hpp"
 #include "compact_vector.hpp"
 #include "hash.hpp"
+#include "io_tools.hpp"
+#include "parallel_tools.hpp"
 
 namespace poplar {
 
+// A node removed by erase() leaves a tombstone, that is skipped by find_child() and reused by add_child().
+// The tombstones are counted toward MaxFactor and are dropped by expand().
 template <uint32_t MaxFactor = 90, typename Hasher = hash::vigna_hasher>
 class plain_bonsai_trie {
   private:
@@ -39,6 +43,8 @@ class plain_bonsai_trie {
   public:
     static constexpr uint64_t nil_id = UINT64_MAX;
     static constexpr uint32_t min_capa_bits = 16;
+    static constexpr uint32_t max_factor = MaxFactor;
+    static constexpr bool reversible = true;
 
     static constexpr auto trie_type_id = trie_type_ids::BONSAI_TRIE;
 
@@ -93,6 +99,14 @@ class plain_bonsai_trie {
         }
     }
 
+    // Prefetches the initial slot probed by find_child(node_id, symb).
+    void prefetch_child(uint64_t node_id, uint64_t symb) const {
+        assert(node_id < capa_size_.size());
+        assert(symb < symb_size_.size());
+
+        table_.prefetch(Hasher::hash(make_key_(node_id, symb)) & capa_size_.mask());
+    }
+
     bool add_child(uint64_t& node_id, uint64_t symb) {
         assert(node_id < capa_size_.size());
         assert(symb < symb_size_.size());
@@ -100,6 +114,8 @@ class plain_bonsai_trie {
         uint64_t key = make_key_(node_id, symb);
         assert(key != 0);
 
+        uint64_t tomb_id = nil_id;
+
         for (uint64_t i = Hasher::hash(key) & capa_size_.mask();; i = right_(i)) {
             if (i == 0) {
                 // table_[0] is always empty so that any table_[i] = 0 indicates to be empty.
@@ -112,7 +128,11 @@ class plain_bonsai_trie {
 
             if (table_[i] == 0) {
                 // this slot is empty
-                if (size_ == max_size_) {
+                if (tomb_id != nil_id) {
+                    // reuse the first tombstone on the probe
+                    i = tomb_id;
+                    --num_tombs_;
+                } else if (size_ + num_tombs_ == max_size_) {
                     return false;  // needs to expand
                 }
 
@@ -124,6 +144,11 @@ class plain_bonsai_trie {
                 return true;
             }
 
+            if (table_[i] == tomb_key and tomb_id == nil_id) {
+                tomb_id = i;
+                continue;
+            }
+
             if (table_[i] == key) {
                 node_id = i;
                 return false;  // already stored
@@ -131,11 +156,21 @@ class plain_bonsai_trie {
         }
     }
 
+    // Removes the leaf node by leaving a tombstone. The node ID can be reused by add_child().
+    void erase(uint64_t node_id) {
+        assert(node_id != get_root());
+        assert(is_node_(node_id));
+
+        table_.set(node_id, tomb_key);
+        --size_;
+        ++num_tombs_;
+    }
+
     std::pair<uint64_t, uint64_t> get_parent_and_symb(uint64_t node_id) const {
         assert(node_id < capa_size_.size());
 
         uint64_t key = table_[node_id];
-        if (key == 0) {
+        if (key == 0 or key == tomb_key) {
             // root or not exist
             return {nil_id, 0};
         }
@@ -172,10 +207,16 @@ class plain_bonsai_trie {
     };
 
     bool needs_to_expand() const {
-        return max_size() <= size();
+        return max_size() <= size() + num_tombs();
     }
 
-    node_map expand() {
+    // Doubles the capacity and returns the mapping from the old node IDs to the new ones.
+    // If num_threads > 1, the new table is built in parallel.
+    node_map expand(uint32_t num_threads = 1) {
+        if (1 < num_threads) {
+            return expand_parallel_(num_threads);
+        }
+
         plain_bonsai_trie new_ht{capa_bits() + 1, symb_size_.bits()};
         new_ht.add_root();
 
@@ -193,8 +234,8 @@ class plain_bonsai_trie {
 
         // 0 is empty, 1 is root
         for (uint64_t i = 2; i < table_.size(); ++i) {
-            if (done_flags[i] || table_[i] == 0) {
-                // skip already processed or empty elements
+            if (done_flags[i] || !is_node_(i)) {
+                // skip already processed, empty or erased elements
                 continue;
             }
 
@@ -223,10 +264,44 @@ class plain_bonsai_trie {
         return node_map;
     }
 
+    // Builds the trie of twice the capacity as expand(), but leaves this trie unchanged,
+    // so that it can be done while this trie is read.
+    std::pair<plain_bonsai_trie, node_map> build_expanded(uint32_t num_threads = 1) const {
+        plain_bonsai_trie new_ht{capa_bits() + 1, symb_size_.bits()};
+        new_ht.add_root();
+
+#ifdef POPLAR_EXTRA_STATS
+        new_ht.num_resize_ = num_resize_ + 1;
+#endif
+
+        compact_vector map{capa_size(), new_ht.capa_bits()};
+        bit_vector done_flags(capa_size());
+
+        parallel_tools::rebuild_bonsai(
+            num_threads, capa_size(), get_root(), new_ht.capa_size(), new_ht.get_root(),
+            [&](uint64_t i) { return is_node_(i); },
+            [&](uint64_t i) { return get_parent_and_symb(i); },
+            [&](uint64_t new_parent, uint64_t symb) {
+                uint64_t key = new_ht.make_key_(new_parent, symb);
+                return std::make_pair(key, Hasher::hash(key) & new_ht.capa_size_.mask());
+            },
+            [&](uint64_t key, uint64_t slot, uint64_t end) { return new_ht.try_place_(key, slot, end); },
+            [&](uint64_t key, uint64_t slot) { return new_ht.place_(key, slot); },
+            map, done_flags);
+
+        new_ht.size_ = size_;
+
+        return {std::move(new_ht), node_map{std::move(map), std::move(done_flags)}};
+    }
+
     // # of registerd nodes
     uint64_t size() const {
         return size_;
     }
+    // # of tombstones left by erase()
+    uint64_t num_tombs() const {
+        return num_tombs_;
+    }
     uint64_t max_size() const {
         return max_size_;
     }
@@ -251,12 +326,44 @@ class plain_bonsai_trie {
         return table_.alloc_bytes();
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, symb_size_.bits());
+        io_tools::save_value(os, size_);
+        io_tools::save_value(os, num_tombs_);
+        table_.save(os);
+    }
+    void load(std::istream& is) {
+        *this = plain_bonsai_trie{};
+        capa_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        symb_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = io_tools::load_value(is);
+        num_tombs_ = io_tools::load_value(is);
+        table_.load(is);
+        POPLAR_THROW_IF(table_.size() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+    // Makes the trie a read-only view over the bytes written by save().
+    void load_view(io_tools::mapper& mapper) {
+        *this = plain_bonsai_trie{};
+        capa_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        symb_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = mapper.map_value();
+        num_tombs_ = mapper.map_value();
+        table_.load_view(mapper);
+        POPLAR_THROW_IF(table_.size() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "plain_bonsai_trie");
         show_stat(os, indent, "factor", double(size()) / capa_size() * 100);
         show_stat(os, indent, "max_factor", MaxFactor);
         show_stat(os, indent, "size", size());
+        show_stat(os, indent, "num_tombs", num_tombs());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
         show_stat(os, indent, "capa_bits", capa_bits());
         show_stat(os, indent, "symb_bits", symb_bits());
@@ -272,8 +379,12 @@ class plain_bonsai_trie {
     plain_bonsai_trie& operator=(plain_bonsai_trie&&) noexcept = default;
 
   private:
+    // Key of tombstones, whose parent is slot 0 that never has a node.
+    static constexpr uint64_t tomb_key = 1;
+
     compact_vector table_;
     uint64_t size_ = 0;  // # of registered nodes
+    uint64_t num_tombs_ = 0;
     uint64_t max_size_ = 0;  // MaxFactor% of the capacity
     size_p2 capa_size_;
     size_p2 symb_size_;
@@ -287,6 +398,41 @@ class plain_bonsai_trie {
     uint64_t right_(uint64_t slot_id) const {
         return (slot_id + 1) & capa_size_.mask();
     }
+    bool is_node_(uint64_t slot_id) const {
+        return table_[slot_id] != 0 and table_[slot_id] != tomb_key;
+    }
+
+    node_map expand_parallel_(uint32_t num_threads) {
+        auto [new_ht, node_map] = build_expanded(num_threads);
+        std::swap(*this, new_ht);
+        return std::move(node_map);
+    }
+
+    // Places the key in the empty slot of [slot, end) if exists.
+    uint64_t try_place_(uint64_t key, uint64_t slot, uint64_t end) {
+        for (uint64_t i = slot; i < end; ++i) {
+            if (i == 0 or i == get_root()) {
+                continue;
+            }
+            if (table_[i] == 0) {
+                table_.set(i, key);
+                return i;
+            }
+        }
+        return nil_id;
+    }
+
+    uint64_t place_(uint64_t key, uint64_t slot) {
+        for (uint64_t i = slot;; i = right_(i)) {
+            if (i == 0 or i == get_root()) {
+                continue;
+            }
+            if (table_[i] == 0) {
+                table_.set(i, key);
+                return i;
+            }
+        }
+    }
 };
 
 }  // namespace poplar
@@ -24,16 +24,26 @@
 #ifndef POPLAR_TRIE_PLAIN_FKHASH_NLM_HPP
 #define POPLAR_TRIE_PLAIN_FKHASH_NLM_HPP
 
+#include <algorithm>
+#include <cstring>
 #include <vector>
 
 #include "basics.hpp"
+#include "compact_vector.hpp"
 #include "exception.hpp"
+#include "label_arena.hpp"
+#include "vbyte.hpp"
 
 namespace poplar {
 
-template <typename Value>
+// Labels are stored in an append-only arena and are referred to by OffsetBits-bit offsets.
+// Each label is preceded by its length in VByte and followed by the value.
+template <typename Value, uint32_t OffsetBits = 40>
 class plain_fkhash_nlm {
+    static_assert(OffsetBits < 64);
+
   public:
+    using this_type = plain_fkhash_nlm<Value, OffsetBits>;
     using value_type = Value;
 
     static constexpr auto trie_type_id = trie_type_ids::FKHASH_TRIE;
@@ -41,37 +51,65 @@ class plain_fkhash_nlm {
   public:
     plain_fkhash_nlm() = default;
 
-    explicit plain_fkhash_nlm(uint32_t capa_bits) {
-        ptrs_.reserve(1ULL << capa_bits);
+    explicit plain_fkhash_nlm(uint32_t capa_bits) : offsets_(0, OffsetBits) {
+        offsets_.reserve(1ULL << capa_bits);
     }
 
     ~plain_fkhash_nlm() = default;
 
     std::pair<const value_type*, uint64_t> compare(uint64_t pos, const char_range& key) const {
-        assert(pos < ptrs_.size());
-        assert(ptrs_[pos]);
+        assert(pos < offsets_.size());
+        assert(offsets_[pos] != 0);
 
-        const uint8_t* ptr = ptrs_[pos].get();
+        uint64_t length = 0;
+        const uint8_t* ptr = get_label_(pos, length);
 
-        if (key.empty()) {
-            return {reinterpret_cast<const value_type*>(ptr), 0};
+        const uint64_t min_length = std::min(key.length(), length);
+        if (uint64_t i = find_mismatch(key.begin, ptr, min_length); i != min_length) {
+            return {nullptr, i};
         }
 
-        for (uint64_t i = 0; i < key.length(); ++i) {
-            if (key[i] != ptr[i]) {
-                return {nullptr, i};
-            }
+        // The virtual terminator of the shorter one mismatches.
+        if (key.length() != length) {
+            return {nullptr, min_length};
         }
 
-        return {reinterpret_cast<const value_type*>(ptr + key.length()), key.length()};
+        // +1 considers the terminator
+        return {reinterpret_cast<const value_type*>(ptr + length), length + 1};
+    }
+
+    bool has_label(uint64_t pos) const {
+        return offsets_[pos] != 0;
+    }
+
+    // Gets the label associated with pos and the value pointer.
+    // The label is empty if the key is terminated by the edge to pos.
+    std::pair<char_range, const value_type*> get_label(uint64_t pos) const {
+        assert(offsets_[pos] != 0);
+        uint64_t length = 0;
+        const uint8_t* ptr = get_label_(pos, length);
+        return {char_range{ptr, ptr + length}, reinterpret_cast<const value_type*>(ptr + length)};
+    }
+
+    // Prefetches the label associated with pos.
+    void prefetch(uint64_t pos) const {
+        assert(pos < offsets_.size());
+        if (uint64_t offset = offsets_[pos]; offset != 0) {
+            prefetch_address(arena_.get(offset - 1));
+        }
     }
 
     value_type* append(const char_range& key) {
-        uint64_t length = key.length();
-        ptrs_.emplace_back(std::make_unique<uint8_t[]>(length + sizeof(value_type)));
-        label_bytes_ += length + sizeof(value_type);
+        const uint64_t length = key.length();
+        const uint64_t bytes = vbyte::size(length) + length + sizeof(value_type);
+        uint64_t offset = arena_.allocate(bytes);
+        POPLAR_THROW_IF((offset + 1) >> OffsetBits != 0, "The offset of labels overflows OffsetBits.");
 
-        auto ptr = ptrs_.back().get();
+        offsets_.push_back(offset + 1);
+        label_bytes_ += bytes;
+
+        auto ptr = arena_.get(offset);
+        ptr += vbyte::encode(ptr, length);
         copy_bytes(ptr, key.begin, length);
 
 #ifdef POPLAR_EXTRA_STATS
@@ -86,28 +124,54 @@ class plain_fkhash_nlm {
     }
 
     void append_dummy() {
-        ptrs_.emplace_back(nullptr);
+        offsets_.push_back(0);
     }
 
     uint64_t size() const {
-        return ptrs_.size();
+        return offsets_.size();
     }
     uint64_t alloc_bytes() const {
         uint64_t bytes = 0;
-        bytes += ptrs_.capacity() * sizeof(std::unique_ptr<uint8_t[]>);
-        bytes += label_bytes_;
+        bytes += offsets_.alloc_bytes();
+        bytes += arena_.alloc_bytes();
         return bytes;
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, sizeof(value_type));
+        io_tools::save_param(os, OffsetBits);
+        io_tools::save_value(os, label_bytes_);
+        offsets_.save(os);
+        arena_.save(os);
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, sizeof(value_type));
+        io_tools::load_param(is, OffsetBits);
+        label_bytes_ = io_tools::load_value(is);
+        offsets_.load(is);
+        arena_.load(is);
+    }
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(sizeof(value_type));
+        mapper.map_param(OffsetBits);
+        label_bytes_ = mapper.map_value();
+        offsets_.load_view(mapper);
+        arena_.load_view(mapper);
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "plain_fkhash_nlm");
         show_stat(os, indent, "size", size());
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_stat(os, indent, "label_bytes", label_bytes_);
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "max_length", max_length_);
         show_stat(os, indent, "ave_length", double(sum_length_) / size());
 #endif
+        show_stat(os, indent, "offset_bits", OffsetBits);
+        show_member(os, indent, "arena_");
+        arena_.show_stats(os, n + 1);
     }
 
     plain_fkhash_nlm(const plain_fkhash_nlm&) = delete;
@@ -117,12 +181,20 @@ class plain_fkhash_nlm {
     plain_fkhash_nlm& operator=(plain_fkhash_nlm&&) noexcept = default;
 
   private:
-    std::vector<std::unique_ptr<uint8_t[]>> ptrs_;
+    // Offset of the label plus one, or zero for a dummy (step node)
+    compact_vector offsets_;
+    label_arena<> arena_;
     uint64_t label_bytes_ = 0;
 #ifdef POPLAR_EXTRA_STATS
     uint64_t max_length_ = 0;
     uint64_t sum_length_ = 0;
 #endif
+
+    // Gets the pointer to the label associated with pos, which is preceded by its length.
+    const uint8_t* get_label_(uint64_t pos, uint64_t& length) const {
+        const uint8_t* ptr = arena_.get(offsets_[pos] - 1);
+        return ptr + vbyte::decode(ptr, length);
+    }
 };
 
 }  // namespace poplar
@@ -25,24 +25,39 @@
 #define POPLAR_TRIE_PLAIN_FKHASH_TRIE_HPP
 
 #include <iostream>
+#include <memory>
 
 #include "bit_tools.hpp"
 #include "bit_vector.hpp"
+#include "bucket_vector.hpp"
 #include "compact_vector.hpp"
 #include "hash.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
-// The node IDs are arranged incrementally
-template <uint32_t MaxFactor = 90, typename Hasher = hash::vigna_hasher>
+// The node IDs are arranged incrementally.
+// If Incremental is true, the hash table is resized incrementally; the old table is kept alive
+// and its slots are migrated to the new one little by little in add_child().
+// If Reversible is true, the slot of each node is also kept to support get_parent_and_symb().
+// If Bucketed is true, the key and the ID of each slot are stored together in 64-byte buckets,
+// so that a probe usually touches one cache line instead of one line in each array.
+template <uint32_t MaxFactor = 90, typename Hasher = hash::vigna_hasher, bool Incremental = false,
+          bool Reversible = false, bool Bucketed = false>
 class plain_fkhash_trie {
     static_assert(0 < MaxFactor and MaxFactor < 100);
 
   public:
-    using this_type = plain_fkhash_trie<MaxFactor, Hasher>;
+    using this_type = plain_fkhash_trie<MaxFactor, Hasher, Incremental, Reversible, Bucketed>;
 
     static constexpr uint64_t nil_id = UINT64_MAX;
     static constexpr uint32_t min_capa_bits = 16;
+    static constexpr uint32_t max_factor = MaxFactor;
+    static constexpr bool incremental = Incremental;
+    static constexpr bool reversible = Reversible;
+    static constexpr bool bucketed = Bucketed;
+    // # of old slots migrated per add_child(), which completes the migration before the new table is filled
+    static constexpr uint64_t migration_step = 200 / MaxFactor + 1;
 
     static constexpr auto trie_type_id = trie_type_ids::FKHASH_TRIE;
 
@@ -53,8 +68,15 @@ class plain_fkhash_trie {
         capa_size_ = size_p2{std::max(min_capa_bits, capa_bits)};
         symb_size_ = size_p2{symb_bits};
         max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
-        table_ = compact_vector{capa_size_.size(), capa_size_.bits() + symb_size_.bits()};
-        ids_ = compact_vector{capa_size_.size(), capa_size_.bits()};
+        if constexpr (Bucketed) {
+            buckets_ = bucket_vector<2>{capa_size_.size(), {capa_size_.bits() + symb_size_.bits(), capa_size_.bits()}};
+        } else {
+            table_ = compact_vector{capa_size_.size(), capa_size_.bits() + symb_size_.bits()};
+            ids_ = compact_vector{capa_size_.size(), capa_size_.bits()};
+        }
+        if constexpr (Reversible) {
+            slots_ = compact_vector{capa_size_.size(), capa_size_.bits()};
+        }
     }
 
     ~plain_fkhash_trie() = default;
@@ -81,48 +103,109 @@ class plain_fkhash_trie {
         uint64_t key = make_key_(node_id, symb);
 
         for (uint64_t i = init_id_(key);; i = right_(i)) {
-            uint64_t child_id = ids_[i];
+            uint64_t child_id = get_id_(i);
 
             if (child_id == 0) {  // empty?
-                return nil_id;
+                return find_old_child_(node_id, symb);
             }
-            if (table_[i] == key) {
+            if (get_table_(i) == key) {
                 return child_id;
             }
         }
     }
 
+    // Prefetches the initial slot probed by find_child(node_id, symb).
+    void prefetch_child(uint64_t node_id, uint64_t symb) const {
+        assert(node_id < capa_size_.size());
+        assert(symb < symb_size_.size());
+
+        uint64_t i = init_id_(make_key_(node_id, symb));
+        if constexpr (Bucketed) {
+            buckets_.prefetch(i);
+        } else {
+            ids_.prefetch(i);
+            table_.prefetch(i);
+        }
+    }
+
+    // Expands the hash table in advance so that num_nodes nodes can be stored without resizing.
+    void reserve(uint64_t num_nodes) {
+        uint32_t new_capa_bits = capa_bits();
+        while (static_cast<uint64_t>((1ULL << new_capa_bits) * MaxFactor / 100.0) <= num_nodes) {
+            ++new_capa_bits;
+        }
+        if (capa_bits() < new_capa_bits) {
+            expand_(new_capa_bits);
+        }
+    }
+
     bool add_child(uint64_t& node_id, uint64_t symb) {
         assert(node_id < capa_size_.size());
         assert(symb < symb_size_.size());
 
         if (max_size() <= size()) {
-            expand_();
+            if constexpr (Incremental) {
+                start_expansion_();
+            } else {
+                expand_(capa_bits() + 1);
+            }
+        }
+
+        if constexpr (Incremental) {
+            if (old_ht_) {
+                migrate_(migration_step);
+                uint64_t child_id = find_old_child_(node_id, symb);
+                if (child_id != nil_id) {
+                    node_id = child_id;
+                    return false;  // already stored
+                }
+            }
         }
 
+        // The key can be 0 for the root, since empty slots are indicated by the IDs.
         uint64_t key = make_key_(node_id, symb);
-        assert(key != 0);
 
         for (uint64_t i = init_id_(key);; i = right_(i)) {
-            uint64_t child_id = ids_[i];
+            uint64_t child_id = get_id_(i);
 
             if (child_id == 0) {  // empty?
                 node_id = size_++;  // new child_id
                 assert(node_id != 0);
 
-                table_.set(i, key);
-                ids_.set(i, node_id);
+                set_slot_(i, key, node_id);
+                if constexpr (Reversible) {
+                    slots_.set(node_id, i);
+                }
 
                 return true;
             }
 
-            if (table_[i] == key) {
+            if (get_table_(i) == key) {
                 node_id = child_id;
                 return false;  // already stored
             }
         }
     }
 
+    std::pair<uint64_t, uint64_t> get_parent_and_symb(uint64_t node_id) const {
+        static_assert(Reversible, "get_parent_and_symb() needs Reversible.");
+        assert(node_id < size_);
+
+        if (node_id == get_root()) {
+            return {nil_id, 0};
+        }
+        if constexpr (Incremental) {
+            // The node is still in the old table if its slot has not been migrated.
+            if (old_ht_ and node_id < old_ht_->size() and num_migrated_ <= old_ht_->slots_[node_id]) {
+                return old_ht_->get_parent_and_symb(node_id);
+            }
+        }
+
+        uint64_t key = get_table_(slots_[node_id]);
+        // Returns pair (parent, label)
+        return std::make_pair(key >> symb_size_.bits(), key & symb_size_.mask());
+    }
+
     // # of registerd nodes
     uint64_t size() const {
         return size_;
@@ -151,9 +234,90 @@ class plain_fkhash_trie {
         uint64_t bytes = 0;
         bytes += table_.alloc_bytes();
         bytes += ids_.alloc_bytes();
+        bytes += buckets_.alloc_bytes();
+        bytes += slots_.alloc_bytes();
+        if (old_ht_) {
+            bytes += old_ht_->alloc_bytes();
+        }
         return bytes;
     }
 
+    // The old table under migration is also saved.
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, Reversible);
+        io_tools::save_param(os, Bucketed);
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, symb_size_.bits());
+        io_tools::save_value(os, size_);
+        if constexpr (Bucketed) {
+            buckets_.save(os);
+        } else {
+            table_.save(os);
+            ids_.save(os);
+        }
+        if constexpr (Reversible) {
+            slots_.save(os);
+        }
+        io_tools::save_value(os, old_ht_ ? 1 : 0);
+        if (old_ht_) {
+            io_tools::save_value(os, num_migrated_);
+            old_ht_->save(os);
+        }
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, Reversible);
+        io_tools::load_param(is, Bucketed);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        symb_size_ = size_p2{static_cast<uint32_t>(io_tools::load_value(is))};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = io_tools::load_value(is);
+        if constexpr (Bucketed) {
+            buckets_.load(is);
+        } else {
+            table_.load(is);
+            ids_.load(is);
+        }
+        if constexpr (Reversible) {
+            slots_.load(is);
+        }
+        if (io_tools::load_value(is) != 0) {
+            POPLAR_THROW_IF(!Incremental, "The serialized data structure has a different type.");
+            num_migrated_ = io_tools::load_value(is);
+            old_ht_ = std::make_unique<this_type>();
+            old_ht_->load(is);
+        }
+        POPLAR_THROW_IF(table_size_() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+    // Makes the trie a read-only view over the bytes written by save().
+    void load_view(io_tools::mapper& mapper) {
+        mapper.map_param(Reversible);
+        mapper.map_param(Bucketed);
+        *this = this_type{};
+        capa_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        symb_size_ = size_p2{static_cast<uint32_t>(mapper.map_value())};
+        max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+        size_ = mapper.map_value();
+        if constexpr (Bucketed) {
+            buckets_.load_view(mapper);
+        } else {
+            table_.load_view(mapper);
+            ids_.load_view(mapper);
+        }
+        if constexpr (Reversible) {
+            slots_.load_view(mapper);
+        }
+        if (mapper.map_value() != 0) {
+            POPLAR_THROW_IF(!Incremental, "The serialized data structure has a different type.");
+            num_migrated_ = mapper.map_value();
+            old_ht_ = std::make_unique<this_type>();
+            old_ht_->load_view(mapper);
+        }
+        POPLAR_THROW_IF(table_size_() != (capa_size_.bits() == 0 ? 0 : capa_size_.size()),
+                        "The serialized data is broken.");
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "plain_fkhash_trie");
@@ -163,6 +327,7 @@ class plain_fkhash_trie {
         show_stat(os, indent, "alloc_bytes", alloc_bytes());
         show_stat(os, indent, "capa_bits", capa_bits());
         show_stat(os, indent, "symb_bits", symb_bits());
+        show_stat(os, indent, "bucketed", Bucketed);
 #ifdef POPLAR_EXTRA_STATS
         show_stat(os, indent, "num_resize", num_resize_);
 #endif
@@ -177,14 +342,22 @@ class plain_fkhash_trie {
   private:
     compact_vector table_;
     compact_vector ids_;
+    bucket_vector<2> buckets_;  // fields of table_ and ids_ in buckets (only if Bucketed)
+    compact_vector slots_;  // slot IDs of the nodes (only if Reversible)
     uint64_t size_ = 0;  // # of registered nodes
     uint64_t max_size_ = 0;  // MaxFactor% of the capacity
     size_p2 capa_size_;
     size_p2 symb_size_;
+    // The old table under migration and the # of its slots already migrated (only if Incremental)
+    std::unique_ptr<this_type> old_ht_;
+    uint64_t num_migrated_ = 0;
 #ifdef POPLAR_EXTRA_STATS
     uint64_t num_resize_ = 0;
 #endif
 
+    static constexpr uint32_t table_field = 0;
+    static constexpr uint32_t id_field = 1;
+
     uint64_t make_key_(uint64_t node_id, uint64_t symb) const {
         return (node_id << symb_size_.bits()) | symb;
     }
@@ -195,33 +368,118 @@ class plain_fkhash_trie {
         return (slot_id + 1) & capa_size_.mask();
     }
 
-    void expand_() {
-        this_type new_ht{capa_bits() + 1, symb_bits()};
-#ifdef POPLAR_EXTRA_STATS
-        new_ht.num_resize_ = num_resize_ + 1;
-#endif
+    uint64_t get_table_(uint64_t slot_id) const {
+        if constexpr (Bucketed) {
+            return buckets_.get(slot_id, table_field);
+        } else {
+            return table_[slot_id];
+        }
+    }
+    uint64_t get_id_(uint64_t slot_id) const {
+        if constexpr (Bucketed) {
+            return buckets_.get(slot_id, id_field);
+        } else {
+            return ids_[slot_id];
+        }
+    }
+    void set_slot_(uint64_t slot_id, uint64_t key, uint64_t node_id) {
+        if constexpr (Bucketed) {
+            buckets_.set(slot_id, table_field, key);
+            buckets_.set(slot_id, id_field, node_id);
+        } else {
+            table_.set(slot_id, key);
+            ids_.set(slot_id, node_id);
+        }
+    }
+    uint64_t table_size_() const {
+        return Bucketed ? buckets_.size() : table_.size();
+    }
 
-        for (uint64_t i = 0; i < capa_size_.size(); ++i) {
-            uint64_t child_id = ids_[i];
-            if (child_id == 0) {  // empty?
-                continue;
+    // Searches the child from the old table under migration.
+    uint64_t find_old_child_(uint64_t node_id, uint64_t symb) const {
+        if constexpr (Incremental) {
+            // Nodes added after starting the migration do not appear in the old table.
+            if (old_ht_ and node_id < old_ht_->size()) {
+                return old_ht_->find_child(node_id, symb);
             }
+        }
+        return nil_id;
+    }
 
-            uint64_t key = table_[i];
-            assert(key != 0);
+    // Moves the item in slot i of ht to this table.
+    void move_slot_(const this_type& ht, uint64_t i) {
+        move_slot_(ht, i, ht.get_id_(i));
+    }
+    void move_slot_(const this_type& ht, uint64_t i, uint64_t child_id) {
+        if (child_id == 0) {  // empty?
+            return;
+        }
+
+        uint64_t key = ht.get_table_(i);
 
-            for (uint64_t new_i = new_ht.init_id_(key);; new_i = new_ht.right_(new_i)) {
-                if (new_ht.ids_[new_i] == 0) {  // empty?
-                    new_ht.table_.set(new_i, key);
-                    new_ht.ids_.set(new_i, child_id);
-                    break;
+        for (uint64_t new_i = init_id_(key);; new_i = right_(new_i)) {
+            if (get_id_(new_i) == 0) {  // empty?
+                set_slot_(new_i, key, child_id);
+                if constexpr (Reversible) {
+                    slots_.set(child_id, new_i);
                 }
+                break;
+            }
+        }
+    }
+
+    void expand_(uint32_t new_capa_bits) {
+        migrate_(UINT64_MAX);
+
+        this_type new_ht{new_capa_bits, symb_bits()};
+#ifdef POPLAR_EXTRA_STATS
+        new_ht.num_resize_ = num_resize_ + 1;
+#endif
+
+        if constexpr (Bucketed) {
+            for (uint64_t i = 0; i < capa_size_.size(); ++i) {
+                new_ht.move_slot_(*this, i);
+            }
+        } else {
+            uint64_t i = 0;
+            for (uint64_t child_id : ids_) {
+                new_ht.move_slot_(*this, i++, child_id);
             }
         }
 
         new_ht.size_ = size_;
         *this = std::move(new_ht);
     }
+
+    // Allocates the new table and makes the current one old.
+    void start_expansion_() {
+        migrate_(UINT64_MAX);
+
+        auto old_ht = std::make_unique<this_type>(std::move(*this));
+        *this = this_type{old_ht->capa_bits() + 1, old_ht->symb_bits()};
+#ifdef POPLAR_EXTRA_STATS
+        num_resize_ = old_ht->num_resize_ + 1;
+#endif
+        size_ = old_ht->size_;
+        old_ht_ = std::move(old_ht);
+        num_migrated_ = 0;
+    }
+
+    // Migrates at most num_slots slots of the old table.
+    void migrate_(uint64_t num_slots) {
+        if (!old_ht_) {
+            return;
+        }
+
+        const uint64_t end = std::min(old_ht_->capa_size(), num_migrated_ + std::min(num_slots, old_ht_->capa_size()));
+        for (; num_migrated_ < end; ++num_migrated_) {
+            move_slot_(*old_ht_, num_migrated_);
+        }
+
+        if (num_migrated_ == old_ht_->capa_size()) {
+            old_ht_.reset();
+        }
+    }
 };
 
 }  // namespace poplar
@@ -25,5 +25,6 @@
 #define POPLAR_TRIE_CONFIG_HPP
 
 /* #undef POPLAR_EXTRA_STATS */
+/* #undef POPLAR_DISABLE_CPU_DISPATCH */
 
 #endif // POPLAR_TRIE_CONFIG_HPP
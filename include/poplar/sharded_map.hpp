@@ -0,0 +1,315 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_SHARDED_MAP_HPP
+#define POPLAR_TRIE_SHARDED_MAP_HPP
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+
+#include "hash.hpp"
+#include "map.hpp"
+#include "parallel_tools.hpp"
+
+namespace poplar {
+
+// Concurrent map that routes each key by its hash to one of NumShards independent maps. Each shard is
+// guarded by a reader/writer lock, so lookups and insertions on different shards proceed in parallel,
+// and lookups on the same shard share the lock. Since the value pointers of a shard are invalidated by
+// insertions on it, the values are copied out or accessed through callbacks under the lock.
+// Map is an instance of map, such as compact_bonsai_map<int>.
+template <typename Map, uint32_t NumShards = 64>
+class sharded_map {
+    static_assert(is_power2(NumShards));
+
+  public:
+    using this_type = sharded_map<Map, NumShards>;
+    using map_type = Map;
+    using value_type = typename map_type::value_type;
+
+    static constexpr uint32_t num_shards = NumShards;
+
+  public:
+    sharded_map() : shards_(std::make_unique<shard_[]>(NumShards)) {}
+
+    // Each shard is initialized with 2**capa_bits slots.
+    explicit sharded_map(uint32_t capa_bits, uint64_t lambda = 32) : sharded_map() {
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            shards_[i].map = map_type{capa_bits, lambda};
+        }
+    }
+
+    ~sharded_map() = default;
+
+    // Searches the given key and returns a copy of the value if registered.
+    std::optional<value_type> find(std::string_view key) const {
+        return find(make_char_range(key));
+    }
+    std::optional<value_type> find(char_range key) const {
+        const auto& shard = get_shard_(key);
+        std::shared_lock lock(shard.mutex);
+        auto vptr = shard.map.find(key);
+        return vptr != nullptr ? std::optional<value_type>{*vptr} : std::nullopt;
+    }
+
+    // Inserts the given key and calls fn(value) for the reference to its value, under the lock of the shard.
+    template <class Fn>
+    void update(std::string_view key, Fn&& fn) {
+        update(make_char_range(key), std::forward<Fn>(fn));
+    }
+    template <class Fn>
+    void update(char_range key, Fn&& fn) {
+        auto& shard = get_shard_(key);
+        std::unique_lock lock(shard.mutex);
+        fn(*shard.map.update(key));
+    }
+
+    // Removes the given key and returns true if registered (only if map_type is erasable).
+    bool erase(std::string_view key) {
+        return erase(make_char_range(key));
+    }
+    bool erase(char_range key) {
+        auto& shard = get_shard_(key);
+        std::unique_lock lock(shard.mutex);
+        return shard.map.erase(key);
+    }
+
+    // Searches the given keys and stores the copies of the values in values[0..num_keys), as find().
+    // The keys are grouped by shard, and the shards are searched in parallel with find_batch() of map.
+    void find_batch(const char_range* keys, uint64_t num_keys, std::optional<value_type>* values) const {
+        auto [order, begins] = group_keys_(keys, num_keys);
+
+        run_shards_(keys, order, begins, num_threads_, [&](uint32_t shard_id, const char_range* shard_keys,
+                                                           const uint64_t* key_ids, uint64_t num_shard_keys) {
+            std::vector<const value_type*> vptrs(num_shard_keys);
+            const auto& shard = shards_[shard_id];
+            std::shared_lock lock(shard.mutex);
+            shard.map.find_batch(shard_keys, num_shard_keys, vptrs.data());
+            for (uint64_t i = 0; i < num_shard_keys; ++i) {
+                values[key_ids[i]] = vptrs[i] != nullptr ? std::optional<value_type>{*vptrs[i]} : std::nullopt;
+            }
+        });
+    }
+
+    // Inserts the given keys and calls fn(i, value) for the reference to the value of keys[i].
+    // The keys are grouped by shard, and the shards are updated in parallel with update_batch() of map.
+    // fn is called from several threads at once for different shards and must not throw.
+    template <class Fn>
+    void update_batch(const char_range* keys, uint64_t num_keys, Fn&& fn) {
+        auto [order, begins] = group_keys_(keys, num_keys);
+
+        run_shards_(keys, order, begins, num_threads_, [&](uint32_t shard_id, const char_range* shard_keys,
+                                                           const uint64_t* key_ids, uint64_t num_shard_keys) {
+            std::vector<value_type*> vptrs(num_shard_keys);
+            auto& shard = shards_[shard_id];
+            std::unique_lock lock(shard.mutex);
+            shard.map.update_batch(shard_keys, num_shard_keys, vptrs.data());
+            for (uint64_t i = 0; i < num_shard_keys; ++i) {
+                fn(key_ids[i], *vptrs[i]);
+            }
+        });
+    }
+
+    // Builds the empty map from the pairs of keys and values in [first, last) on num_threads threads, where
+    // the keys are convertible to std::string_view and alive during the call. The keys are grouped by shard
+    // keeping their order, and each shard is built independently by a thread. A shard whose keys are in
+    // strictly increasing order is built by build_from_sorted() of map; otherwise, by update_batch(),
+    // where the last value is kept for duplicate keys. Hence, the sorted keys are built fastest.
+    template <class Iterator>
+    void parallel_build(Iterator first, Iterator last, uint32_t num_threads) {
+        POPLAR_THROW_IF(num_threads == 0, "num_threads must be positive.");
+        POPLAR_THROW_IF(size() != 0, "parallel_build() needs an empty map.");
+
+        std::vector<char_range> keys;
+        std::vector<value_type> values;
+        for (; first != last; ++first) {
+            const auto& [str, value] = *first;
+            keys.push_back(make_char_range(str));
+            values.push_back(static_cast<value_type>(value));
+        }
+        auto [order, begins] = group_keys_(keys.data(), keys.size());
+
+        run_shards_(keys.data(), order, begins, num_threads, [&](uint32_t shard_id, const char_range* shard_keys,
+                                                                  const uint64_t* key_ids, uint64_t num_shard_keys) {
+            auto& shard = shards_[shard_id];
+            std::unique_lock lock(shard.mutex);
+
+            auto make_view = [](const char_range& key) {
+                return std::string_view(reinterpret_cast<const char*>(key.begin), key.length());
+            };
+
+            bool is_sorted = true;
+            for (uint64_t i = 1; i < num_shard_keys and is_sorted; ++i) {
+                is_sorted = make_view(shard_keys[i - 1]) < make_view(shard_keys[i]);
+            }
+
+            if (is_sorted) {
+                std::vector<std::pair<std::string_view, value_type>> pairs(num_shard_keys);
+                for (uint64_t i = 0; i < num_shard_keys; ++i) {
+                    pairs[i] = {make_view(shard_keys[i]), values[key_ids[i]]};
+                }
+                shard.map.build_from_sorted(pairs.begin(), pairs.end());
+            } else {
+                std::vector<value_type*> vptrs(num_shard_keys);
+                shard.map.update_batch(shard_keys, num_shard_keys, vptrs.data());
+                for (uint64_t i = 0; i < num_shard_keys; ++i) {
+                    *vptrs[i] = values[key_ids[i]];
+                }
+            }
+        });
+    }
+
+    // Sets the # of threads used by find_batch() and update_batch(), up to NumShards.
+    void set_num_threads(uint32_t num_threads) {
+        POPLAR_THROW_IF(num_threads == 0, "num_threads must be positive.");
+        num_threads_ = num_threads;
+    }
+    uint32_t num_threads() const {
+        return num_threads_;
+    }
+
+    // Gets the number of registered keys.
+    uint64_t size() const {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            std::shared_lock lock(shards_[i].mutex);
+            sum += shards_[i].map.size();
+        }
+        return sum;
+    }
+    uint64_t alloc_bytes() const {
+        uint64_t sum = sizeof(shard_) * NumShards;
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            std::shared_lock lock(shards_[i].mutex);
+            sum += shards_[i].map.alloc_bytes();
+        }
+        return sum;
+    }
+
+    // The shards are written in order, each locked only while it is written.
+    void save(std::ostream& os) const {
+        io_tools::save_param(os, NumShards);
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            std::shared_lock lock(shards_[i].mutex);
+            shards_[i].map.save(os);
+        }
+    }
+    void load(std::istream& is) {
+        io_tools::load_param(is, NumShards);
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            std::unique_lock lock(shards_[i].mutex);
+            shards_[i].map.load(is);
+        }
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "sharded_map");
+        show_stat(os, indent, "num_shards", NumShards);
+        show_stat(os, indent, "size", size());
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+        show_stat(os, indent, "num_threads", num_threads_);
+    }
+
+    sharded_map(const sharded_map&) = delete;
+    sharded_map& operator=(const sharded_map&) = delete;
+
+    sharded_map(sharded_map&&) noexcept = default;
+    sharded_map& operator=(sharded_map&&) noexcept = default;
+
+  private:
+    // Aligned to cache lines so that the locks of neighboring shards do not share a line
+    struct alignas(64) shard_ {
+        mutable std::shared_mutex mutex;
+        map_type map;
+    };
+
+    std::unique_ptr<shard_[]> shards_;
+    uint32_t num_threads_ = 1;
+
+    static uint32_t get_shard_id_(char_range key) {
+        return static_cast<uint32_t>(hash::hash_range(key) & (NumShards - 1));
+    }
+    shard_& get_shard_(char_range key) {
+        return shards_[get_shard_id_(key)];
+    }
+    const shard_& get_shard_(char_range key) const {
+        return shards_[get_shard_id_(key)];
+    }
+
+    // Sorts the key IDs by shard with counting sort. The keys of shard i are order[begins[i]..begins[i+1]).
+    static std::pair<std::vector<uint64_t>, std::vector<uint64_t>> group_keys_(const char_range* keys,
+                                                                                  uint64_t num_keys) {
+        std::vector<uint32_t> shard_ids(num_keys);
+        std::vector<uint64_t> begins(NumShards + 1);
+        for (uint64_t i = 0; i < num_keys; ++i) {
+            shard_ids[i] = get_shard_id_(keys[i]);
+            ++begins[shard_ids[i] + 1];
+        }
+        for (uint32_t i = 0; i < NumShards; ++i) {
+            begins[i + 1] += begins[i];
+        }
+
+        std::vector<uint64_t> order(num_keys);
+        std::vector<uint64_t> offsets(begins.begin(), begins.end() - 1);
+        for (uint64_t i = 0; i < num_keys; ++i) {
+            order[offsets[shard_ids[i]]++] = i;
+        }
+        return {std::move(order), std::move(begins)};
+    }
+
+    // Runs fn(shard_id, shard_keys, key_ids, num_shard_keys) for each shard having keys, where the shards
+    // are split into num_threads ranges processed in parallel.
+    template <class Fn>
+    void run_shards_(const char_range* keys, const std::vector<uint64_t>& order,
+                     const std::vector<uint64_t>& begins, uint32_t num_threads, Fn&& fn) const {
+        const uint64_t num_keys = order.size();
+        if (num_keys == 0) {
+            return;
+        }
+
+        std::vector<char_range> shard_keys(num_keys);
+        for (uint64_t i = 0; i < num_keys; ++i) {
+            shard_keys[i] = keys[order[i]];
+        }
+
+        num_threads = static_cast<uint32_t>(std::min<uint64_t>(num_threads, NumShards));
+        const uint64_t range_size = parallel_tools::get_range_size(num_threads, NumShards, 1);
+
+        parallel_tools::run_ranges(NumShards, range_size, [&](uint64_t, uint64_t begin, uint64_t end) {
+            for (uint64_t i = begin; i < end; ++i) {
+                const uint64_t num_shard_keys = begins[i + 1] - begins[i];
+                if (num_shard_keys != 0) {
+                    fn(static_cast<uint32_t>(i), shard_keys.data() + begins[i], order.data() + begins[i],
+                       num_shard_keys);
+                }
+            }
+        });
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_SHARDED_MAP_HPP
@@ -0,0 +1,191 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef POPLAR_TRIE_SLAB_ALLOCATOR_HPP
+#define POPLAR_TRIE_SLAB_ALLOCATOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "bit_tools.hpp"
+
+namespace poplar {
+
+// Size-class allocator of byte buffers. Blocks of the same class are carved from pages of
+// PageBytes bytes and recycled through the free list of the class. Blocks larger than
+// PageBytes / 8 are allocated individually.
+// The capacity of a block is the size of its class, where 2**ClassBits classes are defined for each
+// power of two; so a buffer can grow in place up to capacity(bytes) bytes. A larger ClassBits gives
+// less slack but more reallocations.
+// The allocator owns all the memory, that is released at destruction. It is not thread-safe.
+template <uint64_t PageBytes = 1ULL << 16, uint32_t ClassBits = 2>
+class slab_allocator {
+    static_assert(is_power2(PageBytes) and 1024 <= PageBytes);
+    static_assert((8ULL << ClassBits) < PageBytes / 8);
+
+  public:
+    using this_type = slab_allocator<PageBytes, ClassBits>;
+
+    static constexpr uint64_t page_bytes = PageBytes;
+    static constexpr uint64_t max_class_bytes = PageBytes / 8;
+
+  public:
+    slab_allocator() = default;
+
+    ~slab_allocator() = default;
+
+    // Gets the capacity of the block allocated for the given bytes.
+    static constexpr uint64_t capacity(uint64_t bytes) {
+        if (bytes <= small_bytes) {
+            return std::max<uint64_t>(8, (bytes + 7) / 8 * 8);
+        }
+        const uint64_t step = 1ULL << (bit_tools::msb(bytes - 1) - ClassBits);
+        return (bytes + step - 1) / step * step;
+    }
+
+    uint8_t* allocate(uint64_t bytes) {
+        const uint64_t capa = capacity(bytes);
+
+        if (max_class_bytes < capa) {
+            auto block = std::make_unique<uint8_t[]>(capa);
+            uint8_t* ptr = block.get();
+            large_blocks_.emplace(ptr, std::move(block));
+            large_bytes_ += capa;
+            return ptr;
+        }
+
+        const uint64_t class_id = get_class_id_(capa);
+        if (uint8_t* ptr = free_heads_[class_id]; ptr != nullptr) {
+            std::memcpy(&free_heads_[class_id], ptr, sizeof(uint8_t*));
+            return ptr;
+        }
+
+        if (page_rest_ < capa) {
+            pages_.emplace_back(std::make_unique<uint8_t[]>(PageBytes));
+            page_ptr_ = pages_.back().get();
+            page_rest_ = PageBytes;
+        }
+
+        uint8_t* ptr = page_ptr_;
+        page_ptr_ += capa;
+        page_rest_ -= capa;
+        return ptr;
+    }
+
+    // Releases the block allocated for the given bytes.
+    void deallocate(uint8_t* ptr, uint64_t bytes) {
+        const uint64_t capa = capacity(bytes);
+
+        if (max_class_bytes < capa) {
+            large_bytes_ -= capa;
+            large_blocks_.erase(ptr);
+            return;
+        }
+
+        const uint64_t class_id = get_class_id_(capa);
+        std::memcpy(ptr, &free_heads_[class_id], sizeof(uint8_t*));
+        free_heads_[class_id] = ptr;
+    }
+
+    // Takes over the memory of rhs. The blocks allocated by rhs can be released through this.
+    void merge(this_type&& rhs) {
+        for (auto& page : rhs.pages_) {
+            pages_.emplace_back(std::move(page));
+        }
+        for (auto& kv : rhs.large_blocks_) {
+            large_blocks_.emplace(kv.first, std::move(kv.second));
+        }
+        large_bytes_ += rhs.large_bytes_;
+
+        for (uint64_t class_id = 0; class_id < num_classes; ++class_id) {
+            for (uint8_t* ptr = rhs.free_heads_[class_id]; ptr != nullptr;) {
+                uint8_t* next = nullptr;
+                std::memcpy(&next, ptr, sizeof(uint8_t*));
+                std::memcpy(ptr, &free_heads_[class_id], sizeof(uint8_t*));
+                free_heads_[class_id] = ptr;
+                ptr = next;
+            }
+        }
+
+        rhs = this_type{};
+    }
+
+    uint64_t num_pages() const {
+        return pages_.size();
+    }
+    uint64_t alloc_bytes() const {
+        uint64_t bytes = 0;
+        bytes += pages_.capacity() * sizeof(std::unique_ptr<uint8_t[]>);
+        bytes += pages_.size() * PageBytes;
+        bytes += large_bytes_;
+        return bytes;
+    }
+
+    void show_stats(std::ostream& os, int n = 0) const {
+        auto indent = get_indent(n);
+        show_stat(os, indent, "name", "slab_allocator");
+        show_stat(os, indent, "page_bytes", PageBytes);
+        show_stat(os, indent, "class_bits", ClassBits);
+        show_stat(os, indent, "num_pages", num_pages());
+        show_stat(os, indent, "num_large_blocks", large_blocks_.size());
+        show_stat(os, indent, "alloc_bytes", alloc_bytes());
+    }
+
+    slab_allocator(const slab_allocator&) = delete;
+    slab_allocator& operator=(const slab_allocator&) = delete;
+
+    slab_allocator(slab_allocator&&) noexcept = default;
+    slab_allocator& operator=(slab_allocator&&) noexcept = default;
+
+  private:
+    // Classes up to small_bytes are multiples of 8
+    static constexpr uint64_t small_bytes = 8ULL << ClassBits;
+    static constexpr uint64_t num_classes =
+        (1ULL << ClassBits) * (bit_tools::msb(max_class_bytes - 1) - (ClassBits + 3) + 2);
+
+    std::vector<std::unique_ptr<uint8_t[]>> pages_;
+    uint8_t* page_ptr_ = nullptr;
+    uint64_t page_rest_ = 0;
+    std::array<uint8_t*, num_classes> free_heads_ = {};
+    std::unordered_map<const uint8_t*, std::unique_ptr<uint8_t[]>> large_blocks_;
+    uint64_t large_bytes_ = 0;
+
+    static uint64_t get_class_id_(uint64_t capa) {
+        assert(capa == capacity(capa) and capa <= max_class_bytes);
+        if (capa <= small_bytes) {
+            return capa / 8 - 1;
+        }
+        const uint32_t b = bit_tools::msb(capa - 1);
+        const uint64_t step = 1ULL << (b - ClassBits);
+        return (1ULL << ClassBits) * (b - (ClassBits + 3) + 1) + ((capa - (1ULL << b)) / step - 1);
+    }
+};
+
+}  // namespace poplar
+
+#endif  // POPLAR_TRIE_SLAB_ALLOCATOR_HPP
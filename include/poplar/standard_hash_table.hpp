@@ -26,6 +26,7 @@
 
 #include "exception.hpp"
 #include "hash.hpp"
+#include "io_tools.hpp"
 
 namespace poplar {
 
@@ -103,6 +104,39 @@ class standard_hash_table {
         return table_.capacity() * sizeof(slot_type);
     }
 
+    void save(std::ostream& os) const {
+        io_tools::save_value(os, capa_size_.bits());
+        io_tools::save_value(os, size_);
+        io_tools::save_vector(os, table_);
+    }
+    void load(std::istream& is) {
+        const uint64_t capa_bits = io_tools::load_value(is);
+        const uint64_t size = io_tools::load_value(is);
+        *this = this_type{};
+        io_tools::load_vector(is, table_);
+        if (!table_.empty()) {
+            POPLAR_THROW_IF(table_.size() != 1ULL << capa_bits, "The serialized data is broken.");
+            capa_size_ = size_p2(static_cast<uint32_t>(capa_bits));
+            max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+            size_ = size;
+        }
+    }
+    // The table is copied since it is tiny as an auxiliary table.
+    void load_view(io_tools::mapper& mapper) {
+        const uint64_t capa_bits = mapper.map_value();
+        const uint64_t size = mapper.map_value();
+        const uint64_t num_slots = mapper.map_value();
+        const slot_type* slots = mapper.map_array<slot_type>(num_slots);
+        *this = this_type{};
+        if (num_slots != 0) {
+            POPLAR_THROW_IF(num_slots != 1ULL << capa_bits, "The serialized data is broken.");
+            table_.assign(slots, slots + num_slots);
+            capa_size_ = size_p2(static_cast<uint32_t>(capa_bits));
+            max_size_ = static_cast<uint64_t>(capa_size_.size() * MaxFactor / 100.0);
+            size_ = size;
+        }
+    }
+
     void show_stats(std::ostream& os, int n = 0) const {
         auto indent = get_indent(n);
         show_stat(os, indent, "name", "standard_hash_table");
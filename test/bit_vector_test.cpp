@@ -57,4 +57,34 @@ TEST(bit_vector_test, Tiny) {
     }
 }
 
+TEST(bit_tools_test, Dispatched) {
+    std::mt19937_64 engine{13};
+
+    for (uint64_t n = 0; n < N; ++n) {
+        const uint64_t x = engine() & engine();  // sparser
+        uint64_t num = 0;
+        for (uint64_t i = 0; i < 64; ++i) {
+            if (bit_tools::get_bit(x, i)) {
+                ASSERT_EQ(num, bit_tools::popcnt(x, i));
+                ASSERT_EQ(i, bit_tools::select(x, ++num));
+            }
+        }
+        ASSERT_EQ(num, bit_tools::popcnt(x));
+        ASSERT_EQ(num, bit_tools::popcnt(static_cast<uint32_t>(x)) + bit_tools::popcnt(static_cast<uint32_t>(x >> 32)));
+    }
+
+    std::vector<uint8_t> x(200), y(200);
+    for (uint64_t i = 0; i < x.size(); ++i) {
+        x[i] = y[i] = static_cast<uint8_t>(engine());
+    }
+    for (uint64_t n = 0; n <= x.size(); ++n) {
+        ASSERT_EQ(n, find_mismatch(x.data(), y.data(), n));
+        for (uint64_t i = 0; i < n; ++i) {
+            y[i] ^= 1;
+            ASSERT_EQ(i, find_mismatch(x.data(), y.data(), n));
+            y[i] ^= 1;
+        }
+    }
+}
+
 }  // namespace
\ No newline at end of file
@@ -0,0 +1,105 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+#include <sstream>
+
+#include <poplar/block_dsp_table.hpp>
+
+namespace {
+
+using namespace poplar;
+
+template <class Table>
+void test_table(uint32_t univ_bits, uint64_t size) {
+    std::mt19937_64 engine{13};
+
+    std::map<uint64_t, uint64_t> orig;
+    Table table{univ_bits};
+
+    const uint64_t univ_mask = (1ULL << univ_bits) - 1;
+    while (orig.size() < size) {
+        const uint64_t key = engine() & univ_mask;
+        const uint64_t val = engine() % Table::val_mask;
+        ASSERT_EQ(orig.find(key) == orig.end(), table.set(key, val));
+        orig[key] = val;
+    }
+    ASSERT_EQ(orig.size(), table.size());
+    if (Table::area_size < Table::block_bits) {
+        ASSERT_LT(0, table.spill_size());  // the areas overflow in dense blocks
+    }
+
+    for (uint64_t key = 0; key <= univ_mask; ++key) {
+        auto it = orig.find(key);
+        ASSERT_EQ(it == orig.end() ? Table::nil : it->second, table.get(key));
+    }
+
+    std::stringstream ss;
+    table.save(ss);
+    const std::string bytes = ss.str();
+
+    Table loaded;
+    loaded.load(ss);
+
+    std::vector<uint64_t> words(bytes.size() / sizeof(uint64_t));
+    std::memcpy(words.data(), bytes.data(), bytes.size());
+    io_tools::mapper mapper(words.data(), bytes.size());
+    Table view;
+    view.load_view(mapper);
+    ASSERT_TRUE(view.is_view());
+
+    for (uint64_t key = 0; key <= univ_mask; ++key) {
+        auto it = orig.find(key);
+        ASSERT_EQ(it == orig.end() ? Table::nil : it->second, loaded.get(key));
+        ASSERT_EQ(it == orig.end() ? Table::nil : it->second, view.get(key));
+    }
+}
+
+TEST(block_dsp_table_test, Tiny) {
+    test_table<block_dsp_table<>>(14, 1ULL << 13);
+    test_table<block_dsp_table<7, 2>>(14, 1ULL << 12);
+    test_table<block_dsp_table<4, 2>>(14, 1ULL << 12);
+    test_table<block_dsp_table<16, 4>>(14, 1ULL << 12);
+    test_table<block_dsp_table<7, 8>>(14, 1ULL << 13);
+}
+
+TEST(block_dsp_table_test, Update) {
+    std::mt19937_64 engine{13};
+
+    block_dsp_table<> table{10};
+    std::vector<uint64_t> orig(1ULL << 10, block_dsp_table<>::nil);
+
+    for (uint64_t n = 0; n < 10000; ++n) {
+        const uint64_t key = engine() % orig.size();
+        const uint64_t val = engine() % block_dsp_table<>::val_mask;
+        table.set(key, val);
+        orig[key] = val;
+    }
+    for (uint64_t key = 0; key < orig.size(); ++key) {
+        ASSERT_EQ(orig[key], table.get(key));
+    }
+}
+
+}  // namespace
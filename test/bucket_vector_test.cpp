@@ -0,0 +1,102 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+
+#include <poplar/bucket_vector.hpp>
+
+namespace {
+
+using namespace poplar;
+
+constexpr uint64_t N = 1000;
+
+TEST(bucket_vector_test, Access) {
+    std::mt19937_64 engine{13};
+
+    for (uint32_t width0 : {1, 7, 25, 63}) {
+        for (uint32_t width1 : {1, 16, 33, 63}) {
+            const uint64_t mask0 = (1ULL << width0) - 1;
+            const uint64_t mask1 = (1ULL << width1) - 1;
+
+            bucket_vector<2> vec(N, {width0, width1});
+            ASSERT_EQ(512 / (width0 + width1), vec.bucket_size());
+
+            vec.fill(1, mask1);
+            for (uint64_t i = 0; i < N; ++i) {
+                ASSERT_EQ(0, vec.get(i, 0));
+                ASSERT_EQ(mask1, vec.get(i, 1));
+            }
+
+            std::vector<std::pair<uint64_t, uint64_t>> orig(N);
+            for (uint64_t i = 0; i < N; ++i) {
+                orig[i] = {engine() & mask0, engine() & mask1};
+                vec.set(i, 0, orig[i].first);
+                vec.set(i, 1, orig[i].second);
+            }
+            for (uint64_t i = 0; i < N; ++i) {
+                ASSERT_EQ(orig[i].first, vec.get(i, 0));
+                ASSERT_EQ(orig[i].second, vec.get(i, 1));
+            }
+
+            // Filling a field must keep the other one.
+            vec.fill(0, mask0 >> 1);
+            for (uint64_t i = 0; i < N; ++i) {
+                ASSERT_EQ(mask0 >> 1, vec.get(i, 0));
+                ASSERT_EQ(orig[i].second, vec.get(i, 1));
+                vec.set(i, 0, orig[i].first);
+            }
+            vec.fill(1, mask1 >> 1);
+            for (uint64_t i = 0; i < N; ++i) {
+                ASSERT_EQ(orig[i].first, vec.get(i, 0));
+                ASSERT_EQ(mask1 >> 1, vec.get(i, 1));
+                vec.set(i, 1, orig[i].second);
+            }
+
+            std::stringstream ss;
+            vec.save(ss);
+            const std::string bytes = ss.str();
+
+            bucket_vector<2> loaded;
+            loaded.load(ss);
+
+            std::vector<uint64_t> words(bytes.size() / sizeof(uint64_t));
+            std::memcpy(words.data(), bytes.data(), bytes.size());
+            io_tools::mapper mapper(words.data(), bytes.size());
+            bucket_vector<2> view;
+            view.load_view(mapper);
+            ASSERT_TRUE(view.is_view());
+
+            for (uint64_t i = 0; i < N; ++i) {
+                ASSERT_EQ(orig[i].first, loaded.get(i, 0));
+                ASSERT_EQ(orig[i].second, loaded.get(i, 1));
+                ASSERT_EQ(orig[i].first, view.get(i, 0));
+                ASSERT_EQ(orig[i].second, view.get(i, 1));
+            }
+        }
+    }
+}
+
+}  // namespace
@@ -0,0 +1,96 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+
+#include <poplar/compact_vector.hpp>
+
+namespace {
+
+using namespace poplar;
+
+constexpr uint64_t N = 1000;
+
+TEST(compact_vector_test, Access) {
+    std::mt19937_64 engine{13};
+
+    for (uint32_t width = 1; width < 64; ++width) {
+        const uint64_t mask = (1ULL << width) - 1;
+
+        std::vector<uint64_t> orig(N);
+        compact_vector vec(N, width);
+        for (uint64_t i = 0; i < N; ++i) {
+            orig[i] = engine() & mask;
+            vec.set(i, orig[i]);
+        }
+
+        for (uint64_t i = 0; i < N; ++i) {
+            ASSERT_EQ(orig[i], vec[i]);
+        }
+
+        uint64_t i = 0;
+        for (uint64_t v : vec) {
+            ASSERT_EQ(orig[i++], v);
+        }
+        ASSERT_EQ(N, i);
+
+        std::vector<uint64_t> range(N);
+        for (uint64_t j = 0; j < N; j += 97) {
+            const uint64_t n = std::min<uint64_t>(N - j, 200);
+            vec.get_range(j, n, range.data());
+            for (uint64_t k = 0; k < n; ++k) {
+                ASSERT_EQ(orig[j + k], range[k]);
+            }
+        }
+    }
+}
+
+TEST(compact_vector_test, Fill) {
+    for (uint32_t width = 1; width < 64; ++width) {
+        const uint64_t mask = (1ULL << width) - 1;
+
+        for (uint64_t size : std::vector<uint64_t>{0, 1, 63, 64, 65, 1000}) {
+            for (uint64_t v : std::vector<uint64_t>{0, mask, 0x5555555555555555ULL & mask, mask >> 1}) {
+                compact_vector expected(size, width);
+                for (uint64_t i = 0; i < size; ++i) {
+                    expected.set(i, v);
+                }
+
+                compact_vector vec(size, width, v);
+                for (uint64_t i = 0; i < size; ++i) {
+                    ASSERT_EQ(v, vec[i]);
+                }
+
+                // The unused bits are cleared as set() leaves them.
+                std::ostringstream oss1, oss2;
+                expected.save(oss1);
+                vec.save(oss2);
+                ASSERT_EQ(oss1.str(), oss2.str());
+            }
+        }
+    }
+}
+
+}  // namespace
@@ -70,7 +70,7 @@ void insert_keys(Trie& ht, const std::vector<std::string>& keys, std::vector<uin
                     ids = std::move(new_ids);
                 } else {
                     if (ids.size() < ht.capa_size()) {
-                        ids.resize(ht.capa_size());
+                        ids.resize(ht.capa_size(), UINT64_MAX);
                     }
                 }
             }
@@ -101,7 +101,7 @@ template <typename Trie>
 void restore_keys(const Trie& ht, const std::vector<std::string>& keys, const std::vector<uint64_t>& ids) {
     ASSERT_FALSE(keys.empty());
 
-    if constexpr (Trie::trie_type_id == trie_type_ids::BONSAI_TRIE) {
+    if constexpr (Trie::reversible) {
         std::string restore;
 
         for (uint64_t i = 0; i < ids.size(); ++i) {
@@ -129,7 +129,19 @@ template <typename>
 class hash_trie_test : public ::testing::Test {};
 
 using hash_trie_types =
-    ::testing::Types<plain_fkhash_trie<>, plain_bonsai_trie<>, compact_fkhash_trie<>, compact_bonsai_trie<>>;
+    ::testing::Types<plain_fkhash_trie<>, plain_bonsai_trie<>, compact_fkhash_trie<>, compact_bonsai_trie<>,
+                     plain_fkhash_trie<90, hash::vigna_hasher, true>,
+                     compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                         bijective_hash::split_mix_hasher, true>,
+                     plain_fkhash_trie<90, hash::vigna_hasher, true, true>,
+                     compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                         bijective_hash::split_mix_hasher, false, true>,
+                     compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                         bijective_hash::split_mix_hasher, true, true>,
+                     plain_fkhash_trie<90, hash::vigna_hasher, false, true, true>,
+                     compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                         bijective_hash::split_mix_hasher, true, true, true>,
+                     compact_bonsai_trie<95, 2, block_dsp_table<>>, compact_fkhash_trie<95, 2, block_dsp_table<>>>;
 
 TYPED_TEST_CASE(hash_trie_test, hash_trie_types);
 
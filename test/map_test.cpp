@@ -21,6 +21,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#include <atomic>
+#include <thread>
+
 #include <gtest/gtest.h>
 #include <poplar.hpp>
 
@@ -48,6 +51,29 @@ void insert_keys(Map& map, const std::vector<std::string>& keys) {
     ASSERT_EQ(map.size(), num_keys);
 }
 
+template <typename Map>
+void insert_keys_batch(Map& map, const std::vector<std::string>& keys) {
+    ASSERT_FALSE(keys.empty());
+
+    std::vector<char_range> ranges;
+    for (uint64_t i = 0; i < keys.size(); i += 2) {
+        ranges.push_back(make_char_range(keys[i]));
+    }
+
+    std::vector<value_type*> ptrs(ranges.size());
+    map.update_batch(ranges.data(), ranges.size(), ptrs.data());
+
+    for (uint64_t i = 0; i < ranges.size(); ++i) {
+        ASSERT_NE(ptrs[i], nullptr);
+        if (*ptrs[i] == 0) {
+            *ptrs[i] = i * 2;
+        }
+        ASSERT_EQ(*ptrs[i], i * 2);  // already registered keys keep their values
+    }
+
+    ASSERT_EQ(map.size(), ranges.size());
+}
+
 template <typename Map>
 void search_keys(Map& map, const std::vector<std::string>& keys) {
     ASSERT_FALSE(keys.empty());
@@ -70,11 +96,53 @@ void search_keys(Map& map, const std::vector<std::string>& keys) {
     }
 }
 
+template <typename Map>
+void search_keys_batch(Map& map, const std::vector<std::string>& keys) {
+    ASSERT_FALSE(keys.empty());
+
+    std::vector<char_range> ranges(keys.size());
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        ranges[i] = make_char_range(keys[i]);
+    }
+
+    std::vector<const value_type*> ptrs(keys.size());
+    map.find_batch(ranges.data(), ranges.size(), ptrs.data());
+
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(ptrs[i], map.find(ranges[i]));
+    }
+}
+
 // clang-format off
 using map_types = ::testing::Types<plain_bonsai_map<value_type>,
                                    compact_bonsai_map<value_type>,
                                    plain_fkhash_map<value_type>,
-                                   compact_fkhash_map<value_type>
+                                   compact_fkhash_map<value_type>,
+                                   map<plain_fkhash_trie<90, hash::vigna_hasher, true>, plain_fkhash_nlm<value_type>>,
+                                   map<compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                                           bijective_hash::split_mix_hasher, true>,
+                                       compact_fkhash_nlm<value_type>>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type, 16, slab_allocator<1024, 1>>>,
+                                   map<plain_bonsai_trie<>, plain_bonsai_nlm<value_type, 32>>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type, 32, slab_allocator<>, true>>,
+                                   map<compact_fkhash_trie<>, compact_fkhash_nlm<value_type, 64, true>>,
+                                   map<plain_fkhash_trie<90, hash::vigna_hasher, true, true>, plain_fkhash_nlm<value_type>>,
+                                   map<compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                                           bijective_hash::split_mix_hasher, true, true>,
+                                       compact_fkhash_nlm<value_type>>,
+                                   map<plain_bonsai_trie<>, plain_bonsai_nlm<value_type>, true>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type>, true>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type, 32, slab_allocator<>, true>, true>,
+                                   map<plain_fkhash_trie<90, hash::vigna_hasher, true, true>, plain_fkhash_nlm<value_type>, true>,
+                                   map<compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                                           bijective_hash::split_mix_hasher, true, true>,
+                                       compact_fkhash_nlm<value_type>, true>,
+                                   map<plain_fkhash_trie<90, hash::vigna_hasher, false, false, true>, plain_fkhash_nlm<value_type>>,
+                                   map<compact_fkhash_trie<90, 4, compact_hash_table<7>, standard_hash_table<>,
+                                                           bijective_hash::split_mix_hasher, true, true, true>,
+                                       compact_fkhash_nlm<value_type>, true>,
+                                   map<compact_bonsai_trie<95, 2, block_dsp_table<>>, compact_bonsai_nlm<value_type>, true>,
+                                   map<compact_fkhash_trie<95, 2, block_dsp_table<4, 4>>, compact_fkhash_nlm<value_type>>
                                    >;
 // clang-format on
 
@@ -97,4 +165,866 @@ TYPED_TEST(map_test, Words) {
     search_keys(map, keys);
 }
 
+TYPED_TEST(map_test, LongKeys) {
+    // Labels longer than a page of the arenas
+    TypeParam map;
+    std::vector<std::string> keys;
+    for (uint64_t i = 0; i < 16; ++i) {
+        keys.push_back(std::string(i % 2 == 0 ? 100000 : 10, 'a' + (i % 4)) + std::to_string(i));
+    }
+    insert_keys(map, keys);
+    search_keys(map, keys);
+}
+
+TYPED_TEST(map_test, SaveLoad) {
+    TypeParam map;
+    auto keys = load_keys("words.txt");
+    insert_keys(map, keys);
+
+    std::stringstream ss;
+    map.save(ss);
+
+    TypeParam other;
+    other.load(ss);
+    ASSERT_EQ(map.size(), other.size());
+    search_keys(other, keys);
+
+    // The loaded map is updatable
+    for (uint64_t i = 1; i < keys.size(); i += 2) {
+        auto ptr = other.update(make_char_range(keys[i]));
+        ASSERT_EQ(*ptr, 0);
+        *ptr = i;
+    }
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        auto ptr = other.find(make_char_range(keys[i]));
+        ASSERT_NE(ptr, nullptr);
+        ASSERT_EQ(*ptr, i);
+    }
+
+    // A file of another format version is rejected
+    std::string bytes = ss.str();
+    const uint64_t old_version = io_tools::format_version - 1;
+    std::memcpy(&bytes[sizeof(uint64_t)], &old_version, sizeof(old_version));
+    {
+        std::stringstream old_ss{bytes};
+        TypeParam old_map;
+        ASSERT_THROW(old_map.load(old_ss), exception);
+    }
+    {
+        std::vector<uint64_t> words(bytes.size() / sizeof(uint64_t));
+        std::memcpy(words.data(), bytes.data(), bytes.size());
+        io_tools::mapper mapper(words.data(), bytes.size());
+        TypeParam old_map;
+        ASSERT_THROW(old_map.load_view(mapper), exception);
+    }
+}
+
+TYPED_TEST(map_test, BuildFromSorted) {
+    auto keys = load_keys("words.txt");
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<std::pair<std::string, value_type>> pairs;
+    for (uint64_t i = 0; i < keys.size(); i += 2) {
+        pairs.emplace_back(keys[i], i);
+    }
+
+    for (uint64_t lambda : {32, 2}) {
+        TypeParam map{0, lambda};
+        map.build_from_sorted(pairs.begin(), pairs.end());
+        ASSERT_EQ(map.size(), pairs.size());
+        search_keys(map, keys);
+
+        // The layout is deterministic and sized just once.
+        TypeParam other{0, lambda};
+        other.build_from_sorted(pairs.begin(), pairs.end());
+        std::stringstream ss1, ss2;
+        map.save(ss1);
+        other.save(ss2);
+        ASSERT_EQ(ss1.str(), ss2.str());
+
+        TypeParam updated{0, lambda};
+        insert_keys(updated, keys);
+        ASSERT_LE(map.capa_size(), updated.capa_size());
+
+        // The built map is updatable
+        for (uint64_t i = 1; i < keys.size(); i += 2) {
+            auto ptr = map.update(make_char_range(keys[i]));
+            ASSERT_EQ(*ptr, 0);
+            *ptr = i;
+        }
+        ASSERT_EQ(map.size(), keys.size());
+    }
+
+    {
+        TypeParam map;
+        std::vector<std::pair<std::string, value_type>> unsorted = {{"b", 1}, {"a", 2}};
+        ASSERT_THROW(map.build_from_sorted(unsorted.begin(), unsorted.end()), poplar::exception);
+        std::vector<std::pair<std::string, value_type>> duplicated = {{"a", 1}, {"a", 2}};
+        ASSERT_THROW(map.build_from_sorted(duplicated.begin(), duplicated.end()), poplar::exception);
+        ASSERT_EQ(map.size(), 0);
+
+        std::vector<std::pair<const char*, value_type>> prefixes = {{"", 1}, {"a", 2}, {"ab", 3}, {"abc", 4}};
+        map.build_from_sorted(prefixes.begin(), prefixes.end());
+        for (const auto& [key, value] : prefixes) {
+            ASSERT_EQ(*map.find(make_char_range(key)), value);
+        }
+        ASSERT_THROW(map.build_from_sorted(prefixes.begin(), prefixes.end()), poplar::exception);
+    }
+}
+
+TYPED_TEST(map_test, StringView) {
+    using namespace std::string_literals;
+
+    // Keys are slices of a buffer without terminators, and may contain '\0'.
+    const std::string buffer = "abc\0abd\0\0xyz"s;
+    const std::vector<std::string_view> keys = {
+        std::string_view(buffer).substr(0, 2),  "ab",  std::string_view(buffer).substr(0, 3),
+        std::string_view(buffer).substr(0, 4),  std::string_view(buffer).substr(0, 8),
+        std::string_view(buffer).substr(8, 1),  std::string_view(buffer).substr(8, 2),
+        std::string_view(buffer).substr(3),     "",
+    };
+    // Distinct keys are keys[0], keys[2..8] since keys[1] equals keys[0].
+    const std::vector<uint64_t> ids = {0, 0, 2, 3, 4, 5, 6, 7, 8};
+
+    for (uint64_t lambda : {32, 2}) {
+        TypeParam map{0, lambda};
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            if (i == ids[i]) {
+                ASSERT_EQ(map.find(keys[i]), nullptr);
+            }
+            *map.update(keys[i]) = ids[i] + 1;
+        }
+        ASSERT_EQ(map.size(), keys.size() - 1);
+
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*map.find(keys[i]), ids[i] + 1);
+            ASSERT_EQ(*map.find(make_char_range(keys[i])), ids[i] + 1);
+        }
+        ASSERT_EQ(map.find("abc\0a"s), nullptr);
+        ASSERT_EQ(map.find("\0\0\0"s), nullptr);
+        ASSERT_EQ(map.find("a"), nullptr);
+
+        std::vector<char_range> ranges;
+        for (const auto& key : keys) {
+            ranges.push_back(make_char_range(key));
+        }
+        std::vector<const value_type*> vptrs(ranges.size());
+        map.find_batch(ranges.data(), ranges.size(), vptrs.data());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*vptrs[i], ids[i] + 1);
+        }
+
+        TypeParam batch_map{0, lambda};
+        std::vector<value_type*> ptrs(ranges.size());
+        batch_map.update_batch(ranges.data(), ranges.size(), ptrs.data());
+        ASSERT_EQ(batch_map.size(), keys.size() - 1);
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(ptrs[i], batch_map.find(keys[i]));
+        }
+
+        std::vector<std::pair<std::string, value_type>> expected;
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            if (i == ids[i]) {
+                expected.emplace_back(keys[i], ids[i] + 1);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        TypeParam sorted_map{0, lambda};
+        sorted_map.build_from_sorted(expected.begin(), expected.end());
+        for (const auto& [key, value] : expected) {
+            ASSERT_EQ(*sorted_map.find(key), value);
+        }
+
+        if constexpr (TypeParam::trie_type::reversible) {
+            std::vector<std::pair<std::string, value_type>> entries;
+            for (auto [key, vptr] : map) {
+                entries.emplace_back(std::string(key), *vptr);
+            }
+            std::sort(entries.begin(), entries.end());
+            ASSERT_EQ(entries, expected);
+        }
+
+        if constexpr (TypeParam::has_child_index and TypeParam::trie_type::reversible) {
+            std::vector<std::pair<std::string, value_type>> entries;
+            map.predictive_search("abc\0"s, [&](std::string_view key, const value_type* vptr) {
+                entries.emplace_back(std::string(key), *vptr);
+            });
+            std::sort(entries.begin(), entries.end());
+            ASSERT_EQ(entries, (std::vector<std::pair<std::string, value_type>>{{"abc\0"s, 4}, {"abc\0abd\0"s, 5}}));
+        }
+
+        std::vector<std::string> prefixes;
+        map.common_prefix_search("abc\0abd\0\0"s, [&](std::string_view key, const value_type*) {
+            prefixes.emplace_back(key);
+        });
+        ASSERT_EQ(prefixes, (std::vector<std::string>{""s, "ab"s, "abc"s, "abc\0"s, "abc\0abd\0"s}));
+
+        if constexpr (TypeParam::erasable) {
+            ASSERT_TRUE(map.erase(keys[3]));
+            ASSERT_FALSE(map.erase(keys[3]));
+            ASSERT_EQ(map.find(keys[3]), nullptr);
+            ASSERT_EQ(*map.find(keys[4]), 5);
+            ASSERT_TRUE(map.erase(keys[8]));
+            ASSERT_EQ(map.find(""), nullptr);
+            ASSERT_EQ(map.size(), keys.size() - 3);
+        }
+    }
+}
+
+TYPED_TEST(map_test, FrozenMap) {
+    const char* filepath = "map_test.frozen.idx";
+    auto keys = load_keys("words.txt");
+    {
+        TypeParam map;
+        insert_keys(map, keys);
+        std::ofstream ofs(filepath, std::ios::binary);
+        map.save(ofs);
+    }
+
+    frozen_map<TypeParam> fmap(filepath);
+    ASSERT_EQ(fmap.size(), (keys.size() + 1) / 2);
+
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        auto ptr = fmap.find(make_char_range(keys[i]));
+        if (i % 2 == 0) {
+            ASSERT_NE(ptr, nullptr);
+            ASSERT_EQ(*ptr, i);
+        } else {
+            ASSERT_EQ(ptr, nullptr);
+        }
+    }
+
+    if constexpr (TypeParam::trie_type::reversible) {
+        uint64_t num_keys = 0;
+        for (auto [key, vptr] : fmap) {
+            ASSERT_EQ(keys[*vptr], key);
+            ++num_keys;
+        }
+        ASSERT_EQ(num_keys, fmap.size());
+    }
+
+    if constexpr (TypeParam::has_child_index and TypeParam::trie_type::reversible) {
+        uint64_t num_keys = 0;
+        fmap.predictive_search("", [&](std::string_view key, const value_type* vptr) {
+            ASSERT_EQ(keys[*vptr], key);
+            ++num_keys;
+        });
+        ASSERT_EQ(num_keys, fmap.size());
+    }
+
+    std::remove(filepath);
+}
+
+TYPED_TEST(map_test, Enumerate) {
+    if constexpr (TypeParam::trie_type::reversible) {
+        TypeParam map;
+        ASSERT_TRUE(map.begin() == map.end());
+
+        auto keys = load_keys("words.txt");
+        insert_keys(map, keys);
+
+        std::vector<std::pair<std::string, value_type>> expected;
+        for (uint64_t i = 0; i < keys.size(); i += 2) {
+            expected.emplace_back(keys[i], i);
+        }
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<std::pair<std::string, value_type>> entries;
+        for (auto [key, vptr] : map) {
+            entries.emplace_back(std::string(key), *vptr);
+        }
+        std::sort(entries.begin(), entries.end());
+        ASSERT_EQ(entries, expected);
+
+        entries.clear();
+        for (auto [it, end] : map.split_ranges(7)) {
+            for (; it != end; ++it) {
+                entries.emplace_back(std::string((*it).key), *(*it).vptr);
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        ASSERT_EQ(entries, expected);
+
+        // Keys sharing long prefixes go through step nodes
+        TypeParam long_map;
+        std::vector<std::string> long_keys;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            long_keys.push_back(std::string(10 + i % 200, 'x') + std::to_string(i));
+            *long_map.update(long_keys.back()) = i;
+        }
+        std::sort(long_keys.begin(), long_keys.end());
+
+        std::vector<std::string> long_entries;
+        for (auto [key, vptr] : long_map) {
+            ASSERT_EQ(*long_map.find(std::string(key)), *vptr);
+            long_entries.emplace_back(key);
+        }
+        std::sort(long_entries.begin(), long_entries.end());
+        ASSERT_EQ(long_entries, long_keys);
+    }
+}
+
+template <typename Map>
+void test_predictive_search(const Map& map, const std::vector<std::string>& keys, const std::string& prefix) {
+    std::vector<std::string> expected;
+    for (const auto& key : keys) {
+        if (key.compare(0, prefix.size(), prefix) == 0) {
+            expected.push_back(key);
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<std::string> results;
+    map.predictive_search(prefix, [&](std::string_view key, const value_type* vptr) {
+        ASSERT_EQ(map.find(std::string(key)), vptr);
+        results.emplace_back(key);
+    });
+    std::sort(results.begin(), results.end());
+    ASSERT_EQ(results, expected);
+}
+
+TYPED_TEST(map_test, PredictiveSearch) {
+    if constexpr (TypeParam::has_child_index and TypeParam::trie_type::reversible) {
+        TypeParam map;
+        test_predictive_search(map, {}, "");
+
+        auto keys = load_keys("words.txt");
+        insert_keys(map, keys);
+
+        std::vector<std::string> inserted;
+        for (uint64_t i = 0; i < keys.size(); i += 2) {
+            inserted.push_back(keys[i]);
+        }
+
+        test_predictive_search(map, inserted, "");
+        for (uint64_t i = 0; i < keys.size(); i += 97) {
+            for (uint64_t len = 1; len <= keys[i].size(); len += 2) {
+                test_predictive_search(map, inserted, keys[i].substr(0, len));
+            }
+        }
+        test_predictive_search(map, inserted, "\x7f\x7f");
+
+        // Keys sharing long prefixes go through step nodes
+        TypeParam long_map;
+        std::vector<std::string> long_keys;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            long_keys.push_back(std::string(10 + i % 200, 'x') + std::to_string(i));
+            *long_map.update(long_keys.back()) = i;
+        }
+        for (uint64_t len : {0, 1, 9, 10, 31, 32, 33, 64, 100, 150, 209, 210}) {
+            test_predictive_search(long_map, long_keys, std::string(len, 'x'));
+            test_predictive_search(long_map, long_keys, std::string(len, 'x') + "1");
+            test_predictive_search(long_map, long_keys, std::string(len, 'x') + "99");
+        }
+    }
+}
+
+template <typename Map>
+void test_common_prefix_search(const Map& map, const std::string& text) {
+    std::vector<std::pair<std::string, const value_type*>> expected;
+    for (uint64_t len = 0; len <= text.size(); ++len) {
+        auto vptr = map.find(text.substr(0, len));
+        if (vptr != nullptr) {
+            expected.emplace_back(text.substr(0, len), vptr);
+        }
+    }
+
+    std::vector<std::pair<std::string, const value_type*>> results;
+    map.common_prefix_search(text, [&](std::string_view key, const value_type* vptr) {
+        ASSERT_EQ(key.data(), text.data());
+        results.emplace_back(std::string(key), vptr);
+    });
+    ASSERT_EQ(results, expected);
+}
+
+TYPED_TEST(map_test, CommonPrefixSearch) {
+    TypeParam map;
+    test_common_prefix_search(map, "abc");
+
+    auto keys = load_keys("words.txt");
+    insert_keys(map, keys);
+
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        test_common_prefix_search(map, keys[i]);
+        test_common_prefix_search(map, keys[i] + keys[(i + 1) % keys.size()]);
+    }
+    test_common_prefix_search(map, "");
+
+    // Keys sharing long prefixes go through step nodes
+    TypeParam long_map;
+    for (uint64_t len = 1; len <= 300; len += (len < 70 ? 1 : 7)) {
+        *long_map.update(std::string(len, 'x')) = len;
+        *long_map.update(std::string(len, 'x') + "y") = len;
+    }
+    for (uint64_t len : {0, 1, 31, 32, 33, 64, 65, 200, 400}) {
+        test_common_prefix_search(long_map, std::string(len, 'x'));
+        test_common_prefix_search(long_map, std::string(len, 'x') + "yz");
+        test_common_prefix_search(long_map, std::string(len, 'x') + '\0' + "x");
+    }
+}
+
+TYPED_TEST(map_test, Erase) {
+    if constexpr (TypeParam::erasable) {
+        TypeParam map;
+        ASSERT_FALSE(map.erase("Hotaru"));
+
+        auto keys = load_keys("words.txt");
+        insert_keys(map, keys);
+        const uint64_t num_keys = map.size();
+
+        // Erases one third of the inserted keys, including the nodes having children
+        uint64_t num_erased = 0;
+        for (uint64_t i = 0; i < keys.size(); i += 6) {
+            ASSERT_TRUE(map.erase(keys[i]));
+            ASSERT_FALSE(map.erase(keys[i]));
+            ASSERT_FALSE(map.erase(keys[i + 1 < keys.size() ? i + 1 : i]));
+            ++num_erased;
+        }
+        ASSERT_EQ(map.size(), num_keys - num_erased);
+
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            auto ptr = map.find(keys[i]);
+            if (i % 2 == 0 and i % 6 != 0) {
+                ASSERT_NE(ptr, nullptr);
+                ASSERT_EQ(*ptr, i);
+            } else {
+                ASSERT_EQ(ptr, nullptr);
+            }
+        }
+
+        uint64_t num_found = 0;
+        for (auto [key, vptr] : map) {
+            ASSERT_EQ(keys[*vptr], key);
+            ++num_found;
+        }
+        ASSERT_EQ(num_found, map.size());
+
+        num_found = 0;
+        map.predictive_search("", [&](std::string_view key, const value_type* vptr) {
+            ASSERT_EQ(keys[*vptr], key);
+            ++num_found;
+        });
+        ASSERT_EQ(num_found, map.size());
+
+        // The erased keys and the others are inserted again
+        for (uint64_t i = 0; i < keys.size(); i += 3) {
+            auto ptr = map.update(keys[i]);
+            if (i % 2 == 0 and i % 6 != 0) {
+                ASSERT_EQ(*ptr, i);
+            } else {
+                ASSERT_EQ(*ptr, 0);
+                *ptr = i;
+            }
+        }
+
+        std::stringstream ss;
+        map.save(ss);
+        TypeParam other;
+        other.load(ss);
+        ASSERT_EQ(map.size(), other.size());
+
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            auto ptr = other.find(keys[i]);
+            if (i % 2 == 0 or i % 3 == 0) {
+                ASSERT_NE(ptr, nullptr);
+                ASSERT_EQ(*ptr, i);
+            } else {
+                ASSERT_EQ(ptr, nullptr);
+            }
+        }
+
+        // Erasing all the keys empties the map
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(other.erase(keys[i]), i % 2 == 0 or i % 3 == 0);
+        }
+        ASSERT_EQ(other.size(), 0);
+        ASSERT_TRUE(other.begin() == other.end());
+        *other.update(keys[0]) = 1;
+        ASSERT_EQ(*other.find(keys[0]), 1);
+    }
+}
+
+TYPED_TEST(map_test, EraseChurn) {
+    if constexpr (TypeParam::erasable) {
+        TypeParam map;
+        auto keys = load_keys("words.txt");
+        const uint64_t window = keys.size() / 8;
+
+        // Keys sharing long prefixes go through step nodes
+        for (uint64_t i = 0; i < 100; ++i) {
+            keys.push_back(std::string(10 + i, 'x') + std::to_string(i));
+        }
+
+        // Keeps the keys in a sliding window registered
+        uint64_t capa_size = 0;
+        for (uint64_t round = 0; round < 4; ++round) {
+            for (uint64_t i = 0; i < keys.size(); ++i) {
+                *map.update(keys[i]) = i;
+                if (window <= i) {
+                    ASSERT_TRUE(map.erase(keys[i - window]));
+                }
+            }
+            for (uint64_t i = keys.size() - window; i < keys.size(); ++i) {
+                ASSERT_TRUE(map.erase(keys[i]));
+            }
+            ASSERT_EQ(map.size(), 0);
+            if (round == 1) {
+                capa_size = map.capa_size();
+            }
+        }
+        // The capacity is stable under churn
+        ASSERT_EQ(map.capa_size(), capa_size);
+    }
+}
+
+TYPED_TEST(map_test, BackgroundExpansion) {
+    if constexpr (TypeParam::trie_type_id == trie_type_ids::BONSAI_TRIE) {
+        auto keys = load_keys("words.txt");
+
+        TypeParam map;
+        map.set_background_expansion(50);
+
+        uint64_t num_expanding = 0;
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            auto ptr = map.update(keys[i]);
+            ASSERT_EQ(*ptr, 0);
+            *ptr = i + 1;
+            if (map.is_expanding()) {
+                ++num_expanding;
+            }
+            // The keys inserted before and during the expansion are updated and found
+            ASSERT_EQ(*map.update(keys[i / 2]), i / 2 + 1);
+            ASSERT_EQ(*map.find(keys[i]), i + 1);
+        }
+        ASSERT_NE(num_expanding, 0);
+        ASSERT_EQ(map.size(), keys.size());
+
+        std::vector<char_range> ranges;
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ranges.push_back(make_char_range(keys[i]));
+        }
+        std::vector<const value_type*> ptrs(ranges.size());
+        map.find_batch(ranges.data(), ranges.size(), ptrs.data());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_NE(ptrs[i], nullptr);
+            ASSERT_EQ(*ptrs[i], i + 1);
+        }
+
+        if (map.is_expanding()) {
+            std::stringstream ss;
+            ASSERT_THROW(map.save(ss), poplar::exception);
+        }
+        map.wait_expansion();
+        ASSERT_FALSE(map.is_expanding());
+        ASSERT_EQ(map.size(), keys.size());
+
+        std::stringstream ss;
+        map.save(ss);
+        TypeParam other;
+        other.load(ss);
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*other.find(keys[i]), i + 1);
+        }
+
+        if constexpr (TypeParam::erasable) {
+            map.set_background_expansion(10);
+            for (uint64_t i = 0; i < keys.size(); i += 2) {
+                ASSERT_TRUE(map.erase(keys[i]));
+            }
+            ASSERT_EQ(map.size(), keys.size() / 2);
+            for (uint64_t i = 0; i < keys.size(); i += 2) {
+                *map.update(keys[i]) = i + 1;
+            }
+            map.wait_expansion();
+            ASSERT_EQ(map.size(), keys.size());
+            for (uint64_t i = 0; i < keys.size(); ++i) {
+                ASSERT_EQ(*map.find(keys[i]), i + 1);
+            }
+        }
+    }
+}
+
+TYPED_TEST(map_test, BackgroundExpansionReplay) {
+    if constexpr (TypeParam::trie_type_id == trie_type_ids::BONSAI_TRIE) {
+        std::vector<std::string> keys;
+        for (const std::string& word : load_keys("words.txt")) {
+            keys.push_back(word);
+            keys.push_back(word + '#');
+        }
+
+        TypeParam map;
+        map.set_background_expansion(50);
+
+        uint64_t max_buffered = 0, num_replaying = 0;
+        bool moved = false;
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            const uint64_t num_buffered = map.num_buffered();
+            *map.update(keys[i]) = i + 1;
+            max_buffered = std::max(max_buffered, map.num_buffered());
+
+            // No single update() replays more than replays_per_update keys
+            if (map.num_buffered() < num_buffered) {
+                ASSERT_LE(num_buffered - map.num_buffered(), TypeParam::replays_per_update);
+                ++num_replaying;
+            }
+
+            // A move keeps the buffered keys without replaying them
+            if (!moved and map.num_buffered() != 0) {
+                const uint64_t num_buffered = map.num_buffered();
+                TypeParam other = std::move(map);
+                ASSERT_EQ(other.num_buffered(), num_buffered);
+                map = std::move(other);
+                ASSERT_EQ(map.num_buffered(), num_buffered);
+                moved = true;
+            }
+        }
+        if (max_buffered > TypeParam::replays_per_update) {
+            ASSERT_LT(1, num_replaying);
+        }
+
+        ASSERT_EQ(map.size(), keys.size());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*map.find(keys[i]), i + 1);
+        }
+        map.wait_expansion();
+        ASSERT_EQ(map.num_buffered(), 0);
+        ASSERT_EQ(map.size(), keys.size());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*map.find(keys[i]), i + 1);
+        }
+    }
+}
+
+TYPED_TEST(map_test, BackgroundExpansionBatch) {
+    if constexpr (TypeParam::trie_type_id == trie_type_ids::BONSAI_TRIE) {
+        auto keys = load_keys("words.txt");
+
+        TypeParam map;
+        map.set_background_expansion(50);
+
+        // Each batch has new keys and the keys of the previous batch, which may be in the buffer or the map.
+        constexpr uint64_t batch_size = 64;
+        uint64_t num_expanding = 0;
+        for (uint64_t begin = 0; begin < keys.size(); begin += batch_size) {
+            const uint64_t end = std::min(begin + batch_size, keys.size());
+            std::vector<uint64_t> ids;
+            for (uint64_t i = begin; i < end; ++i) {
+                ids.push_back(i);
+                if (batch_size <= begin) {
+                    ids.push_back(i - batch_size);
+                }
+            }
+            std::vector<char_range> ranges;
+            for (uint64_t id : ids) {
+                ranges.push_back(make_char_range(keys[id]));
+            }
+            std::vector<value_type*> ptrs(ranges.size());
+            map.update_batch(ranges.data(), ranges.size(), ptrs.data());
+            if (map.is_expanding()) {
+                ++num_expanding;
+            }
+            for (uint64_t j = 0; j < ids.size(); ++j) {
+                ASSERT_NE(ptrs[j], nullptr);
+                ASSERT_EQ(*ptrs[j], ids[j] < begin ? ids[j] + 1 : 0);
+                *ptrs[j] = ids[j] + 1;
+            }
+        }
+        ASSERT_NE(num_expanding, 0);
+        ASSERT_EQ(map.size(), keys.size());
+
+        map.wait_expansion();
+        ASSERT_EQ(map.size(), keys.size());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*map.find(keys[i]), i + 1);
+        }
+    }
+}
+
+TYPED_TEST(map_test, ShardedMap) {
+    auto keys = load_keys("words.txt");
+
+    std::vector<char_range> ranges;
+    for (uint64_t i = 0; i < keys.size(); i += 2) {
+        ranges.push_back(make_char_range(keys[i]));
+    }
+
+    sharded_map<TypeParam, 8> smap;
+    smap.set_num_threads(4);
+    smap.update_batch(ranges.data(), ranges.size(), [&](uint64_t i, value_type& v) {
+        ASSERT_EQ(v, 0);
+        v = i * 2;
+    });
+    ASSERT_EQ(smap.size(), ranges.size());
+
+    // The odd keys are inserted from several threads at once
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (uint64_t i = 1 + t * 2; i < keys.size(); i += 8) {
+                smap.update(keys[i], [&](value_type& v) { v = i; });
+                ASSERT_EQ(*smap.find(keys[i]), i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(smap.size(), keys.size());
+
+    std::vector<char_range> queries;
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        queries.push_back(make_char_range(keys[i]));
+    }
+    queries.push_back(make_char_range("Hotaru"));
+
+    std::vector<std::optional<value_type>> values(queries.size());
+    smap.find_batch(queries.data(), queries.size(), values.data());
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        ASSERT_TRUE(values[i].has_value());
+        ASSERT_EQ(*values[i], i);
+    }
+    ASSERT_FALSE(values.back().has_value());
+
+    std::stringstream ss;
+    smap.save(ss);
+    sharded_map<TypeParam, 8> other;
+    other.load(ss);
+    ASSERT_EQ(other.size(), keys.size());
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(*other.find(keys[i]), i);
+    }
+
+    if constexpr (TypeParam::erasable) {
+        for (uint64_t i = 0; i < keys.size(); i += 2) {
+            ASSERT_TRUE(other.erase(keys[i]));
+        }
+        ASSERT_EQ(other.size(), keys.size() / 2);
+        ASSERT_FALSE(other.find(keys[0]).has_value());
+    }
+}
+
+TYPED_TEST(map_test, ShardedMapParallelBuild) {
+    auto keys = load_keys("words.txt");
+
+    std::vector<std::pair<std::string, value_type>> pairs;
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        pairs.emplace_back(keys[i], i);
+    }
+    auto sorted_pairs = pairs;
+    std::sort(sorted_pairs.begin(), sorted_pairs.end());
+
+    for (const auto& input : {pairs, sorted_pairs}) {
+        sharded_map<TypeParam, 8> smap;
+        smap.parallel_build(input.begin(), input.end(), 4);
+        ASSERT_EQ(smap.size(), keys.size());
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(*smap.find(keys[i]), i);
+        }
+        ASSERT_FALSE(smap.find("Hotaru").has_value());
+        ASSERT_THROW(smap.parallel_build(input.begin(), input.end(), 4), poplar::exception);
+    }
+}
+
+TYPED_TEST(map_test, LeftRightMap) {
+    auto keys = load_keys("words.txt");
+    left_right_map<TypeParam> lrmap;
+
+    // A key once found must keep its value while the writer goes on
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (uint64_t t = 0; t < 3; ++t) {
+        readers.emplace_back([&, t]() {
+            std::vector<bool> founds(keys.size());
+            while (!done.load()) {
+                for (uint64_t i = t; i < keys.size(); i += 97) {
+                    auto value = lrmap.find(keys[i]);
+                    if (value.has_value()) {
+                        ASSERT_EQ(*value, i + 1);
+                        founds[i] = true;
+                    } else {
+                        ASSERT_FALSE(founds[i]);
+                    }
+                }
+                std::this_thread::yield();
+            }
+        });
+    }
+
+    for (uint64_t i = 0; i < keys.size() / 2; ++i) {
+        lrmap.update(keys[i], i + 1);
+    }
+
+    std::vector<char_range> ranges;
+    std::vector<value_type> values;
+    for (uint64_t i = keys.size() / 2; i < keys.size(); ++i) {
+        ranges.push_back(make_char_range(keys[i]));
+        values.push_back(i + 1);
+    }
+    lrmap.update_batch(ranges.data(), ranges.size(), values.data());
+
+    done.store(true);
+    for (auto& t : readers) {
+        t.join();
+    }
+
+    ASSERT_EQ(lrmap.size(), keys.size());
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(*lrmap.find(keys[i]), i + 1);
+    }
+    ASSERT_EQ(lrmap.read([&](const TypeParam& map) { return map.size(); }), keys.size());
+
+    if constexpr (TypeParam::erasable) {
+        ASSERT_TRUE(lrmap.erase(keys[0]));
+        ASSERT_FALSE(lrmap.erase(keys[0]));
+        ASSERT_FALSE(lrmap.find(keys[0]).has_value());
+    }
+
+    std::stringstream ss;
+    lrmap.save(ss);
+    left_right_map<TypeParam> other;
+    other.load(ss);
+    ASSERT_EQ(other.size(), lrmap.size());
+    other.update(keys[0], 1);
+    ASSERT_EQ(*other.find(keys[0]), 1);
+
+    // Both copies are loaded from the stream, so a stream that cannot seek is rejected.
+    std::stringstream unseekable;
+    lrmap.save(unseekable);
+    unseekable.setstate(std::ios::failbit);
+    ASSERT_THROW(other.load(unseekable), poplar::exception);
+}
+
+TYPED_TEST(map_test, FindBatch) {
+    TypeParam map;
+    auto keys = load_keys("words.txt");
+    search_keys_batch(map, keys);
+    insert_keys(map, keys);
+    search_keys_batch(map, keys);
+}
+
+TYPED_TEST(map_test, UpdateBatch) {
+    TypeParam map;
+    auto keys = load_keys("words.txt");
+    insert_keys_batch(map, keys);
+    search_keys(map, keys);
+}
+
+TYPED_TEST(map_test, UpdateBatchSteps) {
+    // Small lambda makes many step nodes, resizing the table within the batch.
+    TypeParam map{0, 2};
+    auto keys = load_keys("words.txt");
+    insert_keys_batch(map, keys);
+    search_keys(map, keys);
+}
+
+TYPED_TEST(map_test, UpdateBatchMixed) {
+    TypeParam map;
+    auto keys = load_keys("words.txt");
+    std::vector<std::string> head(keys.begin(), keys.begin() + keys.size() / 2);
+    insert_keys(map, head);
+    insert_keys_batch(map, keys);
+    search_keys(map, keys);
+}
+
 }  // namespace
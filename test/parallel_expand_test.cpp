@@ -0,0 +1,86 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2018–2019 Shunsuke Kanda
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+// The counter of the ranges run in parallel is needed
+#define POPLAR_EXTRA_STATS
+
+#include <gtest/gtest.h>
+#include <poplar.hpp>
+
+#include "test_common.hpp"
+
+namespace {
+
+using namespace poplar;
+using namespace poplar::test;
+
+using value_type = uint64_t;
+
+// clang-format off
+using map_types = ::testing::Types<plain_bonsai_map<value_type>,
+                                   compact_bonsai_map<value_type>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type, 16, slab_allocator<1024, 1>>>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type, 32, slab_allocator<>, true>>,
+                                   map<plain_bonsai_trie<>, plain_bonsai_nlm<value_type>, true>,
+                                   map<compact_bonsai_trie<>, compact_bonsai_nlm<value_type>, true>,
+                                   map<compact_bonsai_trie<95, 2, block_dsp_table<>>, compact_bonsai_nlm<value_type>, true>
+                                   >;
+// clang-format on
+
+template <typename>
+class parallel_expand_test : public ::testing::Test {};
+
+TYPED_TEST_CASE(parallel_expand_test, map_types);
+
+// Inserts enough keys that the tables of several expansions are split into more than one grain.
+TYPED_TEST(parallel_expand_test, Words) {
+    std::vector<std::string> keys;
+    for (const std::string& word : load_keys("words.txt")) {
+        keys.push_back(word);
+        for (char suffix : {'#', '$', '%', '&', '+'}) {
+            keys.push_back(word + suffix);
+        }
+    }
+
+    const uint64_t num_forked_ranges = parallel_tools::num_forked_ranges.load();
+
+    TypeParam map;
+    map.set_num_threads(4);
+    for (uint64_t i = 0; i < keys.size(); i += 2) {
+        *map.update(make_char_range(keys[i])) = i + 1;
+    }
+    ASSERT_LE(3, map.num_resize());
+    ASSERT_LT(num_forked_ranges, parallel_tools::num_forked_ranges.load());
+
+    for (uint64_t i = 0; i < keys.size(); ++i) {
+        auto ptr = map.find(make_char_range(keys[i]));
+        if (i % 2 == 0) {
+            ASSERT_NE(ptr, nullptr);
+            ASSERT_EQ(*ptr, i + 1);
+        } else {
+            ASSERT_EQ(ptr, nullptr);
+        }
+    }
+}
+
+}  // namespace